@@ -0,0 +1,203 @@
+#include "cpu.hpp"
+#include "../logger/logger.hpp"
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+constexpr const char* CPU_TIER_ENV = "SR_CPU_TIER";  //environment variable that overrides the tier
+
+static const char* _tier_names[NUM_CPU_TIERS] = { "scalar", "sse2", "avx", "avx2", "avx512" };
+
+//global defs
+static std::once_flag _detect_once;
+static CPU_TIER _detected = CPU_SCALAR;
+static std::atomic<int> _tier(-1);  //tier in use, -1 until first asked for
+static bool _env_override = false;
+
+#ifdef CPU_X86
+/**
+* Runs cpuid
+* @param leaf: function to query
+* @param sub: sub function
+* @param regs: set to eax, ebx, ecx, edx
+*/
+static void cpuid(unsigned leaf, unsigned sub, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, (int)leaf, (int)sub);
+	for (int i = 0; i < 4; i++)
+		regs[i] = (unsigned)r[i];
+#else
+	__cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/**
+* Reads which register states the os saves on a context switch
+* Only valid if cpuid reports OSXSAVE
+* @return: XCR0
+*/
+static uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+#endif
+}
+#endif
+
+/**
+* Checks what the cpu and os support
+* @return: highest usable tier
+*/
+static CPU_TIER probe()
+{
+#ifdef CPU_X86
+	unsigned r[4];
+	cpuid(0, 0, r);
+	unsigned max_leaf = r[0];
+	if (max_leaf < 1)
+		return CPU_SCALAR;
+
+	cpuid(1, 0, r);
+	bool sse2 = (r[3] >> 26) & 1;
+	bool osxsave = (r[2] >> 27) & 1;
+	bool avx = (r[2] >> 28) & 1;
+	if (!sse2)
+		return CPU_SCALAR;
+
+	//wide registers are only usable if the os saves them
+	uint64_t xcr0 = osxsave ? xgetbv0() : 0;
+	if (!avx || (xcr0 & 0x6) != 0x6)
+		return CPU_SSE2;
+	if (max_leaf < 7)
+		return CPU_AVX;
+
+	cpuid(7, 0, r);
+	bool avx2 = (r[1] >> 5) & 1;
+	bool avx512f = (r[1] >> 16) & 1;
+	if (!avx2)
+		return CPU_AVX;
+	if (!avx512f || (xcr0 & 0xE6) != 0xE6)
+		return CPU_AVX2;
+	return CPU_AVX512;
+#else
+	return CPU_SCALAR;
+#endif
+}
+
+/**
+* Checks cpu once and applies the environment override
+*/
+static void init()
+{
+	_detected = probe();
+	CPU_TIER tier = _detected;
+	const char* env = getenv(CPU_TIER_ENV);
+	if (env != NULL && env[0] != '\0')
+	{
+		CPU_TIER t = cpu_tier_from_name(env);
+		if (t == NUM_CPU_TIERS)
+			log(WARNING, std::string("unknown cpu tier ") + env + " in " + CPU_TIER_ENV);
+		else
+		{
+			_env_override = true;
+			if (t > _detected)
+				log(WARNING, std::string("cpu tier ") + env + " not supported, using " + _tier_names[_detected]);
+			else
+				tier = t;
+		}
+	}
+	_tier = (int)tier;
+	log(DEBUG1, std::string("cpu supports ") + _tier_names[_detected] + ", using " + _tier_names[tier]);
+}
+
+/**
+* Gets highest tier the cpu and os support
+* @return: detected tier
+*/
+CPU_TIER cpu_detect()
+{
+	std::call_once(_detect_once, init);
+	return _detected;
+}
+
+/**
+* Gets tier kernels should bind to
+* @return: tier in use
+*/
+CPU_TIER cpu_tier()
+{
+	std::call_once(_detect_once, init);
+	return (CPU_TIER)_tier.load();
+}
+
+/**
+* Lowers or raises tier in use, kernels bound before this keep their old tier until rebound
+* Ignored if the tier was set through the environment
+* @param tier: tier to use, clamped to what the cpu supports
+* @return: true if tier is now in use
+*/
+bool cpu_set_tier(CPU_TIER tier)
+{
+	std::call_once(_detect_once, init);
+	if (_env_override)
+	{
+		log(WARNING, std::string("cpu tier set by ") + CPU_TIER_ENV + ", ignoring config");
+		return false;
+	}
+	if (tier < CPU_SCALAR || tier >= NUM_CPU_TIERS)
+	{
+		log(WARNING, "invalid cpu tier");
+		return false;
+	}
+	if (tier > _detected)
+	{
+		log(WARNING, std::string("cpu tier ") + _tier_names[tier] + " not supported, using " + _tier_names[_detected]);
+		_tier = (int)_detected;
+		return false;
+	}
+	_tier = (int)tier;
+	return true;
+}
+
+/**
+* Gets name of a tier
+* @param tier: tier
+* @return: name, "unknown" if out of range
+*/
+const char* cpu_tier_name(CPU_TIER tier)
+{
+	if (tier < CPU_SCALAR || tier >= NUM_CPU_TIERS)
+		return "unknown";
+	return _tier_names[tier];
+}
+
+/**
+* Parses a tier name
+* @param name: one of scalar, sse2, avx, avx2, avx512
+* @return: tier, NUM_CPU_TIERS if not a tier name
+*/
+CPU_TIER cpu_tier_from_name(const std::string& name)
+{
+	for (int i = 0; i < NUM_CPU_TIERS; i++)
+	{
+		if (!name.compare(_tier_names[i]))
+			return (CPU_TIER)i;
+	}
+	return NUM_CPU_TIERS;
+}
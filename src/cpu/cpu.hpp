@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+
+//instruction set tiers kernels can be built for, each one includes everything below it
+enum CPU_TIER
+{
+	CPU_SCALAR,
+	CPU_SSE2,
+	CPU_AVX,
+	CPU_AVX2,
+	CPU_AVX512,
+	NUM_CPU_TIERS
+};
+
+//the cpu is checked once, kernels bind their function tables to the tier picked here
+//the tier can be lowered for benchmarking from config with cpu_set_tier, or with the
+//	SR_CPU_TIER environment variable which wins over config
+//a tier above what the cpu supports is never picked
+CPU_TIER cpu_detect();
+CPU_TIER cpu_tier();
+bool cpu_set_tier(CPU_TIER tier);
+const char* cpu_tier_name(CPU_TIER tier);
+CPU_TIER cpu_tier_from_name(const std::string& name);
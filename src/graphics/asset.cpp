@@ -0,0 +1,220 @@
+#include "asset.hpp"
+#include "model.hpp"
+#include "../logger/logger.hpp"
+#include "../jobs/jobs.hpp"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <exception>
+
+//a parsed mesh and the file bytes it came from, kept so a hash match can be confirmed before sharing
+struct MeshEntry
+{
+	std::string bytes;
+	std::shared_ptr<const Model> model;
+};
+
+//global defs
+static std::mutex _cache_lk;
+static std::unordered_map<std::string, std::shared_ptr<const Model>> _paths;  //path -> mesh loaded from it
+static std::unordered_multimap<uint64_t, MeshEntry> _meshes;  //content hash -> meshes with that hash
+static std::unordered_map<std::string, AssetFuture> _loading;  //path -> load in flight
+static uint64_t _clears = 0;  //bumped by clear so loads started before it don't touch _loading after
+static size_t _requests = 0;
+
+/**
+* Finds an already loaded mesh with the exact same file contents
+* Hash and size narrow it down, the bytes are compared so a hash collision never shares the wrong mesh
+* Caller must hold _cache_lk
+* @param h: hash of contents
+* @param contents: file bytes
+* @return: matching mesh, nullptr if there is none
+*/
+static std::shared_ptr<const Model> find_mesh(uint64_t h, const std::string& contents)
+{
+	auto range = _meshes.equal_range(h);
+	for (auto m = range.first; m != range.second; ++m)
+		if (m->second.bytes.size() == contents.size() && m->second.bytes == contents)
+			return m->second.model;
+	return nullptr;
+}
+
+/**
+* Gets shared mesh data for an obj file, parsing it only the first time it is seen
+* A path that was already loaded is returned without touching the disk again
+* A new path whose contents match an already loaded file shares that file's mesh
+* Parsing happens outside the cache lock so different files can load in parallel
+* @param path: path of obj file
+* @return: shared immutable mesh, nullptr if the file could not be read
+*/
+std::shared_ptr<const Model> AssetCache::load(const std::string& path)
+{
+	//fast path, same file requested again
+	{
+		std::lock_guard<std::mutex> lk(_cache_lk);
+		_requests++;
+		auto p = _paths.find(path);
+		if (p != _paths.end())
+		{
+			log(DEBUG1, "asset cache hit: " + path);
+			return p->second;
+		}
+	}
+
+	//read whole file once so it can be hashed and parsed from memory
+	std::ifstream fstream(path.c_str(), std::ifstream::in | std::ifstream::binary);
+	if (!fstream.good())
+	{
+		log(ERR, "asset cache failed to open: " + path);
+		return nullptr;
+	}
+	std::stringstream data;
+	data << fstream.rdbuf();
+	fstream.close();
+	std::string contents = data.str();
+
+	//check if identical contents were already loaded under a different path
+	uint64_t h = hash(contents);
+	{
+		std::lock_guard<std::mutex> lk(_cache_lk);
+		std::shared_ptr<const Model> match = find_mesh(h, contents);
+		if (match)
+		{
+			log(DEBUG1, "asset cache content match: " + path);
+			_paths[path] = match;
+			return match;
+		}
+	}
+
+	//otherwise parse new mesh
+	std::istringstream in(contents);
+	std::shared_ptr<const Model> model = std::make_shared<const Model>(in, path.c_str());
+
+	//another thread may have finished the same contents first, keep whichever got there first
+	std::lock_guard<std::mutex> lk(_cache_lk);
+	std::shared_ptr<const Model> match = find_mesh(h, contents);
+	if (match)
+	{
+		_paths[path] = match;
+		return match;
+	}
+	MeshEntry entry;
+	entry.bytes.swap(contents);
+	entry.model = model;
+	_meshes.emplace(h, std::move(entry));
+	_paths[path] = model;
+	log(DEBUG1, "asset cache loaded: " + path + " (" + std::to_string(_meshes.size()) + " unique meshes)");
+	return model;
+}
+
+/**
+* Loads a mesh on the job pool
+* Requests for a path that is already loading share the same future instead of parsing twice
+* @param path: path of obj file
+* @return: future that holds the mesh once loaded (nullptr if the file could not be read or parsed)
+*/
+AssetFuture AssetCache::load_async(const std::string& path)
+{
+	std::shared_ptr<std::promise<std::shared_ptr<const Model>>> promise;
+	AssetFuture future;
+	uint64_t clears;
+	{
+		std::lock_guard<std::mutex> lk(_cache_lk);
+		auto p = _paths.find(path);
+		if (p != _paths.end())
+		{
+			//already loaded, hand back a ready future
+			std::promise<std::shared_ptr<const Model>> ready;
+			ready.set_value(p->second);
+			_requests++;
+			return ready.get_future().share();
+		}
+		auto l = _loading.find(path);
+		if (l != _loading.end())
+		{
+			_requests++;
+			return l->second;
+		}
+
+		promise = std::make_shared<std::promise<std::shared_ptr<const Model>>>();
+		future = promise->get_future().share();
+		_loading[path] = future;
+		clears = _clears;
+	}
+
+	jobs_submit([path, promise, clears]()
+		{
+			//a malformed file must not escape the job, waiters get nullptr like an unreadable one
+			std::shared_ptr<const Model> model;
+			try
+			{
+				model = AssetCache::load(path);
+			}
+			catch (const std::exception& e)
+			{
+				log(ERR, "asset cache failed to parse: " + path + " (" + e.what() + ")");
+				model = nullptr;
+			}
+
+			{
+				std::lock_guard<std::mutex> lk(_cache_lk);
+				if (_clears == clears)
+					_loading.erase(path);
+			}
+			promise->set_value(model);
+		});
+	return future;
+}
+
+/**
+* Gets number of unique meshes held by the cache
+* @return number of meshes
+*/
+size_t AssetCache::num_meshes()
+{
+	std::lock_guard<std::mutex> lk(_cache_lk);
+	return _meshes.size();
+}
+
+/**
+* Gets number of load requests made to the cache
+* @return number of requests
+*/
+size_t AssetCache::num_requests()
+{
+	std::lock_guard<std::mutex> lk(_cache_lk);
+	return _requests;
+}
+
+/**
+* Drops the cache's references to all meshes and forgets loads in flight
+* Meshes still used by a scene stay alive until the scene releases them
+* A load still running still hands its mesh to whoever holds its future, and may add it back to the cache
+*/
+void AssetCache::clear()
+{
+	std::lock_guard<std::mutex> lk(_cache_lk);
+	_paths.clear();
+	_meshes.clear();
+	_loading.clear();
+	_clears++;
+	_requests = 0;
+}
+
+/**
+* 64-bit FNV-1a hash of file contents
+* @param data: bytes to hash
+* @return: hash value
+*/
+uint64_t AssetCache::hash(const std::string& data)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		h ^= (uint8_t)data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <future>
+#include <stdint.h>
+#include "model.hpp"
+
+typedef std::shared_future<std::shared_ptr<const Model>> AssetFuture;
+
+//process wide cache of immutable mesh data
+//meshes are keyed by path and by the file contents (hash first, then a byte compare), so every scene instance
+//	of the same obj (or of a byte identical copy under another name) shares one Model
+class AssetCache
+{
+public:
+	static std::shared_ptr<const Model> load(const std::string& path);
+	static AssetFuture load_async(const std::string& path);
+	static size_t num_meshes();
+	static size_t num_requests();
+	static void clear();
+private:
+	static uint64_t hash(const std::string& data);
+};
@@ -0,0 +1,292 @@
+#include "bvh.hpp"
+#include "../logger/logger.hpp"
+#include <algorithm>
+#include <string>
+#include <math.h>
+
+/**
+* Constructor for empty tree
+*/
+Bvh::Bvh()
+{
+	built_area = 0.f;
+	area = 0.f;
+}
+
+/**
+* Builds tree from scratch, splitting each node at the median of its instance centers along its longest axis
+* @param centers: bounding sphere center of every instance in world space
+* @param radii: bounding sphere radius of every instance
+* @param active: instances to put in the tree, others are left out of every query
+*/
+void Bvh::build(const std::vector<Vec3f>& centers, const std::vector<float>& radii, const std::vector<uint8_t>& active)
+{
+	this->centers = centers;
+	this->radii = radii;
+	nodes.clear();
+	items.clear();
+	dirty.clear();
+	leaf_of.assign(centers.size(), -1);
+	for (int i = 0; i < centers.size(); i++)
+	{
+		if (active[i])
+			items.push_back(i);
+	}
+
+	built_area = 0.f;
+	area = 0.f;
+	if (items.empty())
+	{
+		node_dirty.clear();
+		return;
+	}
+
+	Node root;
+	root.first = 0;
+	root.count = (int)items.size();
+	root.left = -1;
+	root.parent = -1;
+	nodes.push_back(root);
+	split(0, 1);
+	node_dirty.assign(nodes.size(), 0);
+
+	//fit bottom up, children come after their parent
+	for (int n = (int)nodes.size() - 1; n >= 0; n--)
+	{
+		fit(n);
+		area += surface(nodes[n]);
+	}
+	built_area = area;
+	log(DEBUG2, "built bvh with " + std::to_string(nodes.size()) + " nodes over " + std::to_string(items.size()) + " instances");
+}
+
+/**
+* Moves an instance's bounds, boxes above it are grown or shrunk by the next refit
+* @param index: index of instance
+* @param center: new bounding sphere center in world space
+* @param radius: new bounding sphere radius
+*/
+void Bvh::update(int index, const Vec3f& center, float radius)
+{
+	if (index >= leaf_of.size() || leaf_of[index] < 0)
+		return;
+	centers[index] = center;
+	radii[index] = radius;
+
+	int leaf = leaf_of[index];
+	if (node_dirty[leaf])
+		return;
+	node_dirty[leaf] = 1;
+	dirty.push_back(leaf);
+	std::push_heap(dirty.begin(), dirty.end());
+}
+
+/**
+* Refits boxes of nodes above updated instances, deepest first so each node is fit once
+* Only touches nodes on paths from updated leaves to the root
+* @return: true if nodes grew far enough past how they were built that the tree should be rebuilt
+*/
+bool Bvh::refit()
+{
+	while (!dirty.empty())
+	{
+		//children always have higher indices than their parent, so the highest dirty node has no dirty children left
+		std::pop_heap(dirty.begin(), dirty.end());
+		int n = dirty.back();
+		dirty.pop_back();
+		node_dirty[n] = 0;
+
+		area -= surface(nodes[n]);
+		fit(n);
+		area += surface(nodes[n]);
+
+		int p = nodes[n].parent;
+		if (p >= 0 && !node_dirty[p])
+		{
+			node_dirty[p] = 1;
+			dirty.push_back(p);
+			std::push_heap(dirty.begin(), dirty.end());
+		}
+	}
+	return area > BVH_REBUILD_GROWTH * built_area;
+}
+
+/**
+* Checks if an instance is in the tree
+* @param index: index of instance
+*/
+bool Bvh::contains(int index) const
+{
+	return index < leaf_of.size() && leaf_of[index] >= 0;
+}
+
+/**
+* Gets number of nodes in tree
+*/
+int Bvh::num_nodes() const
+{
+	return (int)nodes.size();
+}
+
+/**
+* Gets where a ray first enters a sphere
+* @param origin: start of ray
+* @param dir: direction of ray
+* @param c: center of sphere
+* @param r: radius of sphere
+* @param t: set to distance along ray in lengths of dir, 0 if ray starts inside
+* @return: false if ray misses sphere
+*/
+static bool ray_sphere(const Vec3f& origin, const Vec3f& dir, const Vec3f& c, float r, float& t)
+{
+	Vec3f oc = origin - c;
+	float a = dir.dot(dir);
+	float b = oc.dot(dir);
+	float k = oc.dot(oc) - r * r;
+	if (k <= 0.f)
+	{
+		t = 0.f;
+		return true;
+	}
+	float disc = b * b - a * k;
+	if (b >= 0.f || disc < 0.f || a <= 0.f)
+		return false;
+	t = (-b - sqrtf(disc)) / a;
+	return true;
+}
+
+/**
+* Finds the instance whose bounding sphere a ray hits first
+* Nodes are skipped once they start past the closest hit found so far
+* @param origin: start of ray in world space
+* @param dir: direction of ray, does not need to be normalized
+* @param t: set to distance of hit along ray in lengths of dir
+* @return: index of instance hit, -1 if none
+*/
+int Bvh::raycast(const Vec3f& origin, const Vec3f& dir, float& t) const
+{
+	int best = -1;
+	float best_t = INFINITY;
+	if (nodes.empty())
+		return best;
+
+	int stack[BVH_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& n = nodes[stack[--top]];
+		float node_t;
+		if (!ray_sphere(origin, dir, (n.lo + n.hi) / 2.f, (n.hi - n.lo).value() / 2.f, node_t) || node_t >= best_t)
+			continue;
+		if (n.left >= 0)
+		{
+			stack[top++] = n.left;
+			stack[top++] = n.left + 1;
+			continue;
+		}
+		for (int k = n.first; k < n.first + n.count; k++)
+		{
+			int i = items[k];
+			float hit_t;
+			if (ray_sphere(origin, dir, centers[i], radii[i], hit_t) && hit_t < best_t)
+			{
+				best = i;
+				best_t = hit_t;
+			}
+		}
+	}
+	t = best_t;
+	return best;
+}
+
+/********************************************************************
+* Private Functions
+********************************************************************/
+/**
+* Splits a node in two at the median instance center along the longest axis of the centers,
+*	then splits the halves until they fit in a leaf
+* @param node: index of node to split
+* @param depth: depth of node, root is 1
+*/
+void Bvh::split(int node, int depth)
+{
+	int first = nodes[node].first;
+	int count = nodes[node].count;
+	if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+	{
+		for (int k = first; k < first + count; k++)
+			leaf_of[items[k]] = node;
+		return;
+	}
+
+	//longest axis of the centers, not the spheres, so large instances don't skew the split
+	Vec3f lo = centers[items[first]];
+	Vec3f hi = lo;
+	for (int k = first + 1; k < first + count; k++)
+	{
+		const Vec3f& c = centers[items[k]];
+		lo = Vec3f(fminf(lo.x, c.x), fminf(lo.y, c.y), fminf(lo.z, c.z));
+		hi = Vec3f(fmaxf(hi.x, c.x), fmaxf(hi.y, c.y), fmaxf(hi.z, c.z));
+	}
+	Vec3f ext = hi - lo;
+	int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : ((ext.y >= ext.z) ? 1 : 2);
+
+	int half = count / 2;
+	std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count, [&](int a, int b)
+		{
+			return centers[a].raw[axis] < centers[b].raw[axis];
+		});
+
+	Node left, right;
+	left.first = first;
+	left.count = half;
+	right.first = first + half;
+	right.count = count - half;
+	left.left = right.left = -1;
+	left.parent = right.parent = node;
+	int l = (int)nodes.size();
+	nodes[node].left = l;
+	nodes.push_back(left);
+	nodes.push_back(right);
+	split(l, depth + 1);
+	split(l + 1, depth + 1);
+}
+
+/**
+* Sets a node's box to fit its children, or its instances' spheres for a leaf
+* @param node: index of node
+*/
+void Bvh::fit(int node)
+{
+	Node& n = nodes[node];
+	if (n.left >= 0)
+	{
+		const Node& a = nodes[n.left];
+		const Node& b = nodes[n.left + 1];
+		n.lo = Vec3f(fminf(a.lo.x, b.lo.x), fminf(a.lo.y, b.lo.y), fminf(a.lo.z, b.lo.z));
+		n.hi = Vec3f(fmaxf(a.hi.x, b.hi.x), fmaxf(a.hi.y, b.hi.y), fmaxf(a.hi.z, b.hi.z));
+		return;
+	}
+
+	n.lo = Vec3f(INFINITY, INFINITY, INFINITY);
+	n.hi = Vec3f(-INFINITY, -INFINITY, -INFINITY);
+	for (int k = n.first; k < n.first + n.count; k++)
+	{
+		int i = items[k];
+		Vec3f c = centers[i];
+		float r = radii[i];
+		n.lo = Vec3f(fminf(n.lo.x, c.x - r), fminf(n.lo.y, c.y - r), fminf(n.lo.z, c.z - r));
+		n.hi = Vec3f(fmaxf(n.hi.x, c.x + r), fmaxf(n.hi.y, c.y + r), fmaxf(n.hi.z, c.z + r));
+	}
+}
+
+/**
+* Gets surface area of a node's box, used to tell how loose the tree has become
+* @param n: node
+*/
+float Bvh::surface(const Node& n)
+{
+	Vec3f d = n.hi - n.lo;
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
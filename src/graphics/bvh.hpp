@@ -0,0 +1,103 @@
+#pragma once
+
+#include "geom.hpp"
+#include <vector>
+#include <stdint.h>
+
+constexpr int BVH_LEAF_SIZE = 4;  //instances per leaf
+constexpr int BVH_MAX_DEPTH = 64;  //traversal stack size, median splits never get close
+constexpr float BVH_REBUILD_GROWTH = 1.5f;  //rebuild once refits grow total node surface area this far past the last build
+
+//result of testing a bounding sphere against a query volume
+enum BVH_TEST
+{
+	BVH_OUTSIDE = 0,
+	BVH_INTERSECTS = 1,
+	BVH_INSIDE = 2
+};
+
+//bounding volume hierarchy over instance bounding spheres in world space
+//nodes hold boxes, leaves hold up to BVH_LEAF_SIZE instances
+//moving instances only refits boxes bottom up, which keeps every query correct but lets nodes grow
+//	as their instances drift apart, so the owner rebuilds the tree once refit says it got too loose
+class Bvh
+{
+public:
+	Bvh();
+	void build(const std::vector<Vec3f>& centers, const std::vector<float>& radii, const std::vector<uint8_t>& active);
+	void update(int index, const Vec3f& center, float radius);
+	bool refit();
+	bool contains(int index) const;
+	int num_nodes() const;
+	int raycast(const Vec3f& origin, const Vec3f& dir, float& t) const;
+	template <class F, class V>
+	void query(const F& test, V& out) const;
+private:
+	struct Node
+	{
+		Vec3f lo, hi;
+		int first, count;  //run of items under node, leaves and inner nodes alike
+		int left;  //left child, right child follows it, -1 for leaves
+		int parent;
+	};
+	std::vector<Node> nodes;  //children always come after their parent
+	std::vector<int> items;  //instance indices, each node owns a run
+	std::vector<Vec3f> centers;  //bounds of every instance, by instance index
+	std::vector<float> radii;
+	std::vector<int> leaf_of;  //leaf holding each instance, -1 if not in tree
+	std::vector<uint8_t> node_dirty;
+	std::vector<int> dirty;  //heap of nodes waiting on refit, highest index first so children come before their parent
+	float built_area;  //node surface area right after build
+	float area;  //node surface area now
+
+	void split(int node, int depth);
+	void fit(int node);
+	static float surface(const Node& n);
+};
+
+/**
+* Collects instances whose bounding sphere passes a test
+* Each node's box is tested through its bounding sphere, a node inside the volume takes every
+*	instance under it without testing them, a node outside skips them all
+* @param test: called with a sphere center and radius, returns a BVH_TEST
+* @param out: instances passing are appended, in no particular order
+*/
+template <class F, class V>
+void Bvh::query(const F& test, V& out) const
+{
+	if (nodes.empty())
+		return;
+
+	int stack[BVH_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& n = nodes[stack[--top]];
+		Vec3f c = (n.lo + n.hi) / 2.f;
+		float r = (n.hi - n.lo).value() / 2.f;
+		int hit = test(c, r);
+		if (hit == BVH_OUTSIDE)
+			continue;
+		if (hit == BVH_INSIDE)
+		{
+			for (int k = n.first; k < n.first + n.count; k++)
+				out.push_back(items[k]);
+			continue;
+		}
+		if (n.left >= 0)
+		{
+			stack[top++] = n.left;
+			stack[top++] = n.left + 1;
+			continue;
+		}
+
+		//leaf only partly inside, test its instances one by one
+		for (int k = n.first; k < n.first + n.count; k++)
+		{
+			int i = items[k];
+			if (test(centers[i], radii[i]) != BVH_OUTSIDE)
+				out.push_back(i);
+		}
+	}
+}
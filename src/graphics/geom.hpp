@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string>
 #include <memory>
+#include <stdint.h>
 
 template <class t> struct Vec3
 {
@@ -33,7 +34,7 @@ template <class t> struct Vec3
 	//vector operations
 	inline Vec3<t> cross(const Vec3<t>& v) const { return Vec3<t>(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x); } //cross product
 	inline t dot(const Vec3<t>& v) const { return (x * v.x + y * v.y + z * v.z); } //dot product
-	float dist(const Vec3<t> v) const { return sqrtf(powf((v.x - x), 2) + powf((v.y - y), 2) + powf((v.z - z), 2)); }
+	float dist(const Vec3<t> v) const { t dx = v.x - x, dy = v.y - y, dz = v.z - z; return sqrtf(dx * dx + dy * dy + dz * dz); }
 	float value() const { return sqrtf(x * x + y * y + z * z); }
 	Vec3<t> norm() const { return *this / this->value(); }
 
@@ -44,6 +45,42 @@ template <class t> struct Vec3
 typedef Vec3<float> Vec3f;
 typedef Vec3<int>   Vec3i;
 
+//directions packed into 32 bits with an octahedral mapping, 16 bits per axis of the unfolded octahedron
+//vectors don't need to be normalized before packing, unpacking gives the point on the octahedron
+//	|x| + |y| + |z| = 1 in that direction, normalize it before using it as a unit vector
+inline uint32_t pack_normal(const Vec3f& n)
+{
+	float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if (l1 <= 0.f)
+		return 0x7FFF7FFF;  //no direction, packs as +z
+	float inv = 1.f / l1;
+	float x = n.x * inv;
+	float y = n.y * inv;
+	if (n.z < 0.f)
+	{
+		//fold the back half of the octahedron over the front
+		float fx = (1.f - fabsf(y)) * ((x >= 0.f) ? 1.f : -1.f);
+		y = (1.f - fabsf(x)) * ((y >= 0.f) ? 1.f : -1.f);
+		x = fx;
+	}
+	uint32_t px = (uint32_t)((x * 0.5f + 0.5f) * 65535.f + 0.5f);
+	uint32_t py = (uint32_t)((y * 0.5f + 0.5f) * 65535.f + 0.5f);
+	return px | (py << 16);
+}
+inline Vec3f unpack_normal(uint32_t p)
+{
+	float x = (float)(p & 0xFFFF) / 65535.f * 2.f - 1.f;
+	float y = (float)(p >> 16) / 65535.f * 2.f - 1.f;
+	float z = 1.f - fabsf(x) - fabsf(y);
+	if (z < 0.f)
+	{
+		float fx = (1.f - fabsf(y)) * ((x >= 0.f) ? 1.f : -1.f);
+		y = (1.f - fabsf(x)) * ((y >= 0.f) ? 1.f : -1.f);
+		x = fx;
+	}
+	return Vec3f(x, y, z);
+}
+
 struct Vec4f
 {
 	union
@@ -0,0 +1,83 @@
+#include "model.hpp"
+#include "geom.hpp"
+#include "../logger/logger.hpp"
+#include <vector>
+#include <string>
+
+/**
+* Bakes several meshes into one, each placed by its own transform
+* Used to draw many instances that never move as a single mesh, so per-instance work is paid once
+*	when the merged mesh is built instead of every frame
+* Vertices are recentered on the merged bounds so the result follows the same convention as a loaded
+*	mesh, meshlets are rebuilt and never span two source meshes since those share no vertices
+* The merged mesh has no simplified levels of detail
+* @param meshes: meshes to merge, full detail of each is used
+* @param vert_mats: model to world transform of each mesh
+* @param norm_mats: normal transform of each mesh
+* @param center: set to where the merged mesh has to be placed to put every part back where its transform had it
+* @return merged mesh
+*/
+std::unique_ptr<Model> Model::merge(const std::vector<const Model*>& meshes, const std::vector<Mat4x4f>& vert_mats, const std::vector<Mat4x4f>& norm_mats, Vec3f& center)
+{
+	std::unique_ptr<Model> merged(new Model());
+
+	//size lists up front
+	size_t n_verts = 0, n_norms = 0, n_faces = 0;
+	for (const Model* m : meshes)
+	{
+		n_verts += m->vertices.size();
+		n_norms += m->vert_normals.size();
+		n_faces += m->faces.size();
+	}
+	merged->vertices.reserve(n_verts);
+	merged->vert_normals.reserve(n_norms);
+	merged->face_normals.reserve(n_faces);
+	merged->faces.reserve(n_faces);
+
+	//append each mesh in world space, offsetting its indices past the meshes before it
+	for (int i = 0; i < meshes.size(); i++)
+	{
+		const Model* m = meshes[i];
+		int v_off = (int)merged->vertices.size();
+		int n_off = (int)merged->vert_normals.size();
+		for (const Vec3f& v : m->vertices)
+			merged->vertices.push_back(Vec3f(vert_mats[i] * Vec4f(v)));
+		for (const Vec3f& n : m->vert_normals)
+		{
+			Vec3f t = Vec3f(norm_mats[i] * Vec4f(n));
+			merged->vert_normals.push_back((t.value() > 0.f) ? t.norm() : t);
+		}
+		for (int f = 0; f < m->faces.size(); f++)
+		{
+			Vec3f t = Vec3f(norm_mats[i] * Vec4f(m->face_normals[f]));
+			merged->face_normals.push_back((t.value() > 0.f) ? t.norm() : t);
+			std::vector<Vec3i> face;
+			for (const Vec3i& k : m->faces[f])
+				face.push_back(Vec3i(k.i_vert + v_off, -1, k.i_norm + n_off));
+			merged->faces.push_back(face);
+		}
+	}
+
+	//recenter on the middle of the bounds, scene places meshes by their center
+	Vec3f lo, hi;
+	for (int i = 0; i < merged->vertices.size(); i++)
+	{
+		const Vec3f& v = merged->vertices[i];
+		for (int k = 0; k < 3; k++)
+		{
+			lo.raw[k] = (i == 0 || v.raw[k] < lo.raw[k]) ? v.raw[k] : lo.raw[k];
+			hi.raw[k] = (i == 0 || v.raw[k] > hi.raw[k]) ? v.raw[k] : hi.raw[k];
+		}
+	}
+	center = (lo + hi) / 2.f;
+	merged->radius = 0.f;
+	for (Vec3f& v : merged->vertices)
+	{
+		v = v - center;
+		merged->radius = (v.value() > merged->radius) ? v.value() : merged->radius;
+	}
+
+	merged->build_meshlets();
+	log(DEBUG1, "merged " + std::to_string(meshes.size()) + " meshes into " + std::to_string(merged->faces.size()) + " faces, " + std::to_string(merged->meshlets.size()) + " meshlets");
+	return merged;
+}
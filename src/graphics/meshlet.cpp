@@ -0,0 +1,123 @@
+#include "model.hpp"
+#include "geom.hpp"
+#include "../logger/logger.hpp"
+#include <vector>
+#include <deque>
+#include <string>
+#include <cmath>
+
+constexpr float MESHLET_MIN_DOT = 0.6f;  //faces must be within ~53 degrees of the seed face to join a meshlet
+
+/**
+* Partitions faces into meshlets by growing clusters out from a seed face across shared vertices
+* Only faces that point roughly the same way as the seed are taken, which keeps normal cones narrow
+*	enough for whole meshlets to be culled when they face away from the camera
+*/
+void Model::build_meshlets()
+{
+	meshlets.clear();
+
+	//faces touching each vertex, used to walk to neighbouring faces
+	std::vector<std::vector<int>> v_faces(vertices.size());
+	for (int i = 0; i < faces.size(); i++)
+	{
+		for (int k = 0; k < faces[i].size(); k++)
+			v_faces[faces[i][k].i_vert].push_back(i);
+	}
+
+	std::vector<bool> used(faces.size(), false);
+	std::vector<int> vert_mark(vertices.size(), -1);  //last meshlet a vertex was added to
+	std::vector<int> norm_mark(vert_normals.size(), -1);
+	for (int seed = 0; seed < faces.size(); seed++)
+	{
+		if (used[seed])
+			continue;
+
+		Meshlet m;
+		int id = (int)meshlets.size();
+		Vec3f seed_n = face_normals[seed];
+		std::deque<int> frontier;
+		frontier.push_back(seed);
+		while (!frontier.empty() && m.faces.size() < MESHLET_MAX_FACES)
+		{
+			int f = frontier.front();
+			frontier.pop_front();
+			if (used[f])
+				continue;
+
+			//make sure face fits in vertex budget and keeps cone narrow
+			int added = 0;
+			for (int k = 0; k < 3; k++)
+				added += (vert_mark[faces[f][k].i_vert] != id) ? 1 : 0;
+			if (m.verts.size() + added > MESHLET_MAX_VERTS)
+				continue;
+			if (f != seed && face_normals[f].dot(seed_n) < MESHLET_MIN_DOT)
+				continue;
+
+			//add face and queue its neighbours
+			used[f] = true;
+			m.faces.push_back(f);
+			for (int k = 0; k < 3; k++)
+			{
+				int v = faces[f][k].i_vert;
+				int n = faces[f][k].i_norm;
+				if (vert_mark[v] != id)
+				{
+					vert_mark[v] = id;
+					m.verts.push_back(v);
+				}
+				if (n >= 0 && norm_mark[n] != id)
+				{
+					norm_mark[n] = id;
+					m.norms.push_back(n);
+				}
+				for (int nf : v_faces[v])
+				{
+					if (!used[nf])
+						frontier.push_back(nf);
+				}
+			}
+		}
+
+		//bounding sphere around center of bounding box
+		Vec3f lo = vertices[m.verts[0]];
+		Vec3f hi = vertices[m.verts[0]];
+		for (int v : m.verts)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				lo.raw[k] = (vertices[v].raw[k] < lo.raw[k]) ? vertices[v].raw[k] : lo.raw[k];
+				hi.raw[k] = (vertices[v].raw[k] > hi.raw[k]) ? vertices[v].raw[k] : hi.raw[k];
+			}
+		}
+		m.center = (lo + hi) / 2.f;
+		m.radius = 0.f;
+		for (int v : m.verts)
+		{
+			float d = m.center.dist(vertices[v]);
+			m.radius = (d > m.radius) ? d : m.radius;
+		}
+
+		//normal cone around average face normal
+		Vec3f sum;
+		for (int f : m.faces)
+			sum = sum + face_normals[f];
+		m.cone_angle = PI;
+		if (sum.value() > 0.f)
+		{
+			m.axis = sum.norm();
+			float min_dot = 1.f;
+			for (int f : m.faces)
+			{
+				float d = m.axis.dot(face_normals[f]);
+				min_dot = (d < min_dot) ? d : min_dot;
+			}
+			if (min_dot >= -1.f) //false for faces with broken normals
+				m.cone_angle = acosf((min_dot > 1.f) ? 1.f : min_dot);
+		}
+
+		meshlets.push_back(m);
+	}
+
+	log(DEBUG1, std::to_string(faces.size()) + " faces split into " + std::to_string(meshlets.size()) + " meshlets");
+}
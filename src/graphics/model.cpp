@@ -15,14 +15,135 @@
 */
 Model::Model(const char* filename)
 {
-	log(DEBUG2, "parsing: " + std::string(filename));
+	std::ifstream fstream(filename, std::ifstream::in);
+	this->parse(fstream, filename);
+	fstream.close();
+}
+
+/**
+* Constructor for Model
+* Parses wavefront obj data that has already been read into memory (used by the asset cache)
+* @param in: stream of obj file contents
+* @param name: name of mesh for logging
+*/
+Model::Model(std::istream& in, const char* name)
+{
+	this->parse(in, name);
+}
+
+/**
+* Empty model, filled in by simplify when building levels of detail
+*/
+Model::Model()
+{
+	radius = 0.f;
+}
+
+/**
+* Destructor for model
+*/
+Model::~Model()
+{
+	//dont actually need to do anything here
+	log(DEBUG2, "destroying model");
+}
+
+/**
+* Getter for vertices
+* @return vertices of model
+*/
+const std::vector<Vec3f>& Model::get_vertices() const
+{
+	return vertices;
+}
+/**
+* Getter for texture uv coords
+* @return texture uv coords
+*/
+const std::vector<Vec3f>& Model::get_textures() const
+{
+	return textures;
+}
+/**
+* Getter for vertex normals
+* @return normals of model
+*/
+const std::vector<Vec3f>& Model::get_vert_normals() const
+{
+	return vert_normals;
+}
+/**
+* Getter for face normals
+* @return normals of model
+*/
+const std::vector<Vec3f>& Model::get_face_normals() const
+{
+	return face_normals;
+}
+/**
+* Getter for faces
+* @return faces of model
+*/
+const std::vector<std::vector<Vec3i>>& Model::get_faces() const
+{
+	return faces;
+}
+/**
+* Getter for bounding sphere radius
+* Vertices are centered on the origin, so the sphere is centered there as well
+* @return radius of model
+*/
+float Model::get_radius() const
+{
+	return radius;
+}
+/**
+* Getter for meshlets
+* @return clusters of faces covering every face of model once
+*/
+const std::vector<Meshlet>& Model::get_meshlets() const
+{
+	return meshlets;
+}
+/**
+* Gets number of levels of detail including full detail
+* @return number of levels
+*/
+int Model::num_lods() const
+{
+	return (int)lods.size() + 1;
+}
+/**
+* Gets a level of detail of this model
+* @param level: 0 for full detail, each level after has about a quarter of the faces of the one before
+* @return mesh of level, clamped to the coarsest level available
+*/
+const Model* Model::get_lod(int level) const
+{
+	if (level <= 0 || lods.empty())
+		return this;
+	if (level > (int)lods.size())
+		level = (int)lods.size();
+	return lods[level - 1].get();
+}
+/***********************************************************************************************************************
+* Private functions
+***********************************************************************************************************************/
+
+/**
+* Parses wavefront obj data into vertices, faces, and normals
+* @param in: stream of obj file contents
+* @param name: name of mesh for logging
+*/
+void Model::parse(std::istream& in, const char* name)
+{
+	log(DEBUG2, "parsing: " + std::string(name));
 	//assume vector memory allocated on heap
 
 	//start reading file
 	std::string line;
-	std::ifstream fstream(filename, std::ifstream::in);
 	float largest_vertex_val = 0.f;
-	while (std::getline(fstream, line))
+	while (std::getline(in, line))
 	{
 		std::istringstream s(line);
 		std::string t;
@@ -116,7 +237,6 @@ Model::Model(const char* filename)
 			log(DEBUG2, "ignoring: " + t);
 		}
 	}
-	fstream.close();
 
 	//do post processing pass on vertices to normalize all coordinates to -1, 1 range
 	this->normalize_verts(largest_vertex_val);
@@ -145,86 +265,48 @@ Model::Model(const char* filename)
 	}
 	center = center / vertices.size();
 	Vec3f diff = Vec3f(0.f, 0.f, 0.f) - center;
+	radius = 0.f;
 	for (int i = 0; i < vertices.size(); i++)
 	{
 		vertices[i] = vertices[i] + diff;
+		radius = (vertices[i].value() > radius) ? vertices[i].value() : radius;
 	}
 
-	//default color to white
-	color = WHITE;
+	//group faces for cluster culling
+	this->build_meshlets();
+
+	//build simplified meshes for distant instances
+	this->build_lods();
 
 	log(DEBUG1, "model creation complete");
 }
 
 /**
-* Destructor for model
+* Builds chain of simplified meshes, each level targets a quarter of the faces of the level before
+* A level is picked every time the projected radius halves, so a quarter of the faces matches a quarter of the pixels
+* Stops once a level gets too small or simplification stops making progress
 */
-Model::~Model()
+void Model::build_lods()
 {
-	//dont actually need to do anything here
-	log(DEBUG2, "destroying model");
-}
+	const Model* prev = this;
+	while (lods.size() + 1 < MAX_LODS)
+	{
+		int target = (int)prev->faces.size() / LOD_FACE_RATIO;
+		if (target < MIN_LOD_FACES)
+			break;
 
-/**
-* Setter for color of model
-* @param color: hex value of color to set
-*/
-void Model::set_color(COLOR color)
-{
-	this->color = color;
-}
-/**
-* Getter for color of model
-* @return: hex value of model color
-*/
-COLOR Model::get_color() const
-{
-	return color;
-}
+		std::unique_ptr<Model> lod = prev->simplify(target);
+		if (lod->faces.size() * 4 > prev->faces.size() * 3)
+		{
+			log(DEBUG1, "simplification stalled at " + std::to_string(lod->faces.size()) + " faces");
+			break;
+		}
 
-/**
-* Getter for vertices
-* @return vertices of model
-*/
-std::vector<Vec3f>& Model::get_vertices()
-{
-	return vertices;
-}
-/**
-* Getter for texture uv coords
-* @return texture uv coords
-*/
-std::vector<Vec3f>& Model::get_textures()
-{
-	return textures;
-}
-/**
-* Getter for vertex normals
-* @return normals of model
-*/
-std::vector<Vec3f>& Model::get_vert_normals()
-{
-	return vert_normals;
-}
-/**
-* Getter for face normals
-* @return normals of model
-*/
-std::vector<Vec3f>& Model::get_face_normals()
-{
-	return face_normals;
-}
-/**
-* Getter for faces
-* @return faces of model
-*/
-std::vector<std::vector<Vec3i>>& Model::get_faces()
-{
-	return faces;
+		log(DEBUG1, "lod " + std::to_string(lods.size() + 1) + ": " + std::to_string(lod->faces.size()) + " faces");
+		lods.push_back(std::move(lod));
+		prev = lods.back().get();
+	}
 }
-/***********************************************************************************************************************
-* Private functions
-***********************************************************************************************************************/
 
 /**
 * Normalize all vertices to [-1, 1]
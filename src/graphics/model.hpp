@@ -5,33 +5,65 @@
 #include <stdio.h>
 #include <string>
 #include <memory>
+#include <istream>
 #include "geom.hpp"
 #include "../window/window.hpp"
 
 constexpr float PI = 3.14159265358979323846f;
+constexpr int MAX_LODS = 8;  //full detail plus up to 7 simplified levels, only huge meshes get that far before MIN_LOD_FACES
+constexpr int MIN_LOD_FACES = 32;  //stop simplifying below this many faces
+constexpr int LOD_FACE_RATIO = 4;  //each level keeps 1 / ratio of the faces of the level before
+constexpr int MESHLET_MAX_FACES = 124;  //meshlets are closed once they hit either limit
+constexpr int MESHLET_MAX_VERTS = 64;
 
+//cluster of neighbouring faces with bounds, lets the scene cull whole groups of faces
+//	before their vertices are transformed
+struct Meshlet
+{
+	std::vector<int> faces;  //indices into faces of model
+	std::vector<int> verts;  //unique vertex indices used by faces
+	std::vector<int> norms;  //unique vertex normal indices used by faces
+	Vec3f center;  //bounding sphere
+	float radius;
+	Vec3f axis;  //normal cone, every face normal is within cone_angle of axis
+	float cone_angle;  //half angle in rads, PI if faces point every direction
+};
+
+//immutable mesh data, shared between every scene instance that uses it
+//per-instance state (color, transform, rotation) lives on the scene
 class Model
 {
 private:
-	COLOR color;
 	std::vector<Vec3f> vertices;
 	std::vector<Vec3f> textures;
 	std::vector<Vec3f> vert_normals;
 	std::vector<Vec3f> face_normals;
 	std::vector<std::vector<Vec3i>> faces;
+	float radius;  //bounding sphere radius around local origin
+	std::vector<std::unique_ptr<Model>> lods;  //simplified levels of detail, [0] is level 1
+	std::vector<Meshlet> meshlets;
+	Model();
+	void parse(std::istream& in, const char* name);
 	void normalize_verts(float largest);
 	void add_normals();
 	void process_faces();
 	bool is_valid_ear(Triangle t, int i, int a, int b, int c, Vec3f center);
+	void build_lods();
+	std::unique_ptr<Model> simplify(int target_faces) const;  //defined in simplify.cpp
+	void build_meshlets();  //defined in meshlet.cpp
 	
 public:
 	Model(const char* filepath);
+	Model(std::istream& in, const char* name);
 	~Model();
-	void set_color(COLOR color);
-	COLOR get_color() const;
-	std::vector<Vec3f>& get_vertices();
-	std::vector<Vec3f>& get_textures();
-	std::vector<Vec3f>& get_vert_normals();
-	std::vector<Vec3f>& get_face_normals();
-	std::vector<std::vector<Vec3i>>& get_faces();
+	const std::vector<Vec3f>& get_vertices() const;
+	const std::vector<Vec3f>& get_textures() const;
+	const std::vector<Vec3f>& get_vert_normals() const;
+	const std::vector<Vec3f>& get_face_normals() const;
+	const std::vector<std::vector<Vec3i>>& get_faces() const;
+	float get_radius() const;
+	const std::vector<Meshlet>& get_meshlets() const;
+	int num_lods() const;
+	const Model* get_lod(int level) const;
+	static std::unique_ptr<Model> merge(const std::vector<const Model*>& meshes, const std::vector<Mat4x4f>& vert_mats, const std::vector<Mat4x4f>& norm_mats, Vec3f& center);  //defined in merge.cpp
 };
\ No newline at end of file
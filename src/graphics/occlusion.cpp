@@ -0,0 +1,139 @@
+#include "occlusion.hpp"
+#include <math.h>
+
+/**
+* Constructor for empty buffer, clear before use
+*/
+OcclusionBuffer::OcclusionBuffer()
+{
+	width = 0;
+	height = 0;
+	cell_w = 1.f;
+	cell_h = 1.f;
+}
+
+/**
+* Empties buffer for a new frame
+* @param width: width of screen in pixels
+* @param height: height of screen in pixels
+*/
+void OcclusionBuffer::clear(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	cell_w = (float)width / (float)OCCLUSION_WIDTH;
+	cell_h = (float)height / (float)OCCLUSION_HEIGHT;
+	depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.f);
+}
+
+/**
+* Adds occluder triangles to buffer
+* @param tris: triangles in screen space, as handed to the raster stage
+* @param num_tris: number of triangles
+*/
+void OcclusionBuffer::raster(const ScreenTri* tris, int num_tris)
+{
+	for (int i = 0; i < num_tris; i++)
+		raster(tris[i]);
+}
+
+/**
+* Checks if a screen rectangle is hidden behind the occluders
+* @param x_min: left pixel of rectangle
+* @param y_min: lowest row of rectangle
+* @param x_max: right pixel of rectangle
+* @param y_max: highest row of rectangle
+* @param depth: nearest depth of anything drawn inside rectangle
+* @return: true if every cell the rectangle touches is covered by an occluder closer than depth
+*/
+bool OcclusionBuffer::occluded(int x_min, int y_min, int x_max, int y_max, float depth) const
+{
+	x_min = (x_min < 0) ? 0 : x_min;
+	y_min = (y_min < 0) ? 0 : y_min;
+	x_max = (x_max > width - 1) ? width - 1 : x_max;
+	y_max = (y_max > height - 1) ? height - 1 : y_max;
+	if (x_min > x_max || y_min > y_max)
+		return false;
+
+	int cx0 = (int)((float)x_min / cell_w);
+	int cx1 = (int)((float)x_max / cell_w);
+	int cy0 = (int)((float)y_min / cell_h);
+	int cy1 = (int)((float)y_max / cell_h);
+	cx1 = (cx1 > OCCLUSION_WIDTH - 1) ? OCCLUSION_WIDTH - 1 : cx1;
+	cy1 = (cy1 > OCCLUSION_HEIGHT - 1) ? OCCLUSION_HEIGHT - 1 : cy1;
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		const float* row = &this->depth[cy * OCCLUSION_WIDTH];
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			if (row[cx] + OCCLUSION_BIAS >= depth)
+				return false;
+		}
+	}
+	return true;
+}
+
+/********************************************************************
+* Private Functions
+********************************************************************/
+/**
+* Writes one triangle into the cells it fully covers
+* A cell counts as covered once its corners, pushed out by a pixel so edge rounding of the raster stage
+*	can't matter, are all strictly inside, the triangle is convex so everything between them is too
+* Depth is a plane over the screen, so its farthest point in a cell is at one of the corners
+* @param tri: triangle in screen space
+*/
+void OcclusionBuffer::raster(const ScreenTri& tri)
+{
+	//doubles keep edge tests exact enough at any screen size
+	double x0 = tri.x[0], y0 = tri.y[0];
+	double x1 = tri.x[1], y1 = tri.y[1];
+	double x2 = tri.x[2], y2 = tri.y[2];
+	double area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+	if (area == 0.0)
+		return;
+	double sign = (area > 0.0) ? 1.0 : -1.0;
+
+	//depth plane, z = z0 + dz_dx * (x - x0) + dz_dy * (y - y0)
+	double dz1 = tri.z[1] - tri.z[0];
+	double dz2 = tri.z[2] - tri.z[0];
+	double dz_dx = (dz1 * (y2 - y0) - (y1 - y0) * dz2) / area;
+	double dz_dy = ((x1 - x0) * dz2 - dz1 * (x2 - x0)) / area;
+
+	//cells under bounding box
+	double bx0 = fmin(fmin(x0, x1), x2), bx1 = fmax(fmax(x0, x1), x2);
+	double by0 = fmin(fmin(y0, y1), y2), by1 = fmax(fmax(y0, y1), y2);
+	int cx0 = (int)floor(bx0 / cell_w), cx1 = (int)floor(bx1 / cell_w);
+	int cy0 = (int)floor(by0 / cell_h), cy1 = (int)floor(by1 / cell_h);
+	cx0 = (cx0 < 0) ? 0 : cx0;
+	cy0 = (cy0 < 0) ? 0 : cy0;
+	cx1 = (cx1 > OCCLUSION_WIDTH - 1) ? OCCLUSION_WIDTH - 1 : cx1;
+	cy1 = (cy1 > OCCLUSION_HEIGHT - 1) ? OCCLUSION_HEIGHT - 1 : cy1;
+
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		double ys[2] = { cy * (double)cell_h - 1.0, (cy + 1) * (double)cell_h + 1.0 };
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			double xs[2] = { cx * (double)cell_w - 1.0, (cx + 1) * (double)cell_w + 1.0 };
+			bool inside = true;
+			double z_far = 0.0;
+			for (int k = 0; k < 4 && inside; k++)
+			{
+				double px = xs[k & 1];
+				double py = ys[k >> 1];
+				double e0 = sign * ((x1 - x0) * (py - y0) - (y1 - y0) * (px - x0));
+				double e1 = sign * ((x2 - x1) * (py - y1) - (y2 - y1) * (px - x1));
+				double e2 = sign * ((x0 - x2) * (py - y2) - (y0 - y2) * (px - x2));
+				inside = e0 > 0.0 && e1 > 0.0 && e2 > 0.0;
+				double z = tri.z[0] + dz_dx * (px - x0) + dz_dy * (py - y0);
+				z_far = (z > z_far) ? z : z_far;
+			}
+			if (!inside)
+				continue;
+
+			float& cell = depth[cy * OCCLUSION_WIDTH + cx];
+			cell = ((float)z_far < cell) ? (float)z_far : cell;
+		}
+	}
+}
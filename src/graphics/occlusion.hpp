@@ -0,0 +1,27 @@
+#pragma once
+
+#include "pipeline.hpp"
+#include <vector>
+
+constexpr int OCCLUSION_WIDTH = 256;  //cells across the whole screen
+constexpr int OCCLUSION_HEIGHT = 128;
+constexpr float OCCLUSION_BIAS = 1e-4f;  //depth margin for interpolation error, only ever keeps more instances
+
+//low resolution depth buffer of occluder triangles, covering the whole screen
+//a cell is only written once a triangle covers all of it, and then holds the farthest depth of the
+//	triangle inside the cell, so every pixel of the cell ends up at least that close once drawn
+//anything entirely behind every cell it touches can be dropped without changing the frame
+class OcclusionBuffer
+{
+public:
+	OcclusionBuffer();
+	void clear(int width, int height);
+	void raster(const ScreenTri* tris, int num_tris);
+	bool occluded(int x_min, int y_min, int x_max, int y_max, float depth) const;
+private:
+	std::vector<float> depth;  //OCCLUSION_WIDTH * OCCLUSION_HEIGHT cells, 1 where nothing covers the cell
+	int width, height;  //size of screen in pixels
+	float cell_w, cell_h;  //size of cell in pixels
+
+	void raster(const ScreenTri& tri);
+};
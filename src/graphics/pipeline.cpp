@@ -0,0 +1,314 @@
+#include "pipeline.hpp"
+#include "../jobs/jobs.hpp"
+#include "../logger/logger.hpp"
+#include "../memory/alloc.hpp"
+#include "../logger/stats.hpp"
+#include "simd.hpp"
+#include <string>
+#include <atomic>
+
+constexpr int RASTER_BAND_ROWS = 32;  //rows of the screen each raster job owns
+static_assert(RASTER_BAND_ROWS % CLEAR_TILE == 0, "bands must not share rows of clear tiles");
+constexpr int LIGHT_RUN = 64;  //drawn pixels gathered per call of the shade kernel
+
+/**
+* Readies the back buffer for a frame list
+* A list that redraws only some rows starts from the last presented frame with those rows cleared,
+*	anything else starts from a cleared buffer
+* Draw lock must be held
+* @param frame: frame about to be drawn
+*/
+void clear_frame(const FrameList& frame)
+{
+	if (frame.is_partial() && window_reuse_frame(frame.y_lo, frame.y_hi))
+		return;
+	if (frame.is_partial())
+		log(WARNING, "no previous frame to redraw rows over, drawing partial frame on a cleared buffer");
+	window_clear();
+}
+
+/**
+* Lights a run of drawn pixels of a deferred frame, same rule as lighting a vertex
+* @param frame: frame being drawn
+* @param buf: back buffer, albedo of each pixel is replaced with its lit color
+* @param index: pixel of each entry
+* @param pos: camera coords of each pixel
+* @param norms: unpacked normal of each pixel, normalized in place
+* @param count: pixels in run, at most LIGHT_RUN
+*/
+static void light_run(const FrameList& frame, COLOR* buf, const int* index, const Vec3f* pos, Vec3f* norms, int count)
+{
+	float shade[LIGHT_RUN];
+	simd_normalize(norms, norms, count);
+	simd_shade(frame.lights.data(), (int)frame.lights.size(), pos, norms, shade, count);
+	for (int i = 0; i < count; i++)
+	{
+		COLOR& c = buf[index[i]];
+		if (shade[i] <= 0.f)
+			c = 0x0;
+		else if (shade[i] < 1.f)
+			c = c * shade[i];
+	}
+}
+
+/**
+* Lighting pass of a deferred frame over a band of rows, once every triangle reaching the band is filled
+* Pixels in front of the cleared depth were drawn this frame and hold their albedo, their camera coords
+*	come back from depth through the projection, so each light is evaluated once per visible pixel
+*	however many triangles were drawn over it
+* @param frame: frame being drawn
+* @param y_lo: first row of band
+* @param y_hi: last row of band
+* @return: number of pixels lit
+*/
+static int light_rows(const FrameList& frame, int y_lo, int y_hi)
+{
+	COLOR* buf = get_buf();
+	const float* z_buf = get_z_buf();
+	const uint32_t* normal_buf = get_normal_buf();
+	int width = frame.width;
+	int index[LIGHT_RUN];
+	Vec3f pos[LIGHT_RUN];
+	Vec3f norms[LIGHT_RUN];
+	int lit = 0;
+
+	//pixel centers back to the [-1, 1] range vertices were projected to, then to camera coords at depth 1
+	float step_x = 2.f / ((float)width * frame.proj_x);
+	float start_x = (1.f / (float)width - 1.f) / frame.proj_x;
+	float near_q = frame.proj_znear * frame.proj_q;
+
+	//runs carry over between rows, short runs would leave most pixels to the kernel's one at a time tail
+	int count = 0;
+	for (int y = y_lo; y <= y_hi; y++)
+	{
+		float ray_y = (((float)y + 0.5f) * 2.f / (float)frame.height - 1.f) / frame.proj_y;
+		for (int x = 0; x < width; x++)
+		{
+			int p = y * width + x;
+			float depth = z_buf[p];
+			if (depth >= 1.f)
+				continue;
+			float z = near_q / (frame.proj_q - depth);
+			index[count] = p;
+			pos[count] = Vec3f((start_x + step_x * (float)x) * z, ray_y * z, z);
+			norms[count] = unpack_normal(normal_buf[p]);
+			if (++count == LIGHT_RUN)
+			{
+				light_run(frame, buf, index, pos, norms, count);
+				lit += count;
+				count = 0;
+			}
+		}
+	}
+	light_run(frame, buf, index, pos, norms, count);
+	lit += count;
+	return lit;
+}
+
+/**
+* Draws every triangle of a frame list into the back buffer
+* Filled triangles are split across the job pool in bands of rows, each band walks the list in order
+*	and only touches its own rows, so the result is the same as drawing the list front to back on one thread
+* Only bands overlapping the rows of the list are drawn, clipped to those rows
+* Pixels drawn over ones already drawn this frame are counted as overdraw, lists sorted front to back keep it low
+* With a depth prepass each band fills depth for every triangle first, then colors only the pixels each
+*	triangle won, so no pixel is colored more than once whatever the order
+* Deferred frames fill albedo and normals, then each band lights its own pixels once its triangles are done,
+*	so lighting costs the same per pixel however much geometry was drawn
+* Wireframe lines are drawn on the calling thread, wireframe lists always cover every row
+* Draw lock must be held
+* @param frame: triangles to draw
+*/
+void raster_frame(const FrameList& frame)
+{
+	AllocScope scope(ALLOC_DRAW);
+
+	//features are fixed for the whole frame, so pick the compiled loop once instead of per pixel
+	RasterState state(frame.depth_test, !frame.flat);
+	if (frame.wireframe)
+	{
+		LineFunc line = get_line_func(state);
+		for (const ScreenTri& t : frame.tris)
+		{
+			line(t.x[0], t.y[0], t.z[0], t.x[1], t.y[1], t.z[1], t.color[0], t.color[0]);
+			line(t.x[1], t.y[1], t.z[1], t.x[2], t.y[2], t.z[2], t.color[0], t.color[0]);
+			line(t.x[2], t.y[2], t.z[2], t.x[0], t.y[0], t.z[0], t.color[0], t.color[0]);
+		}
+		return;
+	}
+
+	bool prepass = frame.depth_prepass && frame.depth_test;
+	FillFunc fill = get_fill_func(RasterState(frame.depth_test, !frame.flat, prepass ? PASS_SHADE : PASS_FULL, frame.deferred));
+	FillFunc fill_depth = get_fill_func(RasterState(true, false, PASS_DEPTH));
+	int row_lo = max(frame.y_lo, 0);
+	int row_hi = min(frame.y_hi, frame.height - 1);
+	if (row_hi < row_lo)
+		return;
+	std::atomic<int> overdrawn(0);
+	std::atomic<int> lit(0);
+	jobs_parallel_for(row_lo / RASTER_BAND_ROWS, row_hi / RASTER_BAND_ROWS + 1, 1, [&frame, &overdrawn, &lit, fill, fill_depth, prepass, row_lo, row_hi](int begin, int end)
+		{
+			AllocScope scope(ALLOC_DRAW);  //runs on a worker
+			int band_overdrawn = 0;
+			int band_lit = 0;
+			for (int b = begin; b < end; b++)
+			{
+				int y_lo = max(b * RASTER_BAND_ROWS, row_lo);
+				int y_hi = min(b * RASTER_BAND_ROWS + RASTER_BAND_ROWS - 1, row_hi);
+				if (prepass)
+				{
+					for (const ScreenTri& t : frame.tris)
+					{
+						int t_lo = min(min(t.y[0], t.y[1]), t.y[2]);
+						int t_hi = max(max(t.y[0], t.y[1]), t.y[2]);
+						if (t_hi < y_lo || t_lo > y_hi)
+							continue;
+						fill_depth(t.x[0], t.y[0], t.z[0], t.x[1], t.y[1], t.z[1], t.x[2], t.y[2], t.z[2], t.color[0], t.color[1], t.color[2], t.normal, y_lo, y_hi);
+					}
+				}
+				for (const ScreenTri& t : frame.tris)
+				{
+					int t_lo = min(min(t.y[0], t.y[1]), t.y[2]);
+					int t_hi = max(max(t.y[0], t.y[1]), t.y[2]);
+					if (t_hi < y_lo || t_lo > y_hi)
+						continue;
+					band_overdrawn += fill(t.x[0], t.y[0], t.z[0], t.x[1], t.y[1], t.z[1], t.x[2], t.y[2], t.z[2], t.color[0], t.color[1], t.color[2], t.normal, y_lo, y_hi);
+				}
+				if (frame.deferred)
+					band_lit += light_rows(frame, y_lo, y_hi);
+			}
+			overdrawn += band_overdrawn;
+			lit += band_lit;
+		});
+	stats_set("overdrawn pixels", (double)overdrawn.load());
+	if (frame.deferred)
+		stats_set("lit pixels", (double)lit.load());
+}
+
+/**
+* Starts raster thread
+* @param depth: number of finished frame lists allowed to wait for the raster stage, at least 1
+*/
+FramePipeline::FramePipeline(int depth)
+{
+	this->depth = (depth < 1) ? 1 : depth;
+	running = true;
+	dropped = 0;
+	queue.resize(this->depth);
+	head = 0;
+	count = 0;
+	free_lists.reserve(this->depth + 2);
+	raster_thread = std::thread(&FramePipeline::raster_loop, this);
+	log(DEBUG1, "frame pipeline started with depth " + std::to_string(this->depth));
+}
+
+/**
+* Stops raster thread if still running
+*/
+FramePipeline::~FramePipeline()
+{
+	stop();
+}
+
+/**
+* Gets an empty frame list for the geometry stage, reusing one the raster stage is done with if possible
+* @return: frame list to fill
+*/
+std::unique_ptr<FrameList> FramePipeline::acquire()
+{
+	std::lock_guard<std::mutex> l(lk);
+	if (free_lists.empty())
+		return std::unique_ptr<FrameList>(new FrameList());
+	std::unique_ptr<FrameList> frame = std::move(free_lists.back());
+	free_lists.pop_back();
+	return frame;
+}
+
+/**
+* Hands a finished frame list to the raster stage
+* Blocks while depth lists are already waiting
+* @param frame: filled frame list, must not be touched afterwards
+*/
+void FramePipeline::submit(std::unique_ptr<FrameList> frame)
+{
+	std::unique_lock<std::mutex> l(lk);
+	cv.wait(l, [this] { return !running || count < depth; });
+	if (!running)
+		return;
+	queue[(head + count) % depth] = std::move(frame);
+	count++;
+	cv.notify_all();
+}
+
+/**
+* Stops raster thread, frames still waiting are thrown away
+*/
+void FramePipeline::stop()
+{
+	{
+		std::lock_guard<std::mutex> l(lk);
+		if (!running)
+			return;
+		running = false;
+	}
+	cv.notify_all();
+	raster_thread.join();
+	log(DEBUG1, "frame pipeline stopped, " + std::to_string(dropped) + " frames dropped");
+}
+
+/**
+* Gets number of frame lists allowed to wait for the raster stage
+* @return depth
+*/
+int FramePipeline::get_depth() const
+{
+	return depth;
+}
+
+/**
+* Gets number of frames thrown away because the buffers were reallocated after their geometry ran
+* @return dropped frames
+*/
+size_t FramePipeline::num_dropped() const
+{
+	std::lock_guard<std::mutex> l(lk);
+	return dropped;
+}
+
+/**
+* Raster stage, draws and presents each frame list in the order it was submitted
+*/
+void FramePipeline::raster_loop()
+{
+	while (1)
+	{
+		std::unique_ptr<FrameList> frame;
+		{
+			std::unique_lock<std::mutex> l(lk);
+			cv.wait(l, [this] { return !running || count > 0; });
+			if (!running)
+				return;
+			frame = std::move(queue[head]);
+			head = (head + 1) % depth;
+			count--;
+		}
+		//geometry stage may continue now that a slot is free
+		cv.notify_all();
+
+		//present while still holding the lock so a resize cannot swap buffers out from under the handoff
+		//a list built against other buffers is dropped, the geometry stage redraws everything once it sees the change
+		draw_lock();
+		bool stale = frame->width != get_buf_width() || frame->height != get_buf_height() || frame->chain != get_chain_id();
+		if (!stale)
+		{
+			clear_frame(*frame);
+			raster_frame(*frame);
+			window_present();
+		}
+		draw_unlock();
+
+		std::lock_guard<std::mutex> l(lk);
+		dropped += stale ? 1 : 0;
+		free_lists.push_back(std::move(frame));
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "../window/window.hpp"
+#include "geom.hpp"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+//triangle already in screen pixels with lighting applied to each vertex
+//	deferred frames leave vertex colors unlit and light the pixels once drawn, from each vertex's normal
+struct ScreenTri
+{
+	int x[3], y[3];
+	float z[3];
+	COLOR color[3];
+	uint32_t normal[3];  //packed camera space normal of each vertex, only set for deferred frames
+};
+
+//everything the raster stage needs to draw one frame
+//filled by Scene::build_frame, then never modified once handed to the raster stage
+struct FrameList
+{
+	std::vector<ScreenTri> tris;
+	int width, height;  //buffer size the triangles were projected for
+	unsigned chain;  //id of the buffers the list was built against, see get_chain_id
+	int y_lo, y_hi;  //rows drawn, rows outside are kept from the previous frame, tris only holds what reaches these rows
+	bool wireframe;
+	bool depth_test;  //skip pixels behind ones already drawn
+	bool flat;  //one color per triangle, vertex colors are not blended
+	bool depth_prepass;  //fill depth of every triangle before coloring, only with the depth test on
+
+	//deferred frames fill albedo, depth and normal of every pixel, then light each drawn pixel once
+	//	positions come back from depth through the projection, so nothing else is stored per pixel
+	bool deferred;
+	std::vector<Vec3f> lights;  //lights in camera coords, only read by deferred frames
+	float proj_x, proj_y;  //projection scale of camera x and y
+	float proj_q, proj_znear;  //projection of camera z to depth, depth = q - znear * q / z
+
+	FrameList() { width = 0; height = 0; chain = 0; y_lo = 0; y_hi = -1; wireframe = false; depth_test = true; flat = false; depth_prepass = false;
+		deferred = false; proj_x = 1.f; proj_y = 1.f; proj_q = 1.f; proj_znear = 0.f; }
+	bool is_partial() const { return y_lo > 0 || y_hi < height - 1; }
+};
+
+void clear_frame(const FrameList& frame);
+void raster_frame(const FrameList& frame);
+
+//two stage frame pipeline
+//the calling thread runs geometry for frame N+1 while a raster thread draws and presents frame N
+//at most depth finished lists wait between the stages, once full the geometry stage blocks
+//	every waiting list adds one frame of latency between input and the frame showing it,
+//	so depth 1 costs exactly one frame compared to running the stages in order
+class FramePipeline
+{
+public:
+	FramePipeline(int depth);
+	~FramePipeline();
+	std::unique_ptr<FrameList> acquire();
+	void submit(std::unique_ptr<FrameList> frame);
+	void stop();
+	int get_depth() const;
+	size_t num_dropped() const;
+private:
+	int depth;
+	bool running;
+	size_t dropped;  //frames thrown away because the buffers were reallocated after their geometry ran
+	std::vector<std::unique_ptr<FrameList>> queue;  //ring of depth slots, so handing off a frame never allocates
+	int head;  //slot of oldest waiting list
+	int count;  //lists waiting
+	std::vector<std::unique_ptr<FrameList>> free_lists;  //lists handed back by raster stage for reuse
+	mutable std::mutex lk;
+	std::condition_variable cv;
+	std::thread raster_thread;
+
+	void raster_loop();
+};
@@ -1,7 +1,13 @@
 #include "proc.hpp"
 #include "render.hpp"
 #include "geom.hpp"
+#include "asset.hpp"
+#include "simd.hpp"
+#include "../cpu/cpu.hpp"
+#include "../jobs/jobs.hpp"
+#include "../memory/alloc.hpp"
 #include "../logger/logger.hpp"
+#include "../logger/stats.hpp"
 #include "../window/window.hpp"
 #include <iostream>
 #include <string>
@@ -13,6 +19,9 @@ extern volatile bool g_alive;
 extern volatile bool g_exit_error;
 extern volatile bool g_resize;
 
+constexpr int ALLOC_WARMUP_FRAMES = 8;  //frames allowed to size buffers before debug builds expect no heap allocations
+constexpr int IDLE_WAIT_MS = 50;  //longest sleep while nothing changes, bounds how late a finished mesh load shows up
+
 /**
 * Reads provided config file to determine layout of scene
 * Constructor for this class
@@ -25,6 +34,24 @@ extern volatile bool g_resize;
 */
 Proc::Proc(const char* config)
 {
+	//models are collected while reading and loaded once the job pool is configured
+	struct ModelDef
+	{
+		std::string path;
+		Vec3f pos;
+		float scale;
+		COLOR color;
+		bool is_static;
+	};
+	std::vector<ModelDef> defs;
+	int workers = 0;
+	bool affinity = false;
+	bool wait_loads = false;
+	int pipeline_depth = 0;
+	alloc_check = 1;
+	fps_cap = 0;
+	animating = true;
+
 	//read config file to determine layout of scene
 	std::string line;
 	std::ifstream fstream(config, std::ifstream::in);
@@ -67,6 +94,111 @@ Proc::Proc(const char* config)
 			s >> cam_light;
 			scene->set_cam_light(cam_light);
 		}
+		else if (!t.compare("depth_test"))
+		{
+			bool depth_test;
+			s >> depth_test;
+			scene->set_depth_test(depth_test);
+		}
+		else if (!t.compare("depth_prepass"))
+		{
+			bool depth_prepass;
+			s >> depth_prepass;
+			scene->set_depth_prepass(depth_prepass);
+		}
+		else if (!t.compare("deferred"))
+		{
+			bool deferred;
+			s >> deferred;
+			scene->set_deferred(deferred);
+		}
+		else if (!t.compare("flat_shading"))
+		{
+			bool flat_shading;
+			s >> flat_shading;
+			scene->set_flat_shading(flat_shading);
+		}
+		else if (!t.compare("lod_hysteresis"))
+		{
+			float levels;
+			s >> levels;
+			scene->set_lod_hysteresis(levels);
+		}
+		else if (!t.compare("swap_buffers"))
+		{
+			int count;
+			s >> count;
+			if (window_set_buffers(count) != 0)
+			{
+				log(ERR, "Failed to allocate swap chain");
+				g_exit_error = true;
+				g_alive = false;
+			}
+		}
+		else if (!t.compare("pipeline_depth"))
+		{
+			s >> pipeline_depth;
+		}
+		else if (!t.compare("workers"))
+		{
+			s >> workers;
+		}
+		else if (!t.compare("worker_affinity"))
+		{
+			s >> affinity;
+		}
+		else if (!t.compare("wait_loads"))
+		{
+			s >> wait_loads;
+		}
+		else if (!t.compare("alloc_check"))
+		{
+			s >> alloc_check;
+		}
+		else if (!t.compare("fps_cap"))
+		{
+			s >> fps_cap;
+			fps_cap = (fps_cap < 0) ? 0 : fps_cap;
+		}
+		else if (!t.compare("static_batching"))
+		{
+			bool static_batching;
+			s >> static_batching;
+			scene->set_static_batching(static_batching);
+		}
+		else if (!t.compare("occlusion_culling"))
+		{
+			bool occlusion_culling;
+			s >> occlusion_culling;
+			scene->set_occlusion_culling(occlusion_culling);
+		}
+		else if (!t.compare("depth_sort"))
+		{
+			bool depth_sort;
+			s >> depth_sort;
+			scene->set_depth_sort(depth_sort);
+		}
+		else if (!t.compare("animate"))
+		{
+			s >> animating;
+		}
+		else if (!t.compare("frame_budget"))
+		{
+			double budget_ms = 0.0;
+			float min_scale = 0.5f;
+			s >> budget_ms >> min_scale;
+			window_set_frame_budget(budget_ms, min_scale);
+		}
+		else if (!t.compare("cpu_tier"))
+		{
+			std::string name;
+			s >> name;
+			CPU_TIER tier = cpu_tier_from_name(name);
+			if (tier != NUM_CPU_TIERS)
+				cpu_set_tier(tier);
+			else if (name.compare("auto"))
+				log(WARNING, "Unknown cpu tier " + name + ", using detected tier");
+		}
 		else if (!t.compare("light"))
 		{
 			Vec3f light;
@@ -105,11 +237,46 @@ Proc::Proc(const char* config)
 			}
 			s >> scale;
 
-			//add model to scene
-			scene->reg_model(std::shared_ptr<Model>(new Model(path.c_str())), pos, scale, color);
+			//optional trailing flag for models that never move
+			std::string flag;
+			s >> flag;
+
+			ModelDef def;
+			def.path = path;
+			def.pos = pos;
+			def.scale = scale;
+			def.color = color;
+			def.is_static = !flag.compare("static");
+			defs.push_back(def);
 			positions.push_back(pos);
+			static_models.push_back(def.is_static);
 		}
 	}
+
+	//bind vector kernels once the tier is final, before anything can run them
+	simd_bind();
+	raster_bind();
+	stats_set_text("cpu tier", cpu_tier_name(cpu_tier()));
+	log(DEBUG1, std::string("cpu tier ") + cpu_tier_name(cpu_tier()) + " (supports " + cpu_tier_name(cpu_detect()) + "), math " + simd_level() + ", raster " + raster_level());
+
+	//one job pool runs loading, geometry chunks, and raster bands
+	//load models in the background, instances show up as their meshes finish
+	//mesh data is shared between every instance of the same file
+	jobs_start(workers, affinity);
+	for (auto& def : defs)
+	{
+		int i = scene->reg_model(AssetCache::load_async(def.path), def.pos, def.scale, def.color);
+		scene->set_static(i, def.is_static);
+	}
+	if (wait_loads)
+	{
+		scene->wait_loads();
+		log(DEBUG1, std::to_string(scene->num_models()) + " instances share " + std::to_string(AssetCache::num_meshes()) + " unique meshes");
+	}
+
+	//rasterize on its own thread if frames should be pipelined
+	if (pipeline_depth > 0)
+		pipeline = std::unique_ptr<FramePipeline>(new FramePipeline(pipeline_depth));
 }
 
 /**
@@ -118,10 +285,13 @@ Proc::Proc(const char* config)
 Proc::~Proc()
 {
 	log(DEBUG1, "Ending Process");
+	if (pipeline)
+		pipeline->stop();
+	jobs_stop();
 }
 
 /**
-* Animates each model to bounce up and down while rotating
+* Animates each model not marked static to bounce up and down while rotating
 */
 void Proc::animate()
 {
@@ -137,6 +307,10 @@ void Proc::animate()
 	prev_time = curr_time;
 	for (int i = 0; i < positions.size(); i++)
 	{
+		//static models stay where the config put them
+		if (static_models[i])
+			continue;
+
 		//going to use sin function for position
 		positions[i].y = sinf((float)std::chrono::duration_cast<std::chrono::milliseconds>(curr_time - start_time).count() / 1000.f);
 		scene->set_pos(i, positions[i]);
@@ -146,11 +320,63 @@ void Proc::animate()
 	}
 }
 
+/**
+* Reports heap allocations made since the last frame ended, split by stage
+* Totals go to the stats line, a steady state frame that allocated is reported or ends the process
+*	depending on alloc_check
+* Does nothing in release builds, allocations are only counted in debug builds
+* @param steady: frame was past warm up and did not resize or load meshes, so it should not have allocated
+*/
+void Proc::check_allocs(bool steady)
+{
+	if (!alloc_counting())
+		return;
+
+	AllocStats now;
+	alloc_stats(now);
+	size_t count = now.total_count() - prev_allocs.total_count();
+	size_t bytes = now.total_bytes() - prev_allocs.total_bytes();
+	stats_set("allocs/frame", (double)count);
+	stats_set("alloc bytes/frame", (double)bytes);
+
+	if (steady && count != 0 && alloc_check > 0)
+	{
+		std::string msg = "steady state frame made " + std::to_string(count) + " heap allocations, " + std::to_string(bytes) + " bytes:";
+		for (int i = 0; i < NUM_ALLOC_STAGES; i++)
+		{
+			size_t n = now.count[i] - prev_allocs.count[i];
+			if (n != 0)
+				msg += std::string(" ") + alloc_stage_name((ALLOC_STAGE)i) + " " + std::to_string(n) + " (" + std::to_string(now.bytes[i] - prev_allocs.bytes[i]) + " bytes)";
+		}
+		if (alloc_check >= 2)
+		{
+			log(ERR, msg);
+			g_exit_error = true;
+			g_alive = false;
+		}
+		else
+		{
+			log(WARNING, msg);
+		}
+	}
+
+	//read again so the report's own allocations don't count against the next frame
+	alloc_stats(prev_allocs);
+}
+
 /**
 * Draw loop for window
+* When pipelined, this thread only runs geometry and hands each frame to the raster thread,
+*	so the frame on screen is one frame behind the one being built
 */
 void Proc::start()
 {
+	//debug builds count heap allocations per frame, steady state frames should make none
+	int frame_count = 0;
+	alloc_stats(prev_allocs);
+	int prev_width = get_buf_width();
+	int prev_height = get_buf_height();
+
 	//start draw loop
 	while (1)
 	{
@@ -159,6 +385,9 @@ void Proc::start()
 		{
 			//window closed
 			log(DEBUG1, "window termined");
+			if (pipeline)
+				pipeline->stop();
+			jobs_stop();
 			window_remove();
 			if (g_exit_error)
 				exit(-1);
@@ -168,17 +397,19 @@ void Proc::start()
 		//start sync
 		window_sync_begin();
 
-		//clear screen
-		window_clear();
+		//frames that resize or swap in new meshes are expected to allocate
+		bool resized = get_buf_width() != prev_width || get_buf_height() != prev_height;
+		bool steady = ++frame_count > ALLOC_WARMUP_FRAMES && !resized && scene->num_pending() == 0;
+		prev_width = get_buf_width();
+		prev_height = get_buf_height();
+		unsigned chain = get_chain_id();
 
 		//process inputs
 		scene->process_inputs();
 
 		//get next animation step
-		animate();
-
-		//lock the screen
-		draw_lock();
+		if (animating)
+			animate();
 
 		//check if screen size changed
 		if (g_resize)
@@ -187,18 +418,48 @@ void Proc::start()
 			float w = (float)get_buf_width();
 			float h = (float)get_buf_height();
 			scene->set_aspect_ratio(h / w);
+			g_resize = false;
+		}
+
+		//nothing changed, leave the last frame on screen and sleep until input arrives instead of drawing it again
+		if (!scene->needs_draw())
+		{
+			window_wait_events(IDLE_WAIT_MS);
+			window_poll();
+			window_sync_skip();
+			check_allocs(steady && get_chain_id() == chain);
+			continue;
+		}
+
+		if (pipeline)
+		{
+			//build triangle list for raster thread, waits if raster stage is behind
+			std::unique_ptr<FrameList> frame = pipeline->acquire();
+			scene->build_frame(*frame);
+			pipeline->submit(std::move(frame));
+
+			//handle window messages
+			window_poll();
 		}
+		else
+		{
+			//lock the screen
+			draw_lock();
 
-		//draw scene
-		scene->draw();
+			//clear and draw scene, rows nothing changed in are kept from the last frame
+			scene->draw();
 
-		//unlock the screen
-		draw_unlock();
+			//unlock the screen
+			draw_unlock();
 
-		//send draw call to window
-		window_update();
+			//send draw call to window
+			window_update();
+		}
 
 		//end sync
-		window_sync_end(0, true); //0 input uncaps fps
+		window_sync_end(fps_cap, true); //0 uncaps fps
+
+		//a resize message or a render scale step reallocated the buffers during the frame
+		check_allocs(steady && get_chain_id() == chain);
 	}
 }
\ No newline at end of file
@@ -4,7 +4,9 @@
 #include "model.hpp"
 #include "geom.hpp"
 #include "render.hpp"
+#include "pipeline.hpp"
 #include "../window/window.hpp"
+#include "../memory/alloc.hpp"
 
 constexpr auto RED   = 0xFF0000;
 constexpr auto BLUE  = 0x0000FF;
@@ -21,7 +23,14 @@ public:
 	void start();
 private:
 	std::unique_ptr<Scene> scene;
+	std::unique_ptr<FramePipeline> pipeline;  //null when geometry and raster run in order
 	std::vector<Vec3f> positions;
+	std::vector<bool> static_models;  //left out of animation
+	int fps_cap;  //frames per second the loop is paced to, 0 uncapped
+	bool animating;  //models bounce and spin, off leaves the scene still until the camera moves
+	int alloc_check;  //debug builds, 0 ignores allocating frames, 1 warns, 2 exits with an error
+	AllocStats prev_allocs;  //allocation totals at the end of the last frame
 
 	void animate();
+	void check_allocs(bool steady);
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "geom.hpp"
+#include "../memory/alloc.hpp"
 #include <cmath>
 #include <vector>
 #include <stdexcept>
@@ -98,20 +99,23 @@ public:
 	}
 	Quaternion operator *(const Quaternion& q) const
 	{
+		AllocScope scope(ALLOC_QUATERNION);
+
 		//use foil to multiply out all values
-		std::vector<Complex> foil;
+		//always 16 terms, kept on the stack since rotations are combined every frame
+		Complex foil[16];
 
 		for (int i = 0; i < 4; i++)
 		{
 			for (int j = 0; j < 4; j++)
 			{
-				foil.push_back(raw[i] * q.raw[j]);
+				foil[i * 4 + j] = raw[i] * q.raw[j];
 			}
 		}
 
 		//sum all values in foil into new quaternion
 		Quaternion out;
-		for (int i = 0; i < foil.size(); i++)
+		for (int i = 0; i < 16; i++)
 		{
 			switch (foil[i].t)
 			{
@@ -146,6 +150,23 @@ public:
 	}
 	inline operator Vec3f() const { return Vec3f(i_v.val, j_v.val, k_v.val); }
 	inline float get_angle() const { return angle; }
+	//rotation matrix equivalent to q * v * q.conjugate() for a unit quaternion
+	//lets a rotation be folded into the other transforms once instead of being applied per vertex
+	inline Mat4x4f to_mat() const
+	{
+		float w = real.val, x = i_v.val, y = j_v.val, z = k_v.val;
+		Mat4x4f m;
+		m.val[0][0] = 1.f - 2.f * (y * y + z * z);
+		m.val[0][1] = 2.f * (x * y - w * z);
+		m.val[0][2] = 2.f * (x * z + w * y);
+		m.val[1][0] = 2.f * (x * y + w * z);
+		m.val[1][1] = 1.f - 2.f * (x * x + z * z);
+		m.val[1][2] = 2.f * (y * z - w * x);
+		m.val[2][0] = 2.f * (x * z - w * y);
+		m.val[2][1] = 2.f * (y * z + w * x);
+		m.val[2][2] = 1.f - 2.f * (x * x + y * y);
+		return m;
+	}
 private:
 	union {
 		struct {
@@ -175,4 +196,7 @@ struct Rotation
 	int order[3];
 
 	Rotation() { x = Quaternion(0.f, Vec3f(1.f, 0.f, 0.f)); y = Quaternion(0.f, Vec3f(0.f, 1.f, 0.f)); z = Quaternion(0.f, Vec3f(0.f, 0.f, 1.f)); order[0] = 0; order[1] = 1; order[2] = 2; }
+
+	//combined rotation matrix, order[0] is applied first
+	inline Mat4x4f to_mat() const { return raw[order[2]].to_mat() * raw[order[1]].to_mat() * raw[order[0]].to_mat(); }
 };
@@ -2,8 +2,14 @@
 
 #include "geom.hpp"
 #include "model.hpp"
+#include "asset.hpp"
 #include "quaternion.hpp"
+#include "pipeline.hpp"
+#include "bvh.hpp"
+#include "occlusion.hpp"
+#include "../memory/arena.hpp"
 #include <vector>
+#include <atomic>
 
 //very self explanitory camera class
 class Camera
@@ -60,10 +66,15 @@ class Scene
 public:
 	Scene();
 	~Scene();
-	int reg_model(std::shared_ptr<Model> m);
-	int reg_model(std::shared_ptr<Model> m, Vec3f &center, float scale, COLOR color);
+	int reg_model(std::shared_ptr<const Model> m);
+	int reg_model(std::shared_ptr<const Model> m, Vec3f &center, float scale, COLOR color);
+	int reg_model(AssetFuture m, Vec3f &center, float scale, COLOR color);
 	int num_models();
+	int num_pending() const;
+	void wait_loads();
+	bool needs_draw();
 	void draw();
+	void build_frame(FrameList& out);
 	void process_inputs();
 	void set_cam_step(float step);
 	void set_pos(int index, Vec3f &center);
@@ -73,13 +84,25 @@ public:
 	void set_rot_order(int index, int order[3]);
 	void set_color(int index, COLOR color);
 	void set_scale(int index, float scale);
+	void set_static(int index, bool b);
+	bool is_static(int index) const;
+	void set_static_batching(bool b);
+	void set_occlusion_culling(bool b);
+	void set_depth_sort(bool b);
+	void set_depth_prepass(bool b);
+	void set_deferred(bool b);
 	void set_projection(float fov_rad, float zfar, float znear, float aspect_r);
 	void set_aspect_ratio(float aspect_r);
 	void set_z_bound(float zfar, float znear);
 	void set_fov(float fov_rad);
 	void set_wireframe(bool b);
 	void set_cam_light(bool b);
+	void set_depth_test(bool b);
+	void set_flat_shading(bool b);
+	void set_lod_hysteresis(float levels);
 	int add_light(Vec3f &p);
+	int raycast(const Vec3f& origin, const Vec3f& dir, float& t) const;
+	void query_point(const Vec3f& p, std::vector<int>& out) const;
 private:
 	struct ProjMat
 	{
@@ -89,18 +112,134 @@ private:
 		ProjMat() { mat = Mat4x4f(); fov_rad = 0; zfar = 0; znear = 0; aspect_r = 0; f = 0; q = 0; }
 		ProjMat(float fov_rad, float zfar, float znear, float aspect_r);  //defined in scene.cpp
 	};
-	std::vector<std::shared_ptr<Model>> models;
+	//per-instance state, mesh data is shared through the asset cache
+	std::vector<std::shared_ptr<const Model>> models;
+	std::vector<COLOR> colors;
 	std::vector<Vec3f> lights;
 	std::vector<Mat4x4f> translates;
 	std::vector<Mat4x4f> scales;
 	std::vector<Rotation> rotates;  //[0] is x, [1] is y [2] is z
+	std::vector<int> lod_levels;  //level of detail each instance was last drawn at
+
+	//model to world transforms, static instances keep theirs until a transform setter dirties them,
+	//	the rest rebuild theirs every frame since they are expected to move
+	std::vector<Mat4x4f> world_verts;  //rotation, then translation and scale
+	std::vector<Mat4x4f> world_norms;  //rotation only
+	std::vector<uint8_t> world_dirty;
+	std::vector<uint8_t> statics;
+
+	//instances grouped by the mesh they share
+	struct Batch
+	{
+		std::shared_ptr<const Model> mesh;
+		std::vector<int> instances;
+	};
+	std::vector<Batch> batches;
+	std::vector<int> inst_batch;  //batch each instance is drawn in, -1 if none
+	bool batches_dirty;
+
+	//hierarchy over instance bounding spheres in world space, culling and scene queries walk it
+	//	instead of testing every instance
+	Bvh bvh;
+	bool bvh_dirty;  //instances were added or loaded, tree needs a rebuild instead of a refit
+
+	//occluders drawn first in a frame, everything else is tested against them before any vertex work
+	OcclusionBuffer occlusion;
+	bool occlusion_culling;
+	bool occluding;  //occlusion buffer holds this frame's occluders
+	std::atomic<int> num_occluded;  //instances dropped this frame
+
+	bool depth_sort;  //draw instances, and meshlets of large meshes, nearest first
+
+	//triangles of one instance in its batch's list, when depth sorting the runs of every batch are merged
+	//	nearest first instead of appending whole lists
+	struct DepthRun
+	{
+		uint32_t key;  //depth key of instance
+		int start, end;  //range of triangles in list
+	};
+
+	//static instances of the same color baked into one mesh, drawn as a single instance
+	struct StaticBatch
+	{
+		std::shared_ptr<const Model> mesh;
+		Mat4x4f world;  //places merged mesh back at its center
+		COLOR color;
+		int num_instances;
+	};
+	std::vector<StaticBatch> static_batches;
+	bool static_batching;
+	bool statics_dirty;  //static set, or a static instance's transform or color, changed since batches were baked
+
+	//placeholder instances waiting on their mesh
+	std::vector<std::pair<int, AssetFuture>> pending;
+
+	//rows of the screen, empty while hi is below lo
+	struct RowSpan
+	{
+		int lo, hi;
+
+		RowSpan() { lo = 0; hi = -1; }
+		RowSpan(int lo, int hi) { this->lo = lo; this->hi = hi; }
+		bool empty() const { return hi < lo; }
+		bool overlaps(const RowSpan& r) const { return !empty() && !r.empty() && lo <= r.hi && r.lo <= hi; }
+		RowSpan join(const RowSpan& r) const
+		{
+			if (empty())
+				return r;
+			if (r.empty())
+				return *this;
+			return RowSpan((lo < r.lo) ? lo : r.lo, (hi > r.hi) ? hi : r.hi);
+		}
+	};
+
+	//change tracking, frames where nothing changed are skipped and frames where only some instances
+	//	changed redraw just the rows those instances cover
+	std::vector<uint8_t> moved;  //instance changed since the last frame was built
+	std::vector<RowSpan> inst_rows;  //rows each instance covered in the last frame it was drawn in
+	int num_moved;
+	bool redraw_all;  //camera, lights, projection, or draw modes changed, nothing of the last frame can be kept
+	RowSpan frame_rows;  //rows of the frame being built that are drawn
+
 	ProjMat proj_mat;
 	Camera cam;
 	bool wireframe;
 	bool cam_light;
+	bool depth_test;
+	bool depth_prepass;
+	bool deferred;  //light pixels after raster instead of vertices before it
+	bool flat_shading;
+	float lod_hysteresis;
+	FrameList frame;  //reused by draw when stages run in order
+	FrameArena arena;  //scratch lists of the geometry stage, reset at the start of every frame
+	int out_width, out_height;  //buffer size of the frame being built
+	unsigned out_chain;  //buffers the frame being built is drawn into
 
-	void cull(std::vector<Vec3f>& f_norms, std::vector<Triangle>& t_draws, std::vector<Triangle>& t_norms);
-	void rotate(Vec3f& old, int i);
-	void projection(std::vector<Triangle> &t_draws);
-	void triangle_to_screen(Triangle &t_draw, Triangle &t_norm, Triangle& t_world, std::vector<Vec3f> lights, COLOR color) const;
+	void cull(ArenaVector<Vec3f>& f_norms, ArenaVector<Triangle>& t_draws, ArenaVector<Triangle>& t_norms);
+	void poll_loads();
+	void build_batches();
+	void mark_moved(int index);
+	void mark_transformed(int index);
+	void update_world();
+	void instance_bounds(int index, Vec3f& c, float& radius) const;
+	void build_bvh();
+	void update_bvh();
+	bool in_frustum(const Vec3f& c, float radius) const;
+	BVH_TEST frustum_test(const Vec3f& c, float radius) const;
+	RowSpan screen_rows(const Vec3f& c, float radius) const;
+	bool occluded(const Vec3f& c, float radius) const;
+	uint32_t depth_key(float z) const;
+	RowSpan instance_rows(int index, const Mat4x4f& vert_cam_mat) const;
+	int select_lod(int index, float depth, float radius, int num_lods);
+	void draw_batch(const Batch& batch, const int* instances, int num_instances, const Mat4x4f& vert_cam_mat, const Mat4x4f& norm_cam_mat, const ArenaVector<Vec3f>& lights, ArenaVector<ScreenTri>& out, ArenaVector<DepthRun>* runs);
+	void draw_occluders(const ArenaVector<int>& batch_start, ArenaVector<int>& batch_count, ArenaVector<int>& batch_visible, const Mat4x4f& vert_cam_mat, const Mat4x4f& norm_cam_mat, const ArenaVector<Vec3f>& lights, ArenaVector<ArenaVector<ScreenTri>>& lists);
+	void build_static_batches();
+	void draw_static_batch(const StaticBatch& batch, const Mat4x4f& vert_cam_mat, const Mat4x4f& norm_cam_mat, const ArenaVector<Vec3f>& lights, ArenaVector<ScreenTri>& out);
+	void draw_instances(const Model* mesh, const ArenaVector<COLOR>& inst_colors, const ArenaVector<Mat4x4f>& inst_vert, const ArenaVector<Mat4x4f>& inst_norm, const ArenaVector<Vec3f>& lights, ArenaVector<ScreenTri>& out, int* ranges);
+	void draw_instance(const Model* mesh, const int* meshlet_ids, int num_meshlets, const Vec3f* t_verts, const Vec3f* t_v_norms, const Vec3f* t_f_norms, const ArenaVector<Vec3f>& lights, COLOR color, ArenaVector<ScreenTri>& out);
+	void projection(ArenaVector<Triangle> &t_draws);
+	template <bool LIT, bool FLAT, bool DEFERRED>
+	void emit_triangles(const ArenaVector<Triangle>& t_draws, const ArenaVector<Triangle>& t_norms, const float* shade, COLOR color, ArenaVector<ScreenTri>& out) const;
+	template <bool LIT, bool FLAT, bool DEFERRED>
+	void triangle_to_screen(const Triangle &t_draw, const Triangle& t_norm, const float* shade, COLOR color, ArenaVector<ScreenTri>& out) const;
 };
\ No newline at end of file
@@ -2,8 +2,35 @@
 #include "geom.hpp"
 #include "model.hpp"
 #include "render.hpp"
+#include "simd.hpp"
 #include "../window/window.hpp"
+#include "../jobs/jobs.hpp"
 #include "../logger/logger.hpp"
+#include "../memory/alloc.hpp"
+#include "../logger/stats.hpp"
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+
+constexpr int INSTANCE_BATCH = 16; //number of instances transformed per pass over a mesh's vertices
+constexpr int MESHLET_GRAIN = 16; //meshlets culled per job
+constexpr int VERTEX_GRAIN = 1024; //vertices transformed per job
+constexpr int GEOMETRY_CHUNK_FACES = 512; //faces clipped, culled and projected per job
+constexpr int WORLD_GRAIN = 256; //instance world transforms rebuilt per job
+constexpr float LOD_PIXELS = 128.f; //projected radius in pixels below which instances start dropping detail
+constexpr float BACKFACE_LIMIT = 1.47062891f; //acos(0.1), angle between view ray and normal under which Scene::cull drops a face
+constexpr float PARTIAL_REDRAW_MAX = 0.5f; //fraction of rows above which a frame with few changed instances is drawn whole
+constexpr int OCCLUDER_MAX = 8; //instances drawn first as occluders each frame
+constexpr float OCCLUDER_MIN_SIZE = 0.1f; //bounding radius over depth below which an instance is too small to be an occluder
+constexpr int CLUSTER_SORT_MIN = 8; //meshlets a mesh needs before its meshlets are drawn nearest first too
+constexpr float DEPTH_KEY_MAX = 65535.f; //depth between near and far planes is quantized to 16 bits for sorting
+
+//run of visible meshlets of one instance in a group that one job turns into screen triangles
+struct GeometryChunk
+{
+	int bit;
+	int begin, end;  //range of meshlet ids
+};
 
 /**
 * Projection matrix for this renderer
@@ -54,6 +81,25 @@ Scene::Scene()
 	//default to wireframe and cam_light
 	wireframe = true;
 	cam_light = true;
+	depth_test = true;
+	depth_prepass = false;
+	deferred = false;
+	flat_shading = false;
+
+	batches_dirty = false;
+	bvh_dirty = false;
+	occlusion_culling = false;
+	depth_sort = false;
+	occluding = false;
+	num_occluded = 0;
+	static_batching = false;
+	statics_dirty = false;
+	lod_hysteresis = 0.25f;
+	out_width = 0;
+	out_height = 0;
+	out_chain = 0;
+	num_moved = 0;
+	redraw_all = true;
 }
 Scene::~Scene()
 {
@@ -64,14 +110,25 @@ Scene::~Scene()
 * @param m: model to add
 * @return: index of model
 */
-int Scene::reg_model(std::shared_ptr<Model> m)
+int Scene::reg_model(std::shared_ptr<const Model> m)
 {
 	models.push_back(m);
+	//default to white
+	colors.push_back(COLOR(WHITE));
 	//default to center at (0,0,0) and scale of 1.0
 	translates.push_back(Mat4x4f());
 	scales.push_back(Mat4x4f());
 	//default to no rotation and x-y-z rot order
 	rotates.push_back(Rotation());
+	lod_levels.push_back(0);
+	moved.push_back(0);
+	inst_rows.push_back(RowSpan());
+	world_verts.push_back(Mat4x4f());
+	world_norms.push_back(Mat4x4f());
+	world_dirty.push_back(1);
+	statics.push_back(0);
+	batches_dirty = true;
+	redraw_all = true;
 
 	return (int)models.size() - 1;
 }
@@ -80,15 +137,26 @@ int Scene::reg_model(std::shared_ptr<Model> m)
 * @param m: model to add
 * @param center: position of model
 * @param scale: scale of model
+* @param color: color of this instance
 * @return: index of model
 */
-int Scene::reg_model(std::shared_ptr<Model> m, Vec3f &center, float scale, COLOR color)
+int Scene::reg_model(std::shared_ptr<const Model> m, Vec3f &center, float scale, COLOR color)
 {
 	models.push_back(m);
 	//init with defaults
+	colors.push_back(COLOR(WHITE));
 	translates.push_back(Mat4x4f());
 	scales.push_back(Mat4x4f());
 	rotates.push_back(Rotation());
+	lod_levels.push_back(0);
+	moved.push_back(0);
+	inst_rows.push_back(RowSpan());
+	world_verts.push_back(Mat4x4f());
+	world_norms.push_back(Mat4x4f());
+	world_dirty.push_back(1);
+	statics.push_back(0);
+	batches_dirty = true;
+	redraw_all = true;
 
 	//use build in functions to set matrix vals
 	int i = (int)models.size() - 1;
@@ -99,6 +167,22 @@ int Scene::reg_model(std::shared_ptr<Model> m, Vec3f &center, float scale, COLOR
 	return i;
 }
 
+/**
+* Adds placeholder model in scene whose mesh is still loading
+* The instance is positioned like any other but isn't drawn until its mesh is ready
+* @param m: future of mesh being loaded
+* @param center: position of model
+* @param scale: scale of model
+* @param color: color of this instance
+* @return: index of model
+*/
+int Scene::reg_model(AssetFuture m, Vec3f &center, float scale, COLOR color)
+{
+	int i = this->reg_model(std::shared_ptr<const Model>(), center, scale, color);
+	pending.push_back(std::make_pair(i, m));
+	return i;
+}
+
 /**
 * Gets number of models
 * @return number of models in scene
@@ -108,6 +192,36 @@ int Scene::num_models()
 	return models.size();
 }
 /**
+* Gets number of instances still waiting on their mesh
+* @return number of placeholder instances
+*/
+int Scene::num_pending() const
+{
+	return (int)pending.size();
+}
+/**
+* Blocks until every pending mesh has loaded, for offline rendering and benchmarks
+*/
+void Scene::wait_loads()
+{
+	for (auto& p : pending)
+		p.second.wait();
+	poll_loads();
+}
+/**
+* Checks if anything changed since the last frame was built
+* Frames where nothing changed would draw the same image again, so the caller can skip them
+*	and leave the last frame on screen
+* Also swaps in meshes that finished loading, which counts as a change
+* @return: true if the next frame would differ from the last one
+*/
+bool Scene::needs_draw()
+{
+	if (!pending.empty())
+		poll_loads();
+	return redraw_all || num_moved > 0 || get_buf_width() != out_width || get_buf_height() != out_height || get_chain_id() != out_chain;
+}
+/**
 * Sets projection matrix
 * @param fov_rad: angle of field of view
 * @param zfar: position of far plane
@@ -117,6 +231,7 @@ int Scene::num_models()
 void Scene::set_projection(float fov_rad, float zfar, float znear, float aspect_r)
 {
 	proj_mat = ProjMat(fov_rad, zfar, znear, aspect_r);
+	redraw_all = true;
 }
 /**
 * Sets aspect ration of perspective transform
@@ -124,9 +239,12 @@ void Scene::set_projection(float fov_rad, float zfar, float znear, float aspect_
 */
 void Scene::set_aspect_ratio(float aspect_r)
 {
+	if (aspect_r == proj_mat.aspect_r)
+		return;
 	//clear current val
 	proj_mat.mat.val[0][0] = proj_mat.f * aspect_r;
 	proj_mat.aspect_r = aspect_r;
+	redraw_all = true;
 }
 /**
 * Sets z bounds of perspective transform
@@ -142,6 +260,7 @@ void Scene::set_z_bound(float zfar, float znear)
 	proj_mat.q = q;
 	proj_mat.zfar = zfar;
 	proj_mat.znear = znear;
+	redraw_all = true;
 }
 /**
 * Sets fov of perspective transform
@@ -155,6 +274,7 @@ void Scene::set_fov(float fov_rad)
 	proj_mat.mat.val[1][1] = f;
 	proj_mat.fov_rad = fov_rad;
 	proj_mat.f = f;
+	redraw_all = true;
 }
 /**
 * Sets wireframe mode
@@ -163,6 +283,16 @@ void Scene::set_fov(float fov_rad)
 void Scene::set_wireframe(bool b)
 {
 	wireframe = b;
+	redraw_all = true;
+}
+/**
+* Sets level of detail hysteresis
+* @param levels: how far past a switch point (in levels) an instance has to be before it changes level
+*/
+void Scene::set_lod_hysteresis(float levels)
+{
+	lod_hysteresis = (levels < 0.f) ? 0.f : levels;
+	redraw_all = true;
 }
 /**
 * Sets cam_light mode
@@ -171,6 +301,47 @@ void Scene::set_wireframe(bool b)
 void Scene::set_cam_light(bool b)
 {
 	cam_light = b;
+	redraw_all = true;
+}
+/**
+* Sets depth testing, with it off later triangles always draw over earlier ones
+* @param b: bool value to set
+*/
+void Scene::set_depth_test(bool b)
+{
+	depth_test = b;
+	redraw_all = true;
+}
+/**
+* Sets depth prepass, every triangle's depth is filled before any color, then only pixels
+*	whose depth matches are colored, so each visible pixel is colored once
+* Only used while filling with the depth test on
+* @param b: bool value to set
+*/
+void Scene::set_depth_prepass(bool b)
+{
+	depth_prepass = b;
+	redraw_all = true;
+}
+/**
+* Sets deferred shading, filled triangles are drawn unlit with their normals and every drawn pixel
+*	is lit once afterwards, so lighting costs per pixel instead of per vertex
+* Wireframe is drawn unlit either way
+* @param b: bool value to set
+*/
+void Scene::set_deferred(bool b)
+{
+	deferred = b;
+	redraw_all = true;
+}
+/**
+* Sets flat shading, each filled triangle gets one color from the average light of its vertices
+* @param b: bool value to set
+*/
+void Scene::set_flat_shading(bool b)
+{
+	flat_shading = b;
+	redraw_all = true;
 }
 /**
 * Sets color of model at index
@@ -179,7 +350,78 @@ void Scene::set_cam_light(bool b)
 */
 void Scene::set_color(int index, COLOR color)
 {
-	models[index].get()->set_color(color);
+	//only rgb is set by the color constructors
+	if (colors[index].R == color.R && colors[index].G == color.G && colors[index].B == color.B)
+		return;
+	colors[index] = color;
+	mark_moved(index);
+	statics_dirty = statics_dirty || statics[index];
+}
+/**
+* Marks model at index as static or dynamic
+* Static models keep their world transform between frames and only rebuild it after being moved,
+*	dynamic models rebuild it every frame
+* @param index: index of model
+* @param b: true if model rarely moves
+*/
+void Scene::set_static(int index, bool b)
+{
+	if (statics[index] == (b ? 1 : 0))
+		return;
+	statics[index] = b ? 1 : 0;
+	world_dirty[index] = 1;
+	batches_dirty = true;
+	statics_dirty = true;
+	redraw_all = true;
+}
+/**
+* Checks if model at index is marked static
+* @param index: index of model
+* @return: true if model keeps its world transform between frames
+*/
+bool Scene::is_static(int index) const
+{
+	return statics[index] != 0;
+}
+/**
+* Sets static batching, static instances sharing a color are baked into one mesh and drawn as one instance
+* Baked instances skip per-instance culling and always draw at full detail, the merged mesh is rebuilt
+*	whenever a static instance is added, moved, or recolored
+* @param b: bool value to set
+*/
+void Scene::set_static_batching(bool b)
+{
+	if (static_batching == b)
+		return;
+	static_batching = b;
+	batches_dirty = true;
+	statics_dirty = true;
+	redraw_all = true;
+}
+/**
+* Sets occlusion culling, the instances biggest on screen are drawn first and everything entirely behind
+*	them is dropped before any vertex work
+* Only used while filling with the depth test on, frames come out the same as without it
+* @param b: bool value to set
+*/
+void Scene::set_occlusion_culling(bool b)
+{
+	if (occlusion_culling == b)
+		return;
+	occlusion_culling = b;
+	redraw_all = true;
+}
+/**
+* Sets depth sorting, instances are drawn nearest first, and so are meshlets of meshes with many of them
+* More of each frame is then rejected by the depth test before any color work
+* @param b: bool value to set
+*/
+void Scene::set_depth_sort(bool b)
+{
+	if (depth_sort == b)
+		return;
+	depth_sort = b;
+	redraw_all = true;
 }
 /**
 * Adds pitch to object rotation
@@ -188,12 +430,15 @@ void Scene::set_color(int index, COLOR color)
 */
 void Scene::add_pitch(int index, float rads)
 {
+	if (rads == 0.f)
+		return;
 	Quaternion q = rotates[index].x; //x-axis
 	float curr_rads = q.get_angle();
 
 	//do operations
 	q = Quaternion(curr_rads + rads, Vec3f(1.f, 0.f, 0.f));
 	rotates[index].x = q;
+	mark_transformed(index);
 }
 /**
 * Adds yaw object rotation
@@ -202,12 +447,15 @@ void Scene::add_pitch(int index, float rads)
 */
 void Scene::add_yaw(int index, float rads)
 {
+	if (rads == 0.f)
+		return;
 	Quaternion q = rotates[index].y; //y-axis
 	float curr_rads = q.get_angle();
 
 	//do operations
 	q = Quaternion(curr_rads + rads, Vec3f(0.f, 1.f, 0.f));
 	rotates[index].y = q;
+	mark_transformed(index);
 }
 /**
 * Adds roll object rotation
@@ -216,12 +464,15 @@ void Scene::add_yaw(int index, float rads)
 */
 void Scene::add_roll(int index, float rads)
 {
+	if (rads == 0.f)
+		return;
 	Quaternion q = rotates[index].z; //z-axis
 	float curr_rads = q.get_angle();
 
 	//do operations
 	q = Quaternion(curr_rads + rads, Vec3f(0.f, 0.f, 1.f));
 	rotates[index].z = q;
+	mark_transformed(index);
 }
 /**
 * Sets order in which to rotate object about axis
@@ -234,6 +485,7 @@ void Scene::set_rot_order(int index, int order[3])
 	{
 		rotates[index].order[i] = order[i];
 	}
+	mark_transformed(index);
 }
 /**
 * Sets position of model
@@ -242,9 +494,12 @@ void Scene::set_rot_order(int index, int order[3])
 */
 void Scene::set_pos(int index, Vec3f &center)
 {
+	if (translates[index].val[0][3] == center.x && translates[index].val[1][3] == center.y && translates[index].val[2][3] == center.z)
+		return;
 	translates[index].val[0][3] = center.x;
 	translates[index].val[1][3] = center.y;
 	translates[index].val[2][3] = center.z;
+	mark_transformed(index);
 }
 /**
 * Sets the scale of a specific model
@@ -253,9 +508,12 @@ void Scene::set_pos(int index, Vec3f &center)
 */
 void Scene::set_scale(int index, float scale)
 {
+	if (scales[index].val[0][0] == scale && scales[index].val[1][1] == scale && scales[index].val[2][2] == scale)
+		return;
 	scales[index].val[0][0] = scale;
 	scales[index].val[1][1] = scale;
 	scales[index].val[2][2] = scale;
+	mark_transformed(index);
 }
 /**
 * Adds light to scene
@@ -265,6 +523,7 @@ void Scene::set_scale(int index, float scale)
 int Scene::add_light(Vec3f &p)
 {
 	lights.push_back(p);
+	redraw_all = true;
 	return (int)lights.size() - 1;
 }
 
@@ -299,61 +558,73 @@ void Scene::process_inputs()
 	if (UP_KEY)
 	{
 		cam.rot_up();
+		redraw_all = true;
 		UP_KEY = false;
 	}
 	if (DOWN_KEY)
 	{
 		cam.rot_down();
+		redraw_all = true;
 		DOWN_KEY = false;
 	}
 	if (LEFT_KEY)
 	{
 		cam.rot_left();
+		redraw_all = true;
 		LEFT_KEY = false;
 	}
 	if (RIGHT_KEY)
 	{
 		cam.rot_right();
+		redraw_all = true;
 		RIGHT_KEY = false;
 	}
 	if (W_KEY)
 	{
 		cam.zoom_in();
+		redraw_all = true;
 		W_KEY = false;
 	}
 	if (A_KEY)
 	{
 		cam.left();
+		redraw_all = true;
 		A_KEY = false;
 	}
 	if (S_KEY)
 	{
 		cam.zoom_out();
+		redraw_all = true;
 		S_KEY = false;
 	}
 	if (D_KEY)
 	{
 		cam.right();
+		redraw_all = true;
 		D_KEY = false;
 	}
 	if (Z_KEY)
 	{
 		cam.roll_left();
+		redraw_all = true;
 		Z_KEY = false;
 	}
 	if (C_KEY)
 	{
 		cam.roll_right();
+		redraw_all = true;
 		C_KEY = false;
 	}
 	if (TAB_KEY)
 	{
 		cam.raise();
+		redraw_all = true;
 		TAB_KEY = false;
 	}
 	if (SHIFT_KEY)
 	{
 		cam.lower();
+		redraw_all = true;
 		SHIFT_KEY = false;
 	}
 }
@@ -635,11 +906,17 @@ static int clip(Vec3f& plane_p, Vec3f& plane_n, Triangle& in, Triangle& in_n, Tr
 * @param t_draws: vector of triangles to draw
 * @param t_norms: vector of vertex normals for each triangle
 */
-static void clip_z(std::vector<Triangle>& t_draws, std::vector<Triangle>& t_norms, std::vector<Vec3f>& f_norms, float z_near, float z_far)
+static void clip_z(ArenaVector<Triangle>& t_draws, ArenaVector<Triangle>& t_norms, ArenaVector<Vec3f>& f_norms, float z_near, float z_far)
 {
-	std::vector<Triangle> new_draws;
-	std::vector<Triangle> new_norms;
-	std::vector<Vec3f> new_f_norms;
+	AllocScope scope(ALLOC_CLIP);
+
+	//new lists come from the same frame arena as the old ones
+	ArenaVector<Triangle> new_draws(t_draws.get_allocator());
+	ArenaVector<Triangle> new_norms(t_norms.get_allocator());
+	ArenaVector<Vec3f> new_f_norms(f_norms.get_allocator());
+	new_draws.reserve(t_draws.size());
+	new_norms.reserve(t_norms.size());
+	new_f_norms.reserve(f_norms.size());
 
 	//get near and far plane
 	Vec3f plane_p_near = Vec3f(0.f, 0.f, z_near);
@@ -678,23 +955,26 @@ static void clip_z(std::vector<Triangle>& t_draws, std::vector<Triangle>& t_norm
 	}
 
 	//point to new data vectors
-	t_draws.clear();
-	t_norms.clear();
-	f_norms.clear();
-	t_draws = new_draws;
-	t_norms = new_norms;
-	f_norms = new_f_norms;
+	t_draws.swap(new_draws);
+	t_norms.swap(new_norms);
+	f_norms.swap(new_f_norms);
 }
 /**
 * Clips triangle over x and y bounds of perspective box if part of triangle outside of box
 * @param t_draws: vector of triangles to draw
 * @param t_norms: vector of vertex normals for each triangle
 */
-static void clip_xy(std::vector<Triangle> &t_draws, std::vector<Triangle> &t_norms, std::vector<Triangle> &t_world)
+static void clip_xy(ArenaVector<Triangle> &t_draws, ArenaVector<Triangle> &t_norms, ArenaVector<Triangle> &t_world)
 {
-	std::vector<Triangle> new_draws;
-	std::vector<Triangle> new_norms;
-	std::vector<Triangle> new_world;
+	AllocScope scope(ALLOC_CLIP);
+
+	//new lists come from the same frame arena as the old ones
+	ArenaVector<Triangle> new_draws(t_draws.get_allocator());
+	ArenaVector<Triangle> new_norms(t_norms.get_allocator());
+	ArenaVector<Triangle> new_world(t_world.get_allocator());
+	new_draws.reserve(t_draws.size());
+	new_norms.reserve(t_norms.size());
+	new_world.reserve(t_world.size());
 
 	//get near and far plane
 	Vec3f plane_p_x0 = Vec3f(-0.9f, 0.f, 0.f);
@@ -748,102 +1028,264 @@ static void clip_xy(std::vector<Triangle> &t_draws, std::vector<Triangle> &t_nor
 	}
 
 	//point to new data vectors
-	t_draws.clear();
-	t_norms.clear();
-	t_world.clear();
-	t_draws = new_draws;
-	t_norms = new_norms;
-	t_world = new_world;
+	t_draws.swap(new_draws);
+	t_norms.swap(new_norms);
+	t_world.swap(new_world);
+}
+/**
+* Sorts values by 16 bit keys, one counting pass per byte
+* Stable, so values with equal keys keep their order
+* @param keys: key of each value, sorted along with them
+* @param vals: values to sort
+* @param n: number of values
+* @param arena: arena for scratch lists
+*/
+static void radix_sort(uint32_t* keys, int* vals, int n, FrameArena& arena)
+{
+	if (n < 2)
+		return;
+	ArenaVector<uint32_t> tmp_keys(n, arena);
+	ArenaVector<int> tmp_vals(n, arena);
+	uint32_t* src_k = keys;
+	int* src_v = vals;
+	uint32_t* dst_k = tmp_keys.data();
+	int* dst_v = tmp_vals.data();
+	for (int shift = 0; shift < 16; shift += 8)
+	{
+		int offsets[257] = { 0 };
+		for (int i = 0; i < n; i++)
+			offsets[((src_k[i] >> shift) & 0xFF) + 1]++;
+		for (int d = 0; d < 256; d++)
+			offsets[d + 1] += offsets[d];
+		for (int i = 0; i < n; i++)
+		{
+			int slot = offsets[(src_k[i] >> shift) & 0xFF]++;
+			dst_k[slot] = src_k[i];
+			dst_v[slot] = src_v[i];
+		}
+		std::swap(src_k, dst_k);
+		std::swap(src_v, dst_v);
+	}
+	//even number of passes, sorted values are back in the lists passed in
 }
+
 /**
 * Draws all models to the screen
+* Runs geometry and raster stages back to back on the calling thread, readying the back buffer in between
+*	since only the built frame knows which rows it redraws
+* Draw lock must be held
 */
 void Scene::draw()
 {
+	build_frame(frame);
+	clear_frame(frame);
+	raster_frame(frame);
+}
+
+/**
+* Geometry stage of a frame
+* Transforms, clips, culls, projects, and lights every visible triangle into screen space
+* Instances are processed in batches that share a mesh, so each mesh's vertex data is streamed through the cache
+*	once per group of instance transforms instead of once per instance
+* Batches run in parallel on the job pool and large instances are split into chunks of meshlets,
+*	triangles come out in the same order as if everything ran on one thread
+* Only reads the buffer size, so it can run while another thread rasterizes the previous frame
+* Scratch lists come from the frame arena and out keeps its capacity, so once the scene stops growing
+*	a frame makes no heap allocations
+* If only some instances changed since the last frame, the list only covers the rows they covered before
+*	and after the change, and only holds instances reaching those rows, the rest is kept from the last frame
+* @param out: frame list to fill, previous contents are discarded
+*/
+void Scene::build_frame(FrameList& out)
+{
+	AllocScope scope(ALLOC_DRAW);
+
+	//nothing from the last frame's arena is still in use
+	arena.reset();
+
+	//swap in meshes that finished loading since last frame
+	if (!pending.empty())
+		poll_loads();
+
+	//regroup instances by mesh if instances were added
+	if (batches_dirty)
+	{
+		build_batches();
+		bvh_dirty = true;
+	}
+
+	//last frame can only be built on if it was drawn into the same buffers, lines are always drawn whole
+	int width = get_buf_width();
+	int height = get_buf_height();
+	unsigned chain = get_chain_id();
+	bool full = redraw_all || wireframe || width != out_width || height != out_height || chain != out_chain;
+
+	out.tris.clear();
+	out.width = width;
+	out.height = height;
+	out.chain = chain;
+	out.wireframe = wireframe;
+	out.depth_test = depth_test;
+	out.flat = flat_shading;
+	out.depth_prepass = depth_prepass;
+	out.deferred = deferred && !wireframe;
+	out.proj_x = proj_mat.mat.val[0][0];
+	out.proj_y = proj_mat.mat.val[1][1];
+	out.proj_q = proj_mat.q;
+	out.proj_znear = proj_mat.znear;
+	out_width = width;
+	out_height = height;
+	out_chain = chain;
+
 	//get camera matrices
 	Mat4x4f vert_cam_mat = cam.gen_vert_mat();
 	Mat4x4f norm_cam_mat = cam.gen_norm_mat();
+	update_world();
+	update_bvh();
 
-	//iterate through each model
-	for (int i = 0; i < models.size(); i++)
+	//bake static instances again once any of them changed, baked meshes don't track rows per instance so draw everything
+	if (statics_dirty)
 	{
-		//get faces, vertices, and normals
-		std::vector<std::vector<Vec3i>> faces = models[i].get()->get_faces();
-		std::vector<Vec3f> vertices = models[i].get()->get_vertices();
-		std::vector<Vec3f> v_normals = models[i].get()->get_vert_normals();
-		std::vector<Vec3f> f_normals = models[i].get()->get_face_normals();
-		std::vector<Triangle> t_draws;
-		std::vector<Triangle> t_norms;
-		std::vector<Vec3f> f_norms;
-		std::vector<Vec3f> lights = this->lights;
-		Mat4x4f local_to_world = scales[i] * translates[i];
-		for (int j = 0; j < faces.size(); j++)
-		{
-			//translate vertices
-			Triangle t_draw;
-			Triangle t_norm;
-			Vec3f    f_norm = f_normals[j];
-			for (int k = 0; k < 3; k++)
+		build_static_batches();
+		full = true;
+	}
+
+	//rows to redraw are where changed instances were plus where they are now
+	frame_rows = RowSpan(0, height - 1);
+	if (!full)
+	{
+		RowSpan changed;
+		for (int i = 0; i < moved.size(); i++)
+		{
+			if (moved[i] && models[i])
+				changed = changed.join(inst_rows[i]).join(instance_rows(i, vert_cam_mat));
+		}
+		if ((float)(changed.hi - changed.lo + 1) <= PARTIAL_REDRAW_MAX * (float)height)
+			frame_rows = changed;
+	}
+	out.y_lo = frame_rows.lo;
+	out.y_hi = frame_rows.hi;
+	std::fill(moved.begin(), moved.end(), (uint8_t)0);
+	num_moved = 0;
+	redraw_all = false;
+
+	//translate lights to camera world coords, this is the same for every instance
+	ArenaVector<Vec3f> lights(this->lights.begin(), this->lights.end(), arena);
+	for (int j = 0; j < lights.size(); j++)
+	{
+		lights[j] = Vec3f(vert_cam_mat * Vec4f(lights[j]));
+	}
+	//add cam pos to lights if cam_light set
+	if (cam_light)
+		lights.push_back(Vec3f(0.f, 0.f, 0.f)); //cam pos is origin after transform
+	out.lights.assign(lights.begin(), lights.end());
+
+	//instances in the frustum come from the bvh, then are grouped by batch keeping instance order, or depth order when sorting
+	ArenaVector<int> visible(arena);
+	bvh.query([&](const Vec3f& c, float r) { return frustum_test(Vec3f(vert_cam_mat * Vec4f(c)), r); }, visible);
+	std::sort(visible.begin(), visible.end());
+	if (depth_sort)
+	{
+		//nearest point of each bounding sphere, ties keep instance order
+		ArenaVector<uint32_t> keys(visible.size(), arena);
+		for (int j = 0; j < visible.size(); j++)
+		{
+			Vec3f c;
+			float radius;
+			instance_bounds(visible[j], c, radius);
+			keys[j] = depth_key(Vec3f(vert_cam_mat * Vec4f(c)).z - radius);
+		}
+		radix_sort(keys.data(), visible.data(), (int)visible.size(), arena);
+	}
+	ArenaVector<int> batch_start(batches.size() + 1, 0, arena);
+	for (int i : visible)
+	{
+		if (inst_batch[i] >= 0)
+			batch_start[inst_batch[i] + 1]++;
+	}
+	for (int b = 0; b < batches.size(); b++)
+		batch_start[b + 1] += batch_start[b];
+	ArenaVector<int> batch_next(batch_start.begin(), batch_start.end(), arena);
+	ArenaVector<int> batch_visible(batch_start.back(), arena);
+	for (int i : visible)
+	{
+		if (inst_batch[i] >= 0)
+			batch_visible[batch_next[inst_batch[i]]++] = i;
+	}
+	ArenaVector<int> batch_count(batches.size(), 0, arena);
+	for (int b = 0; b < batches.size(); b++)
+		batch_count[b] = batch_start[b + 1] - batch_start[b];
+
+	//occluders come out of the instances the frustum kept, drawing them takes them out of the lists
+	ArenaVector<ArenaVector<ScreenTri>> occluder_lists(batches.size(), ArenaVector<ScreenTri>(arena), arena);
+	occluding = false;
+	num_occluded = 0;
+	if (occlusion_culling && depth_test && !wireframe)
+		draw_occluders(batch_start, batch_count, batch_visible, vert_cam_mat, norm_cam_mat, lights, occluder_lists);
+
+	//meshes are processed in parallel, each into its own list so the merged order never depends on timing
+	//	static batches follow the instance batches
+	int num_lists = (int)(batches.size() + static_batches.size());
+	ArenaVector<ArenaVector<ScreenTri>> batch_lists(num_lists, ArenaVector<ScreenTri>(arena), arena);
+	ArenaVector<ArenaVector<DepthRun>> batch_runs(depth_sort ? num_lists : 0, ArenaVector<DepthRun>(arena), arena);
+	jobs_parallel_for(0, num_lists, 1, [&](int b_begin, int b_end)
+		{
+			AllocScope scope(ALLOC_DRAW);  //runs on a worker
+			for (int i = b_begin; i < b_end; i++)
 			{
-				//all vertices should be within [-1, 1] range on all axis
-				Vec3f vertex = vertices[faces[j][k].i_vert];
-				Vec3f norm = v_normals[faces[j][k].i_norm];
-				//rotate object
-				rotate(vertex, i);
-				rotate(norm, i);
-
-				//translate to world coords
-				vertex = Vec3f(local_to_world * Vec4f(vertex));
-
-				//translate based on camera pos
-				vertex = Vec3f(vert_cam_mat * Vec4f(vertex));
-				norm = Vec3f(norm_cam_mat * Vec4f(norm));
-
-				//add to draw list
-				t_draw.raw[k] = vertex;
-				t_norm.raw[k] = norm;
+				if (i < batches.size())
+					draw_batch(batches[i], batch_visible.data() + batch_start[i], batch_count[i], vert_cam_mat, norm_cam_mat, lights, batch_lists[i], depth_sort ? &batch_runs[i] : NULL);
+				else
+					draw_static_batch(static_batches[i - batches.size()], vert_cam_mat, norm_cam_mat, lights, batch_lists[i]);
 			}
-			//get new face normal
-			rotate(f_norm, i);
-			f_norm = Vec3f(norm_cam_mat * Vec4f(f_norm));
+		});
 
-			//otherwise add triangles to draw list
-			t_draws.push_back(t_draw);
-			t_norms.push_back(t_norm);
-			f_norms.push_back(f_norm);
+	//occluders are already the biggest and nearest, they go first either way
+	for (int i = 0; i < occluder_lists.size(); i++)
+		out.tris.insert(out.tris.end(), occluder_lists[i].begin(), occluder_lists[i].end());
+	if (!depth_sort)
+	{
+		for (int i = 0; i < num_lists; i++)
+			out.tris.insert(out.tris.end(), batch_lists[i].begin(), batch_lists[i].end());
+	}
+	else
+	{
+		//a static batch is one run keyed by its bounding sphere
+		for (int i = 0; i < static_batches.size(); i++)
+		{
+			Vec3f c = Vec3f(static_batches[i].world.val[0][3], static_batches[i].world.val[1][3], static_batches[i].world.val[2][3]);
+			DepthRun run;
+			run.key = depth_key(Vec3f(vert_cam_mat * Vec4f(c)).z - static_batches[i].mesh->get_radius());
+			run.start = 0;
+			run.end = (int)batch_lists[batches.size() + i].size();
+			batch_runs[batches.size() + i].push_back(run);
 		}
 
-		//translate lights to camera world coords
-		for (int j = 0; j < lights.size(); j++)
+		//every instance's triangles go out nearest first, so instances of different meshes and levels interleave by depth
+		//	ties keep list order
+		ArenaVector<uint32_t> keys(arena);
+		ArenaVector<int> order(arena);
+		ArenaVector<const DepthRun*> all_runs(arena);
+		ArenaVector<int> run_list(arena);
+		for (int i = 0; i < num_lists; i++)
 		{
-			lights[j] = Vec3f(vert_cam_mat * Vec4f(lights[j]));
+			for (const DepthRun& run : batch_runs[i])
+			{
+				keys.push_back(run.key);
+				order.push_back((int)order.size());
+				all_runs.push_back(&run);
+				run_list.push_back(i);
+			}
 		}
-		//add cam pos to lights if cam_light set
-		if (cam_light)
-			lights.push_back(Vec3f(0.f, 0.f, 0.f)); //cam pos is origin after transform
-
-		//clip over z bounds
-		clip_z(t_draws, t_norms, f_norms, proj_mat.znear, proj_mat.zfar);
-
-		//check if face can be culled (face is facing away from viewpoint)
-		cull(f_norms, t_draws, t_norms);
-
-		//project triangle to screen coords
-		std::vector<Triangle> t_world = t_draws; //copy pre-projected values for lighting
-		projection(t_draws);
-
-		//clip over x and y bounds
-		clip_xy(t_draws, t_norms, t_world);
-
-		//draw all triangles
-		if (t_draws.size() != t_norms.size())
+		radix_sort(keys.data(), order.data(), (int)order.size(), arena);
+		for (int k : order)
 		{
-			log(ERR, "Error occured drawing model... Incorrect triangle or vertex normal count... skipping");
-			continue;
+			const ArenaVector<ScreenTri>& list = batch_lists[run_list[k]];
+			out.tris.insert(out.tris.end(), list.begin() + all_runs[k]->start, list.begin() + all_runs[k]->end);
 		}
-		for (int j = 0; j < t_draws.size(); j++)
-			triangle_to_screen(t_draws[j], t_norms[j], t_world[j], lights, models[i].get()->get_color());
 	}
+	if (occluding)
+		stats_set("occluded instances", (double)num_occluded.load());
 }
 
 /********************************************************************
@@ -858,63 +1300,1031 @@ void Scene::draw()
 * @param t_draws: traingles to draw
 * @param t_norms: triangle normals
 */
-void Scene::cull(std::vector<Vec3f> &f_norms, std::vector<Triangle> &t_draws, std::vector<Triangle> &t_norms)
+void Scene::cull(ArenaVector<Vec3f> &f_norms, ArenaVector<Triangle> &t_draws, ArenaVector<Triangle> &t_norms)
 {
-	//get the face normal to check
-	std::vector<Triangle> new_draws;
-	std::vector<Triangle> new_norms;
-	std::vector<Vec3f>    new_f_norms;
-	for (int i = 0; i < t_draws.size(); i++)
+	AllocScope scope(ALLOC_CLIP);
+
+	//determine the vector pointing from the camera to each face
+	//get center of face
+	int n = (int)t_draws.size();
+	ArenaVector<Vec3f> centers(n, arena);
+	ArenaVector<Vec3f> face_n(n, arena);
+	ArenaVector<float> facing(n, arena);
+	for (int i = 0; i < n; i++)
 	{
-		Vec3f face_n = f_norms[i];
-
-		//determine the vector pointing from the camera to this face
-		//get center of face
 		Vec3f center;
 		for (int j = 0; j < 3; j++)
 		{
 			center = center + t_draws[i].raw[j];
 		}
-		center = center / 3.f;
-		Vec3f face_to_cam = Vec3f(0.f, 0.f, 0.f) - center;  //camera position is 0 relative to object because of transform
+		centers[i] = center / 3.f;
+	}
+	simd_normalize(f_norms.data(), face_n.data(), n);
+	simd_facing(Vec3f(0.f, 0.f, 0.f), centers.data(), face_n.data(), facing.data(), n);  //camera position is 0 relative to object because of transform
 
+	//faces that can be seen are moved to the front in place
+	int kept = 0;
+	for (int i = 0; i < n; i++)
+	{
 		//if the dot product between the camera and normal is less than 90 degrees, then we can draw
-		if (face_to_cam.norm().dot(face_n.norm()) >= -0.1f) //account for some error
+		if (facing[i] >= -0.1f) //account for some error
 		{
-			new_draws.push_back(t_draws[i]);
-			new_norms.push_back(t_norms[i]);
+			t_draws[kept] = t_draws[i];
+			t_norms[kept] = t_norms[i];
+			kept++;
 		}
 
 		//else we don't need to draw since face can't be seen
 	}
-	//redirect t_draws and t_norms to new vectors
-	t_draws.clear();
-	t_norms.clear();
-	t_draws = new_draws;
-	t_norms = new_norms;
+	//drop faces past the last kept one
+	t_draws.erase(t_draws.begin() + kept, t_draws.end());
+	t_norms.erase(t_norms.begin() + kept, t_norms.end());
 }
 
 /**
-* Rotates an object based off rotation matrix
-* Object should be centered around origin at this point
-* @param old: vertex data to modify
-* @param i: index of rotation matrix
+* Moves meshes that finished loading onto their placeholder instances
+*/
+void Scene::poll_loads()
+{
+	for (int j = 0; j < pending.size(); j++)
+	{
+		if (pending[j].second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			continue;
+
+		int i = pending[j].first;
+		models[i] = pending[j].second.get();
+		if (!models[i])
+			log(ERR, "mesh for model " + std::to_string(i) + " failed to load, leaving it hidden");
+		batches_dirty = true;
+		statics_dirty = statics_dirty || statics[i];
+		redraw_all = true;
+
+		//swap remove
+		pending[j] = pending.back();
+		pending.pop_back();
+		j--;
+	}
+}
+
+/**
+* Groups registered instances by the mesh they share
+* Called lazily from draw after instances are added
+*/
+void Scene::build_batches()
+{
+	batches.clear();
+	inst_batch.assign(models.size(), -1);
+	std::unordered_map<const Model*, int> lookup;
+	for (int i = 0; i < models.size(); i++)
+	{
+		//placeholders stay hidden until loaded, static instances are drawn from static batches if those are on
+		if (!models[i] || (static_batching && statics[i]))
+			continue;
+		auto b = lookup.find(models[i].get());
+		if (b == lookup.end())
+		{
+			Batch batch;
+			batch.mesh = models[i];
+			lookup[models[i].get()] = (int)batches.size();
+			batches.push_back(batch);
+			b = lookup.find(models[i].get());
+		}
+		batches[b->second].instances.push_back(i);
+		inst_batch[i] = b->second;
+	}
+	batches_dirty = false;
+	log(DEBUG1, "built " + std::to_string(batches.size()) + " instance batches");
+}
+
+/**
+* Bakes loaded static instances into one mesh per color, in world space
+* Needs world transforms to be up to date
+*/
+void Scene::build_static_batches()
+{
+	static_batches.clear();
+	statics_dirty = false;
+	if (!static_batching)
+		return;
+
+	//group by color, the only per-instance shading state
+	std::unordered_map<uint32_t, std::vector<int>> groups;
+	std::vector<uint32_t> order;  //colors in order first seen, so batches come out the same every time
+	for (int i = 0; i < models.size(); i++)
+	{
+		if (!models[i] || !statics[i])
+			continue;
+		uint32_t key = ((uint32_t)colors[i].R << 16) | ((uint32_t)colors[i].G << 8) | (uint32_t)colors[i].B;
+		auto g = groups.find(key);
+		if (g == groups.end())
+		{
+			order.push_back(key);
+			g = groups.insert(std::make_pair(key, std::vector<int>())).first;
+		}
+		g->second.push_back(i);
+	}
+
+	for (uint32_t key : order)
+	{
+		const std::vector<int>& group = groups[key];
+		std::vector<const Model*> meshes;
+		std::vector<Mat4x4f> vert_mats;
+		std::vector<Mat4x4f> norm_mats;
+		for (int i : group)
+		{
+			meshes.push_back(models[i].get());
+			vert_mats.push_back(world_verts[i]);
+			norm_mats.push_back(world_norms[i]);
+		}
+
+		StaticBatch batch;
+		Vec3f center;
+		batch.mesh = std::shared_ptr<const Model>(Model::merge(meshes, vert_mats, norm_mats, center));
+		batch.world.val[0][3] = center.x;
+		batch.world.val[1][3] = center.y;
+		batch.world.val[2][3] = center.z;
+		batch.color = colors[group[0]];
+		batch.num_instances = (int)group.size();
+		static_batches.push_back(batch);
+	}
+	log(DEBUG1, "baked static instances into " + std::to_string(static_batches.size()) + " static batches");
+}
+
+/**
+* Flags an instance as changed so the next frame redraws the rows it covers
+* @param index: index of instance
+*/
+void Scene::mark_moved(int index)
+{
+	if (moved[index])
+		return;
+	moved[index] = 1;
+	num_moved++;
+}
+
+/**
+* Flags an instance's world transform as out of date, along with the rows it covers
+* @param index: index of instance
+*/
+void Scene::mark_transformed(int index)
+{
+	world_dirty[index] = 1;
+	mark_moved(index);
+	statics_dirty = statics_dirty || statics[index];
+}
+
+/**
+* Rebuilds world transforms of dynamic instances and of static instances that were moved since last frame
+* Only the camera transform is left to apply per frame for everything else
+*/
+void Scene::update_world()
+{
+	jobs_parallel_for(0, (int)models.size(), WORLD_GRAIN, [this](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				if (statics[i] && !world_dirty[i])
+					continue;
+
+				//rotation happens before translation and scale, normals are only rotated
+				Mat4x4f rot = rotates[i].to_mat();
+				world_verts[i] = (scales[i] * translates[i]) * rot;
+				world_norms[i] = rot;
+				world_dirty[i] = 0;
+			}
+		});
+}
+
+/**
+* Gets an instance's bounding sphere in world space
+* @param index: index of loaded instance
+* @param c: set to center of sphere
+* @param radius: set to radius of sphere after scaling
+*/
+void Scene::instance_bounds(int index, Vec3f& c, float& radius) const
+{
+	//mesh is centered on its local origin, so the center is the translation of the world matrix
+	c = Vec3f(world_verts[index].val[0][3], world_verts[index].val[1][3], world_verts[index].val[2][3]);
+	radius = models[index]->get_radius() * fabsf(scales[index].val[0][0]);
+}
+
+/**
+* Rebuilds the bvh over every loaded instance
+* Needs world transforms to be up to date
 */
-void Scene::rotate(Vec3f &old, int i)
+void Scene::build_bvh()
 {
-	//iterate through each rotation on 
-	for (int j = 0; j < 3; j++)
+	std::vector<Vec3f> centers(models.size());
+	std::vector<float> radii(models.size(), 0.f);
+	std::vector<uint8_t> active(models.size(), 0);
+	for (int i = 0; i < models.size(); i++)
 	{
-		Quaternion q = rotates[i].raw[rotates[i].order[j]];
-		Quaternion q_neg = q.conjugate();
-		old = (Vec3f)(q * Quaternion(old) * q_neg);
+		if (!models[i])
+			continue;
+		instance_bounds(i, centers[i], radii[i]);
+		active[i] = 1;
 	}
+	bvh.build(centers, radii, active);
+	bvh_dirty = false;
 }
+
+/**
+* Brings the bvh up to date with instances changed since the last frame
+* Changed instances only refit the boxes above them, the tree is rebuilt once instances were added
+*	or refits have let it get too loose to cull well
+* Needs world transforms to be up to date
+*/
+void Scene::update_bvh()
+{
+	if (bvh_dirty)
+	{
+		build_bvh();
+		return;
+	}
+	if (num_moved == 0)
+		return;
+
+	for (int i = 0; i < moved.size(); i++)
+	{
+		if (!moved[i] || !bvh.contains(i))
+			continue;
+		Vec3f c;
+		float radius;
+		instance_bounds(i, c, radius);
+		bvh.update(i, c, radius);
+	}
+	if (bvh.refit())
+	{
+		log(DEBUG2, "bvh grew too loose from moving instances, rebuilding");
+		build_bvh();
+	}
+}
+
+/**
+* Finds the instance whose bounding sphere a ray hits first
+* Bounds are those of the last built frame
+* @param origin: start of ray in world space
+* @param dir: direction of ray, does not need to be normalized
+* @param t: set to distance of hit along ray in lengths of dir
+* @return: index of instance hit, -1 if none
+*/
+int Scene::raycast(const Vec3f& origin, const Vec3f& dir, float& t) const
+{
+	return bvh.raycast(origin, dir, t);
+}
+
+/**
+* Finds every instance whose bounding sphere holds a point
+* Bounds are those of the last built frame
+* @param p: point in world space
+* @param out: set to indices of instances found, in instance order
+*/
+void Scene::query_point(const Vec3f& p, std::vector<int>& out) const
+{
+	out.clear();
+	bvh.query([&](const Vec3f& c, float r) { return (c.dist(p) <= r) ? BVH_INTERSECTS : BVH_OUTSIDE; }, out);
+	std::sort(out.begin(), out.end());
+}
+
+/**
+* Checks if a bounding sphere is at least partly inside the view frustum
+* Uses the same planes as clip_z and clip_xy so nothing that could be drawn is rejected
+* @param c: center of sphere in camera coords
+* @param radius: radius of bounding sphere after scaling
+* @return: false if sphere is fully outside of the frustum
+*/
+bool Scene::in_frustum(const Vec3f& c, float radius) const
+{
+	//near and far planes
+	if (c.z + radius < proj_mat.znear || c.z - radius > proj_mat.zfar)
+		return false;
+
+	//side planes pass through the camera, a point is inside while |proj * x| <= 0.9 * z
+	float sx = proj_mat.mat.val[0][0];
+	float sy = proj_mat.mat.val[1][1];
+	float len_x = sqrtf(sx * sx + 0.81f);
+	float len_y = sqrtf(sy * sy + 0.81f);
+	if ((sx * c.x - 0.9f * c.z) / len_x > radius || (-sx * c.x - 0.9f * c.z) / len_x > radius)
+		return false;
+	if ((sy * c.y - 0.9f * c.z) / len_y > radius || (-sy * c.y - 0.9f * c.z) / len_y > radius)
+		return false;
+
+	return true;
+}
+
+/**
+* Checks how much of a bounding sphere is inside the view frustum, against the same planes as in_frustum
+* @param c: center of sphere in camera coords
+* @param radius: radius of bounding sphere after scaling
+* @return: BVH_INSIDE if the whole sphere is inside, BVH_OUTSIDE if none of it is, BVH_INTERSECTS otherwise
+*/
+BVH_TEST Scene::frustum_test(const Vec3f& c, float radius) const
+{
+	if (!in_frustum(c, radius))
+		return BVH_OUTSIDE;
+
+	//inside once the sphere is past every plane by its radius
+	if (c.z - radius < proj_mat.znear || c.z + radius > proj_mat.zfar)
+		return BVH_INTERSECTS;
+	float sx = proj_mat.mat.val[0][0];
+	float sy = proj_mat.mat.val[1][1];
+	float len_x = sqrtf(sx * sx + 0.81f);
+	float len_y = sqrtf(sy * sy + 0.81f);
+	if ((sx * c.x - 0.9f * c.z) / len_x > -radius || (-sx * c.x - 0.9f * c.z) / len_x > -radius)
+		return BVH_INTERSECTS;
+	if ((sy * c.y - 0.9f * c.z) / len_y > -radius || (-sy * c.y - 0.9f * c.z) / len_y > -radius)
+		return BVH_INTERSECTS;
+
+	return BVH_INSIDE;
+}
+
+/**
+* Gets pixels along one screen axis a bounding sphere can reach once projected
+* Clipping drops everything in front of the near plane first, so only the part of the sphere past it counts
+* Pixels are a conservative bound, one extra pixel is added on each side for rounding
+* @param p: center of sphere along axis in camera coords
+* @param radius: radius of bounding sphere after scaling
+* @param near_z: nearest depth of sphere past the near plane
+* @param far_z: farthest depth of sphere
+* @param scale: projection scale of axis
+* @param size: pixels along axis
+* @param lo: set to first pixel covered, clamped to the buffer
+* @param hi: set to last pixel covered, clamped to the buffer
+*/
+static void screen_span(float p, float radius, float near_z, float far_z, float scale, int size, int& lo, int& hi)
+{
+	//largest and smallest p / z over the sphere, then to the same [-1, 1] range as projection
+	float top = p + radius;
+	float bottom = p - radius;
+	float p_max = scale * ((top >= 0.f) ? top / near_z : top / far_z);
+	float p_min = scale * ((bottom >= 0.f) ? bottom / far_z : bottom / near_z);
+	p_max = (p_max > 1.f) ? 1.f : ((p_max < -1.f) ? -1.f : p_max);
+	p_min = (p_min > 1.f) ? 1.f : ((p_min < -1.f) ? -1.f : p_min);
+
+	//same mapping to pixels as triangle_to_screen
+	float s = (float)size;
+	lo = (int)floorf((p_min + 1.f) * s / 2.f) - 1;
+	hi = (int)ceilf((p_max + 1.f) * s / 2.f) + 1;
+	lo = (lo < 0) ? 0 : lo;
+	hi = (hi > size - 1) ? size - 1 : hi;
+}
+
+/**
+* Gets rows of the frame being built a bounding sphere can reach once projected
+* @param c: center of sphere in camera coords
+* @param radius: radius of bounding sphere after scaling
+* @return: rows covered, clamped to the buffer
+*/
+Scene::RowSpan Scene::screen_rows(const Vec3f& c, float radius) const
+{
+	float near_z = (c.z - radius > proj_mat.znear) ? c.z - radius : proj_mat.znear;
+	float far_z = c.z + radius;
+	if (far_z < near_z)
+		return RowSpan();
+
+	int lo, hi;
+	screen_span(c.y, radius, near_z, far_z, proj_mat.mat.val[1][1], out_height, lo, hi);
+	return RowSpan(lo, hi);
+}
+
+/**
+* Quantizes camera space depth for sorting, everything in front of the near plane or past the far plane
+*	shares the key of that plane
+* @param z: depth in camera coords
+* @return: key, smaller is nearer
+*/
+uint32_t Scene::depth_key(float z) const
+{
+	float t = (z - proj_mat.znear) / (proj_mat.zfar - proj_mat.znear);
+	t = (t < 0.f) ? 0.f : ((t > 1.f) ? 1.f : t);
+	return (uint32_t)(t * DEPTH_KEY_MAX);
+}
+
+/**
+* Checks if a bounding sphere is entirely behind this frame's occluders
+* @param c: center of sphere in camera coords
+* @param radius: radius of bounding sphere after scaling
+* @return: true if nothing inside sphere could be drawn over the occluders
+*/
+bool Scene::occluded(const Vec3f& c, float radius) const
+{
+	//spheres reaching the near plane could be drawn anywhere in front
+	float near_z = c.z - radius;
+	if (near_z <= proj_mat.znear)
+		return false;
+
+	int x_lo, x_hi, y_lo, y_hi;
+	screen_span(c.x, radius, near_z, c.z + radius, proj_mat.mat.val[0][0], out_width, x_lo, x_hi);
+	screen_span(c.y, radius, near_z, c.z + radius, proj_mat.mat.val[1][1], out_height, y_lo, y_hi);
+
+	//nearest depth after projection, the same z / w as projection gives
+	float depth = proj_mat.q * (1.f - proj_mat.znear / near_z);
+	return occlusion.occluded(x_lo, y_lo, x_hi, y_hi, depth);
+}
+
+/**
+* Gets rows of the frame being built an instance can reach where it is now
+* @param index: index of instance
+* @param vert_cam_mat: camera matrix for vertices
+* @return: rows covered, empty if instance is outside the frustum
+*/
+Scene::RowSpan Scene::instance_rows(int index, const Mat4x4f& vert_cam_mat) const
+{
+	Mat4x4f to_cam = vert_cam_mat * world_verts[index];
+	float radius = models[index]->get_radius() * fabsf(scales[index].val[0][0]);
+	Vec3f c = Vec3f(to_cam.val[0][3], to_cam.val[1][3], to_cam.val[2][3]);
+	if (!in_frustum(c, radius))
+		return RowSpan();
+	return screen_rows(c, radius);
+}
+
+/**
+* Picks the level of detail of an instance from its projected size on screen
+* A level is dropped every time the projected radius halves below LOD_PIXELS, which roughly keeps
+*	the number of triangles per pixel constant since each level has about a quarter of the faces of the last
+* The instance only changes level once it is past a switch point by lod_hysteresis levels, so instances
+*	sitting near a switch point don't flicker between levels
+* @param index: index of instance
+* @param depth: camera space depth of instance center
+* @param radius: radius of instance bounding sphere after scaling
+* @param num_lods: number of levels available for instance mesh
+* @return: level to draw
+*/
+int Scene::select_lod(int index, float depth, float radius, int num_lods)
+{
+	int cur = (lod_levels[index] < num_lods) ? lod_levels[index] : num_lods - 1;
+
+	//camera inside or touching bounding sphere always gets full detail
+	float level = 0.f;
+	if (depth > radius)
+	{
+		//projected radius in pixels, using y scale of projection matrix and the height the frame is built for
+		float px = (radius * proj_mat.mat.val[1][1] / depth) * (float)out_height / 2.f;
+		level = (px > 0.f) ? log2f(LOD_PIXELS / px) : (float)num_lods;
+	}
+
+	int next = cur;
+	if (level >= (float)(cur + 1) + lod_hysteresis)
+		next = (int)floorf(level - lod_hysteresis);
+	else if (level < (float)cur - lod_hysteresis)
+		next = (int)floorf(level + lod_hysteresis);
+	next = (next < 0) ? 0 : next;
+	next = (next > num_lods - 1) ? num_lods - 1 : next;
+
+	lod_levels[index] = next;
+	return next;
+}
+
+/**
+* Draws instances of one mesh
+* Transforms of visible instances are packed into arrays per level of detail
+* @param batch: mesh and the instances using it
+* @param instances: instances of batch the bvh found in the frustum, in instance order, or nearest first when depth sorting
+* @param num_instances: number of instances in list
+* @param vert_cam_mat: camera matrix for vertices
+* @param norm_cam_mat: camera matrix for normals
+* @param lights: lights in camera coords
+* @param out: list to add screen space triangles to
+* @param runs: set to the triangles of each instance with its depth key so build_frame can interleave batches by depth,
+*	null if not sorting
+*/
+void Scene::draw_batch(const Batch& batch, const int* instances, int num_instances, const Mat4x4f& vert_cam_mat, const Mat4x4f& norm_cam_mat, const ArenaVector<Vec3f>& lights, ArenaVector<ScreenTri>& out, ArenaVector<DepthRun>* runs)
+{
+	const Model* mesh = batch.mesh.get();
+	int num_lods = mesh->num_lods();
+
+	//pack per-instance data, rejecting instances outside the redrawn rows before any vertex work
+	//	instances culled by the bvh keep the rows they last covered, which only ever widens a later redraw
+	bool partial = frame_rows.lo > 0 || frame_rows.hi < out_height - 1;
+	ArenaVector<int> visible(arena);
+	ArenaVector<int> levels(arena);
+	ArenaVector<Mat4x4f> vert(arena);
+	ArenaVector<Mat4x4f> norm(arena);
+	ArenaVector<uint32_t> keys(arena);
+	visible.reserve(num_instances);
+	levels.reserve(num_instances);
+	vert.reserve(num_instances);
+	norm.reserve(num_instances);
+	keys.reserve((runs != NULL) ? num_instances : 0);
+	for (int j = 0; j < num_instances; j++)
+	{
+		int i = instances[j];
+		Mat4x4f to_cam = vert_cam_mat * world_verts[i];
+		float radius = mesh->get_radius() * fabsf(scales[i].val[0][0]);
+		//mesh is centered on its local origin, so the center is the translation of the matrix
+		Vec3f c = Vec3f(to_cam.val[0][3], to_cam.val[1][3], to_cam.val[2][3]);
+
+		//instances not reaching the redrawn rows are kept from the last frame, along with their rows
+		RowSpan rows = screen_rows(c, radius);
+		if (partial && !rows.overlaps(frame_rows))
+			continue;
+		inst_rows[i] = rows;
+
+		//instances entirely behind this frame's occluders would not change a pixel
+		if (occluding && occluded(c, radius))
+		{
+			num_occluded++;
+			continue;
+		}
+
+		visible.push_back(i);
+		levels.push_back(select_lod(i, to_cam.val[2][3], radius, num_lods));
+		vert.push_back(to_cam);
+		norm.push_back(norm_cam_mat * world_norms[i]);
+		if (runs != NULL)
+			keys.push_back(depth_key(c.z - radius));
+	}
+
+	//each level of detail is drawn from its own mesh, instances keep their list order within a level
+	//	and when sorting each one's triangles become a run, so regrouping by level never costs depth order
+	ArenaVector<int> members(arena);
+	ArenaVector<int> ranges(arena);
+	for (int l = 0; l < num_lods; l++)
+	{
+		ArenaVector<COLOR> inst_colors(arena);
+		ArenaVector<Mat4x4f> inst_vert(arena);
+		ArenaVector<Mat4x4f> inst_norm(arena);
+		members.clear();
+		for (int j = 0; j < visible.size(); j++)
+		{
+			if (levels[j] != l)
+				continue;
+			inst_colors.push_back(colors[visible[j]]);
+			inst_vert.push_back(vert[j]);
+			inst_norm.push_back(norm[j]);
+			members.push_back(j);
+		}
+		if (inst_colors.empty())
+			continue;
+
+		ranges.resize((runs != NULL) ? members.size() + 1 : 0);
+		draw_instances(mesh->get_lod(l), inst_colors, inst_vert, inst_norm, lights, out, (runs != NULL) ? ranges.data() : NULL);
+		for (int k = 0; runs != NULL && k < members.size(); k++)
+		{
+			DepthRun run;
+			run.key = keys[members[k]];
+			run.start = ranges[k];
+			run.end = ranges[k + 1];
+			runs->push_back(run);
+		}
+	}
+}
+
+/**
+* Draws the instances biggest on screen and rasterizes them into the occlusion buffer
+* Occluders are taken out of the lists of visible instances, what is left is tested against them when drawn
+* @param batch_start: start of each batch's visible instances in batch_visible
+* @param batch_count: number of visible instances of each batch, occluders are taken off
+* @param batch_visible: visible instances grouped by batch, occluders are taken out of each batch's run
+* @param vert_cam_mat: camera matrix for vertices
+* @param norm_cam_mat: camera matrix for normals
+* @param lights: lights in camera coords
+* @param lists: one list per batch, set to screen triangles of its occluders
+*/
+void Scene::draw_occluders(const ArenaVector<int>& batch_start, ArenaVector<int>& batch_count, ArenaVector<int>& batch_visible, const Mat4x4f& vert_cam_mat, const Mat4x4f& norm_cam_mat, const ArenaVector<Vec3f>& lights, ArenaVector<ArenaVector<ScreenTri>>& lists)
+{
+	//candidates cover a large part of the view and reach the redrawn rows, biggest first
+	bool partial = frame_rows.lo > 0 || frame_rows.hi < out_height - 1;
+	ArenaVector<std::pair<float, int>> candidates(arena);
+	for (int b = 0; b < batches.size(); b++)
+	{
+		for (int j = batch_start[b]; j < batch_start[b] + batch_count[b]; j++)
+		{
+			Vec3f c;
+			float radius;
+			instance_bounds(batch_visible[j], c, radius);
+			c = Vec3f(vert_cam_mat * Vec4f(c));
+			float size = radius / ((c.z > proj_mat.znear) ? c.z : proj_mat.znear);
+			if (size < OCCLUDER_MIN_SIZE || (partial && !screen_rows(c, radius).overlaps(frame_rows)))
+				continue;
+			candidates.push_back(std::make_pair(-size, j));
+		}
+	}
+	if (candidates.empty())
+		return;
+	std::sort(candidates.begin(), candidates.end());
+	ArenaVector<uint8_t> chosen(batch_visible.size(), 0, arena);
+	for (int k = 0; k < candidates.size() && k < OCCLUDER_MAX; k++)
+		chosen[candidates[k].second] = 1;
+
+	//split each batch's run into occluders and the rest, both keep instance order
+	ArenaVector<int> occ_visible(arena);
+	ArenaVector<int> occ_start(batches.size(), 0, arena);
+	ArenaVector<int> occ_count(batches.size(), 0, arena);
+	occ_visible.reserve(OCCLUDER_MAX);
+	for (int b = 0; b < batches.size(); b++)
+	{
+		occ_start[b] = (int)occ_visible.size();
+		int kept = batch_start[b];
+		for (int j = batch_start[b]; j < batch_start[b] + batch_count[b]; j++)
+		{
+			if (chosen[j])
+				occ_visible.push_back(batch_visible[j]);
+			else
+				batch_visible[kept++] = batch_visible[j];
+		}
+		occ_count[b] = (int)occ_visible.size() - occ_start[b];
+		batch_count[b] = kept - batch_start[b];
+	}
+
+	jobs_parallel_for(0, (int)batches.size(), 1, [&](int b_begin, int b_end)
+		{
+			AllocScope scope(ALLOC_DRAW);  //runs on a worker
+			for (int b = b_begin; b < b_end; b++)
+			{
+				if (occ_count[b] > 0)
+					draw_batch(batches[b], occ_visible.data() + occ_start[b], occ_count[b], vert_cam_mat, norm_cam_mat, lights, lists[b], NULL);
+			}
+		});
+
+	occlusion.clear(out_width, out_height);
+	for (int b = 0; b < lists.size(); b++)
+		occlusion.raster(lists[b].data(), (int)lists[b].size());
+	occluding = true;
+}
+
+/**
+* Draws a static batch as one instance, its meshlets are culled on their own like any other mesh
+* @param batch: baked static instances
+* @param vert_cam_mat: camera matrix for vertices
+* @param norm_cam_mat: camera matrix for normals
+* @param lights: lights in camera coords
+* @param out: list to add screen space triangles to
+*/
+void Scene::draw_static_batch(const StaticBatch& batch, const Mat4x4f& vert_cam_mat, const Mat4x4f& norm_cam_mat, const ArenaVector<Vec3f>& lights, ArenaVector<ScreenTri>& out)
+{
+	Mat4x4f to_cam = vert_cam_mat * batch.world;
+	Vec3f c = Vec3f(to_cam.val[0][3], to_cam.val[1][3], to_cam.val[2][3]);
+	float radius = batch.mesh->get_radius();
+	if (!in_frustum(c, radius))
+		return;
+	bool partial = frame_rows.lo > 0 || frame_rows.hi < out_height - 1;
+	if (partial && !screen_rows(c, radius).overlaps(frame_rows))
+		return;
+	if (occluding && occluded(c, radius))
+	{
+		num_occluded++;
+		return;
+	}
+
+	ArenaVector<COLOR> inst_colors(1, batch.color, arena);
+	ArenaVector<Mat4x4f> inst_vert(1, to_cam, arena);
+	ArenaVector<Mat4x4f> inst_norm(1, norm_cam_mat, arena);
+	draw_instances(batch.mesh.get(), inst_colors, inst_vert, inst_norm, lights, out, NULL);
+}
+
+/**
+* Checks whether every face of a meshlet points away from the camera
+* A face is culled by Scene::cull once the angle between its normal and the view ray is under acos(0.1),
+*	so a meshlet can go once the view ray to any point in its sphere plus its cone angle stays under that
+* @param center: meshlet center in camera coords (camera is the origin)
+* @param radius: meshlet radius after scaling
+* @param axis: normal cone axis in camera coords
+* @param cone_angle: normal cone half angle
+* @return: true if whole meshlet can be skipped
+*/
+static bool cone_culled(const Vec3f& center, float radius, const Vec3f& axis, float cone_angle)
+{
+	if (cone_angle >= BACKFACE_LIMIT)
+		return false;
+	float dist = center.value();
+	if (dist <= radius)
+		return false;
+
+	float cos_view = center.dot(axis) / dist;
+	cos_view = (cos_view > 1.f) ? 1.f : ((cos_view < -1.f) ? -1.f : cos_view);
+	return acosf(cos_view) + asinf(radius / dist) + cone_angle < BACKFACE_LIMIT;
+}
+
+/**
+* Transforms each run of consecutive vectors whose mask has a bit set, so runs go through the batched kernel
+* @param mat: transform
+* @param in: vectors of mesh
+* @param out: transformed vectors, same indexing as in
+* @param masks: visibility bits of each vector
+* @param bit: bit of instance being transformed
+* @param begin: first vector to look at
+* @param end: one past last vector to look at
+*/
+static void transform_masked(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, const uint32_t* masks, uint32_t bit, int begin, int end)
+{
+	int v = begin;
+	while (v < end)
+	{
+		while (v < end && !(masks[v] & bit))
+			v++;
+		int run = v;
+		while (v < end && (masks[v] & bit))
+			v++;
+		if (v > run)
+			simd_transform(mat, in + run, out + run, v - run);
+	}
+}
+
+/**
+* Draws instances that share one mesh
+* For each group of INSTANCE_BATCH instances, meshlets are first tested against the frustum and their
+*	normal cone per instance, then only vertices of meshlets some instance can see are transformed,
+*	streaming each vertex once for the whole group
+* Culling and transforms are split into chunks on the job pool
+* With depth sorting, each instance of a mesh with many meshlets draws its nearest meshlets first
+* @param mesh: mesh to draw
+* @param inst_colors: color of each instance
+* @param inst_vert: local to camera matrix of each instance
+* @param inst_norm: normal matrix of each instance
+* @param lights: lights in camera coords
+* @param out: list to add screen space triangles to, instance by instance
+* @param ranges: if not null, set to where each instance's triangles start in out, followed by the end of the last one
+*/
+void Scene::draw_instances(const Model* mesh, const ArenaVector<COLOR>& inst_colors, const ArenaVector<Mat4x4f>& inst_vert, const ArenaVector<Mat4x4f>& inst_norm, const ArenaVector<Vec3f>& lights, ArenaVector<ScreenTri>& out, int* ranges)
+{
+	const std::vector<Vec3f>& vertices = mesh->get_vertices();
+	const std::vector<Vec3f>& v_normals = mesh->get_vert_normals();
+	const std::vector<Vec3f>& f_normals = mesh->get_face_normals();
+	const std::vector<Meshlet>& meshlets = mesh->get_meshlets();
+
+	//transform a group of instances per pass over the mesh
+	//instance b of the group owns entries [b * size, (b + 1) * size) of each list
+	size_t group = (inst_colors.size() < INSTANCE_BATCH) ? inst_colors.size() : INSTANCE_BATCH;
+	size_t n_verts = vertices.size();
+	size_t n_v_norms = v_normals.size();
+	size_t n_f_norms = f_normals.size();
+	ArenaVector<Vec3f> t_verts(group * n_verts, arena);
+	ArenaVector<Vec3f> t_v_norms(group * n_v_norms, arena);
+	ArenaVector<Vec3f> t_f_norms(group * n_f_norms, arena);
+	ArenaVector<uint32_t> masks(meshlets.size(), arena);  //bit b set if instance b of group can see meshlet
+	ArenaVector<uint32_t> v_masks(n_verts, arena);  //same bits gathered per vertex, normal and face
+	ArenaVector<uint32_t> n_masks(n_v_norms, arena);
+	ArenaVector<uint32_t> f_masks(n_f_norms, arena);
+	ArenaVector<GeometryChunk> chunks(arena);
+	ArenaVector<int> meshlet_ids(arena);  //visible meshlets of each instance of the group, one run per instance
+
+	//meshes with many meshlets are drawn nearest meshlet first when sorting
+	bool sort_meshlets = depth_sort && meshlets.size() >= CLUSTER_SORT_MIN;
+	ArenaVector<uint32_t> m_keys(sort_meshlets ? group * meshlets.size() : 0, arena);  //instance b owns entries [b * size, (b + 1) * size)
+	ArenaVector<uint32_t> run_keys(arena);
+	for (int start = 0; start < inst_colors.size(); start += INSTANCE_BATCH)
+	{
+		int count = ((int)inst_colors.size() - start < INSTANCE_BATCH) ? (int)inst_colors.size() - start : INSTANCE_BATCH;
+
+		//cull meshlets per instance before touching vertices
+		jobs_parallel_for(0, (int)meshlets.size(), MESHLET_GRAIN, [&](int m_begin, int m_end)
+			{
+				for (int m = m_begin; m < m_end; m++)
+				{
+					masks[m] = 0;
+					Vec4f c = Vec4f(meshlets[m].center);
+					Vec4f a = Vec4f(meshlets[m].axis);
+					for (int b = 0; b < count; b++)
+					{
+						const Mat4x4f& mat = inst_vert[start + b];
+						//matrix is rotation times uniform scale, so scale is length of any column
+						float scale = sqrtf(mat.val[0][0] * mat.val[0][0] + mat.val[1][0] * mat.val[1][0] + mat.val[2][0] * mat.val[2][0]);
+						float radius = meshlets[m].radius * scale;
+						Vec3f center = Vec3f(mat * c);
+						if (!in_frustum(center, radius))
+							continue;
+						if (cone_culled(center, radius, Vec3f(inst_norm[start + b] * a), meshlets[m].cone_angle))
+							continue;
+						masks[m] |= (1u << b);
+						if (sort_meshlets)
+							m_keys[b * meshlets.size() + m] = depth_key(center.z - radius);
+					}
+				}
+			});
+
+		//spread meshlet bits to the vertices they use, meshlets share vertices so chunks of vertices
+		//	rather than meshlets are handed to the job pool
+		std::fill(v_masks.begin(), v_masks.end(), 0u);
+		std::fill(n_masks.begin(), n_masks.end(), 0u);
+		for (int m = 0; m < meshlets.size(); m++)
+		{
+			uint32_t mask = masks[m];
+			for (int f : meshlets[m].faces)
+				f_masks[f] = mask;
+			if (mask == 0)
+				continue;
+			for (int v : meshlets[m].verts)
+				v_masks[v] |= mask;
+			for (int v : meshlets[m].norms)
+				n_masks[v] |= mask;
+		}
+
+		//transform only what survived, a chunk of VERTEX_GRAIN vertices stays in cache while each
+		//	instance of the group transforms its visible runs of it
+		jobs_parallel_for(0, (int)vertices.size(), VERTEX_GRAIN, [&](int v_begin, int v_end)
+			{
+				for (int b = 0; b < count; b++)
+					transform_masked(inst_vert[start + b], vertices.data(), t_verts.data() + b * n_verts, v_masks.data(), 1u << b, v_begin, v_end);
+			});
+		jobs_parallel_for(0, (int)v_normals.size(), VERTEX_GRAIN, [&](int v_begin, int v_end)
+			{
+				for (int b = 0; b < count; b++)
+					transform_masked(inst_norm[start + b], v_normals.data(), t_v_norms.data() + b * n_v_norms, n_masks.data(), 1u << b, v_begin, v_end);
+			});
+		jobs_parallel_for(0, (int)f_normals.size(), VERTEX_GRAIN, [&](int f_begin, int f_end)
+			{
+				for (int b = 0; b < count; b++)
+					transform_masked(inst_norm[start + b], f_normals.data(), t_f_norms.data() + b * n_f_norms, f_masks.data(), 1u << b, f_begin, f_end);
+			});
+
+		//list visible meshlets of each instance, nearest first when sorting, then split them into chunks
+		//	of about GEOMETRY_CHUNK_FACES faces so a single huge instance still spreads over every worker
+		chunks.clear();
+		meshlet_ids.clear();
+		for (int b = 0; b < count; b++)
+		{
+			int first = (int)meshlet_ids.size();
+			for (int m = 0; m < meshlets.size(); m++)
+			{
+				if (masks[m] & (1u << b))
+					meshlet_ids.push_back(m);
+			}
+			int last = (int)meshlet_ids.size();
+			if (sort_meshlets)
+			{
+				run_keys.resize(last - first);
+				for (int k = first; k < last; k++)
+					run_keys[k - first] = m_keys[b * meshlets.size() + meshlet_ids[k]];
+				radix_sort(run_keys.data(), meshlet_ids.data() + first, last - first, arena);
+			}
+
+			GeometryChunk chunk;
+			chunk.bit = b;
+			chunk.begin = first;
+			int chunk_faces = 0;
+			for (int k = first; k < last; k++)
+			{
+				chunk_faces += (int)meshlets[meshlet_ids[k]].faces.size();
+				if (chunk_faces >= GEOMETRY_CHUNK_FACES)
+				{
+					chunk.end = k + 1;
+					chunks.push_back(chunk);
+					chunk.begin = k + 1;
+					chunk_faces = 0;
+				}
+			}
+			if (chunk.begin < last)
+			{
+				chunk.end = last;
+				chunks.push_back(chunk);
+			}
+		}
+
+		//each chunk writes its own list, appended in chunk order once all are done
+		ArenaVector<ArenaVector<ScreenTri>> chunk_lists(chunks.size(), ArenaVector<ScreenTri>(arena), arena);
+		jobs_parallel_for(0, (int)chunks.size(), 1, [&](int c_begin, int c_end)
+			{
+				AllocScope scope(ALLOC_DRAW);  //runs on a worker
+				for (int c = c_begin; c < c_end; c++)
+				{
+					const GeometryChunk& chunk = chunks[c];
+					draw_instance(mesh, meshlet_ids.data() + chunk.begin, chunk.end - chunk.begin,
+						t_verts.data() + chunk.bit * n_verts, t_v_norms.data() + chunk.bit * n_v_norms, t_f_norms.data() + chunk.bit * n_f_norms,
+						lights, inst_colors[start + chunk.bit], chunk_lists[c]);
+				}
+			});
+		//chunks are in instance order, instances with nothing left to draw get an empty range
+		int next = 0;
+		for (int c = 0; c < chunk_lists.size(); c++)
+		{
+			for (; ranges != NULL && next <= chunks[c].bit; next++)
+				ranges[start + next] = (int)out.size();
+			out.insert(out.end(), chunk_lists[c].begin(), chunk_lists[c].end());
+		}
+		for (; ranges != NULL && next < count; next++)
+			ranges[start + next] = (int)out.size();
+	}
+	if (ranges != NULL)
+		ranges[inst_colors.size()] = (int)out.size();
+}
+
+/**
+* Runs clipping, culling, projection, and lighting for a run of visible meshlets of one instance
+* Only reads shared state, so chunks of the same frame can run on different workers
+* @param mesh: mesh of instance
+* @param meshlet_ids: meshlets of chunk, drawn in this order
+* @param num_meshlets: number of meshlets in chunk
+* @param t_verts: mesh vertices in camera coords
+* @param t_v_norms: mesh vertex normals in camera coords
+* @param t_f_norms: mesh face normals in camera coords
+* @param lights: lights in camera coords
+* @param color: color of instance
+* @param out: list to add screen space triangles to
+*/
+void Scene::draw_instance(const Model* mesh, const int* meshlet_ids, int num_meshlets, const Vec3f* t_verts, const Vec3f* t_v_norms, const Vec3f* t_f_norms, const ArenaVector<Vec3f>& lights, COLOR color, ArenaVector<ScreenTri>& out)
+{
+	const std::vector<std::vector<Vec3i>>& faces = mesh->get_faces();
+	const std::vector<Meshlet>& meshlets = mesh->get_meshlets();
+
+	//size lists up front so gathering faces doesn't regrow them
+	size_t num_faces = 0;
+	for (int k = 0; k < num_meshlets; k++)
+		num_faces += meshlets[meshlet_ids[k]].faces.size();
+	ArenaVector<Triangle> t_draws(arena);
+	ArenaVector<Triangle> t_norms(arena);
+	ArenaVector<Vec3f> f_norms(arena);
+	t_draws.reserve(num_faces);
+	t_norms.reserve(num_faces);
+	f_norms.reserve(num_faces);
+	for (int k = 0; k < num_meshlets; k++)
+	{
+		for (int j : meshlets[meshlet_ids[k]].faces)
+		{
+			//gather already transformed vertices
+			Triangle t_draw;
+			Triangle t_norm;
+			for (int k = 0; k < 3; k++)
+			{
+				t_draw.raw[k] = t_verts[faces[j][k].i_vert];
+				t_norm.raw[k] = t_v_norms[faces[j][k].i_norm];
+			}
+			t_draws.push_back(t_draw);
+			t_norms.push_back(t_norm);
+			f_norms.push_back(t_f_norms[j]);
+		}
+	}
+
+	//clip over z bounds
+	clip_z(t_draws, t_norms, f_norms, proj_mat.znear, proj_mat.zfar);
+
+	//check if face can be culled (face is facing away from viewpoint)
+	cull(f_norms, t_draws, t_norms);
+
+	//project triangle to screen coords
+	ArenaVector<Triangle> t_world = t_draws; //copy pre-projected values for lighting
+	projection(t_draws);
+
+	//clip over x and y bounds
+	clip_xy(t_draws, t_norms, t_world);
+
+	//add all triangles to frame
+	if (t_draws.size() != t_norms.size())
+	{
+		log(ERR, "Error occured drawing model... Incorrect triangle or vertex normal count... skipping");
+		return;
+	}
+
+	//light every vertex of every triangle at once, wireframe is drawn unlit and deferred frames light pixels after raster
+	//want to go over every light in the scene and determine color value of each vertex based on the vertex normals
+	bool lit = !wireframe && !deferred;
+	int n = (int)t_draws.size() * 3;
+	ArenaVector<float> shade(lit ? n : 0, arena);  //summed dot products
+	if (lit)
+	{
+		ArenaVector<Vec3f> points(n, arena);
+		ArenaVector<Vec3f> normals(n, arena);
+		for (int j = 0; j < t_draws.size(); j++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				points[j * 3 + k] = t_world[j].raw[k];
+				normals[j * 3 + k] = t_norms[j].raw[k];
+			}
+		}
+		simd_normalize(normals.data(), normals.data(), n);
+		simd_shade(lights.data(), (int)lights.size(), points.data(), normals.data(), shade.data(), n);
+	}
+
+	//pick the specialized output loop once per draw rather than testing modes per triangle
+	if (wireframe)
+		emit_triangles<false, false, false>(t_draws, t_norms, NULL, color, out);
+	else if (deferred)
+	{
+		if (flat_shading)
+			emit_triangles<false, true, true>(t_draws, t_norms, NULL, color, out);
+		else
+			emit_triangles<false, false, true>(t_draws, t_norms, NULL, color, out);
+	}
+	else if (flat_shading)
+		emit_triangles<true, true, false>(t_draws, t_norms, shade.data(), color, out);
+	else
+		emit_triangles<true, false, false>(t_draws, t_norms, shade.data(), color, out);
+}
+
+/**
+* Converts every triangle of a draw to screen triangles
+* @param LIT: color vertices from shade, else leave them the instance color
+* @param FLAT: give all three vertices the average light, or normal, of the triangle
+* @param DEFERRED: pack vertex normals for the lighting pass
+* @param t_draws: projected triangles
+* @param t_norms: vertex normals in camera coords, only read if DEFERRED
+* @param shade: summed light of each vertex, 3 per triangle, null if not LIT
+* @param color: color to use in draw
+* @param out: list to add triangles to
+*/
+template <bool LIT, bool FLAT, bool DEFERRED>
+void Scene::emit_triangles(const ArenaVector<Triangle>& t_draws, const ArenaVector<Triangle>& t_norms, const float* shade, COLOR color, ArenaVector<ScreenTri>& out) const
+{
+	for (int j = 0; j < t_draws.size(); j++)
+		triangle_to_screen<LIT, FLAT, DEFERRED>(t_draws[j], t_norms[j], LIT ? shade + j * 3 : NULL, color, out);
+}
+
 /**
 * Projects input vertices to screen space(adds for depth)
 * @param old: vertex data to modify
 */
-void Scene::projection(std::vector<Triangle>& t_draws)
+void Scene::projection(ArenaVector<Triangle>& t_draws)
 {
 	for (int i = 0; i < t_draws.size(); i++)
 	{
@@ -929,14 +2339,21 @@ void Scene::projection(std::vector<Triangle>& t_draws)
 	}
 }
 /**
-* Draws a triangle to the screen
+* Converts a triangle to screen pixels and colors its vertices
 * Assumes vertices are normalized between [-1, 1]
-* Uses wireframe setting to draw in wireframe or solid block
+* Wireframe triangles are left unlit, the raster stage draws them in the instance color
+* Deferred triangles are left unlit too, they carry their normals to the lighting pass instead
+* @param LIT: color vertices from shade, false for wireframe and deferred
+* @param FLAT: color all vertices from the average shade of the triangle, or give them its average normal if DEFERRED
+* @param DEFERRED: pack vertex normals for the lighting pass
 * @param t_draw: triangle to draw
-* @param t_norm: normal vectors of vertices in triangle
+* @param t_norm: vertex normals in camera coords, only read if DEFERRED
+* @param shade: summed light of each vertex, null if not LIT
 * @param color: color to use in draw
+* @param out: list to add triangle to
 */
-void Scene::triangle_to_screen(Triangle &t_draw, Triangle &t_norm, Triangle &t_world, std::vector<Vec3f> lights, COLOR color) const
+template <bool LIT, bool FLAT, bool DEFERRED>
+void Scene::triangle_to_screen(const Triangle &t_draw, const Triangle& t_norm, const float* shade, COLOR color, ArenaVector<ScreenTri>& out) const
 {
 	//assume z values to be between 0 and 1, values outside of range will just not be drawn
 	//assume x and y values in range [-1, 1]
@@ -950,52 +2367,41 @@ void Scene::triangle_to_screen(Triangle &t_draw, Triangle &t_norm, Triangle &t_w
 	temp.B.y += 1.f;
 	temp.C.y += 1.f;
 
-	float w = (float)get_buf_width();
-	float h = (float)get_buf_height();
-	int x0, x1, x2, y0, y1, y2;
-
-	x0 = (int)(temp.A.x * w / 2.f);
-	x1 = (int)(temp.B.x * w / 2.f);
-	x2 = (int)(temp.C.x * w / 2.f);
-	y0 = (int)(temp.A.y * h / 2.f);
-	y1 = (int)(temp.B.y * h / 2.f);
-	y2 = (int)(temp.C.y * h / 2.f);
-
-	/////////////////////////////////////////////////////////////////////
-	//actual drawing of triangles
-	//check if wireframe
-	if (wireframe)
+	float w = (float)out_width;
+	float h = (float)out_height;
+	ScreenTri tri;
+	for (int i = 0; i < 3; i++)
 	{
-		draw_triangle(x0, y0, t_draw.A.z, x1, y1, t_draw.B.z, x2, y2, t_draw.C.z, color);
+		tri.x[i] = (int)(temp.raw[i].x * w / 2.f);
+		tri.y[i] = (int)(temp.raw[i].y * h / 2.f);
+		tri.z[i] = t_draw.raw[i].z;
+		tri.color[i] = color;
 	}
-	//else fill triangle using vertex normals to determine lighting
-	else
-	{
-		//want to go over every light in the scene and determine color value of each vertex based on the vertex normals
-		float color_r[3] = { 0.f, 0.f, 0.f }; //used to accumulate dot products
-		for (auto light : lights)
-		{
-			for (int i = 0; i < 3; i++)
-			{
-				Vec3f light_vec = (light - t_world.raw[i]).norm();
-				float dot = light_vec.dot(t_norm.raw[i].norm());
-				color_r[i] += (dot < 0.f) ? 0.f : dot;
-			}
-		}
 
+	/////////////////////////////////////////////////////////////////////
+	//wireframe is drawn in flat color
+	//else fill triangle using light accumulated from vertex normals
+	if (LIT)
+	{
 		//determine colors based on accumulated dot products
-		COLOR colors[3];
+		float flat = FLAT ? (shade[0] + shade[1] + shade[2]) / 3.f : 0.f;
 		for (int i = 0; i < 3; i++)
 		{
-			if (color_r[i] >= 1.f)
-				colors[i] = color;
-			else if (color_r[i] <= 0.f)
-				colors[i] = 0x0;
+			float s = FLAT ? flat : shade[i];
+			if (s >= 1.f)
+				tri.color[i] = color;
+			else if (s <= 0.f)
+				tri.color[i] = 0x0;
 			else
-				colors[i] = (color * color_r[i]);
+				tri.color[i] = (color * s);
 		}
-
-		//draw filled triangle based on these points
-		fill_triangle(x0, y0, t_draw.A.z, x1, y1, t_draw.B.z, x2, y2, t_draw.C.z, colors[0], colors[1], colors[2]);
 	}
+	if (DEFERRED)
+	{
+		//packing only keeps direction, so the sum stands in for the average
+		uint32_t flat = FLAT ? pack_normal(t_norm.A + t_norm.B + t_norm.C) : 0;
+		for (int i = 0; i < 3; i++)
+			tri.normal[i] = FLAT ? flat : pack_normal(t_norm.raw[i]);
+	}
+	out.push_back(tri);
 }
\ No newline at end of file
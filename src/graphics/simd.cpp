@@ -0,0 +1,492 @@
+#include "simd.hpp"
+#include "../cpu/cpu.hpp"
+#include "../logger/logger.hpp"
+#include <atomic>
+#include <string>
+
+//every path is compiled into the same binary and picked at runtime from the cpu tier,
+//	so functions using wider instructions than the build targets are marked for gcc and clang,
+//	msvc accepts the intrinsics anywhere
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_AVX
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+/********************************************************************
+* Scalar paths, also used for what is left over after the last full group
+********************************************************************/
+/**
+* Transforms points as Vec3f(mat * Vec4f(p))
+*/
+static void transform_scalar(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, int n)
+{
+	for (int i = 0; i < n; i++)
+		out[i] = Vec3f(mat * Vec4f(in[i]));
+}
+
+/**
+* Normalizes vectors as v.norm()
+*/
+static void normalize_scalar(const Vec3f* in, Vec3f* out, int n)
+{
+	for (int i = 0; i < n; i++)
+		out[i] = in[i].norm();
+}
+
+/**
+* Dots vectors against c as v.dot(c)
+*/
+static void dot_scalar(const Vec3f* in, const Vec3f& c, float* out, int n)
+{
+	for (int i = 0; i < n; i++)
+		out[i] = in[i].dot(c);
+}
+
+/**
+* Cosine between direction to from and normal as (from - p).norm().dot(n)
+*/
+static void facing_scalar(const Vec3f& from, const Vec3f* pos, const Vec3f* norms, float* out, int n)
+{
+	for (int i = 0; i < n; i++)
+		out[i] = (from - pos[i]).norm().dot(norms[i]);
+}
+
+/**
+* Sums light over every light as the sum of max(0, facing) in light order
+*/
+static void shade_scalar(const Vec3f* lights, int num_lights, const Vec3f* pos, const Vec3f* norms, float* shade, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float sum = 0.f;
+		for (int l = 0; l < num_lights; l++)
+		{
+			float f = (lights[l] - pos[i]).norm().dot(norms[i]);
+			sum += (f < 0.f) ? 0.f : f;
+		}
+		shade[i] = sum;
+	}
+}
+
+#ifdef SIMD_X86
+/********************************************************************
+* SSE helpers, 4 vectors per group
+********************************************************************/
+/**
+* Loads 4 packed Vec3f and splits them into one register per component
+* @param p: first of 4 vectors
+* @param x: set to x of each vector
+* @param y: set to y of each vector
+* @param z: set to z of each vector
+*/
+TARGET_SSE2 static inline void load3x4(const Vec3f* p, __m128& x, __m128& y, __m128& z)
+{
+	const float* f = p->raw;
+	__m128 a = _mm_loadu_ps(f);  //x0 y0 z0 x1
+	__m128 b = _mm_loadu_ps(f + 4);  //y1 z1 x2 y2
+	__m128 c = _mm_loadu_ps(f + 8);  //z2 x3 y3 z3
+	__m128 t0 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 3, 0));  //x0 x1 y1 z1
+	__m128 t1 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2));  //x2 y2 x3 y3
+	__m128 t2 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1));  //y0 z0 y1 z1
+	__m128 t3 = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));  //z2 z2 z3 z3
+	x = _mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 1, 0));
+	y = _mm_shuffle_ps(t2, t1, _MM_SHUFFLE(3, 1, 2, 0));
+	z = _mm_shuffle_ps(t2, t3, _MM_SHUFFLE(2, 0, 3, 1));
+}
+
+/**
+* Packs one register per component back into 4 Vec3f
+* @param p: first of 4 vectors to write
+* @param x: x of each vector
+* @param y: y of each vector
+* @param z: z of each vector
+*/
+TARGET_SSE2 static inline void store3x4(Vec3f* p, __m128 x, __m128 y, __m128 z)
+{
+	float* f = p->raw;
+	__m128 xy_lo = _mm_unpacklo_ps(x, y);  //x0 y0 x1 y1
+	__m128 xy_hi = _mm_unpackhi_ps(x, y);  //x2 y2 x3 y3
+	__m128 zx_lo = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0));  //z0 z0 x1 x1
+	__m128 yz_lo = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1));  //y1 y1 z1 z1
+	__m128 zx_hi = _mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2));  //z2 z2 x3 x3
+	__m128 yz_hi = _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3));  //y3 y3 z3 z3
+	_mm_storeu_ps(f, _mm_shuffle_ps(xy_lo, zx_lo, _MM_SHUFFLE(2, 0, 1, 0)));
+	_mm_storeu_ps(f + 4, _mm_shuffle_ps(yz_lo, xy_hi, _MM_SHUFFLE(1, 0, 2, 0)));
+	_mm_storeu_ps(f + 8, _mm_shuffle_ps(zx_hi, yz_hi, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+/********************************************************************
+* AVX helpers, 8 vectors per group, split and joined through two SSE groups
+********************************************************************/
+TARGET_AVX static inline void load3x8(const Vec3f* p, __m256& x, __m256& y, __m256& z)
+{
+	__m128 x0, y0, z0, x1, y1, z1;
+	load3x4(p, x0, y0, z0);
+	load3x4(p + 4, x1, y1, z1);
+	x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+	y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+	z = _mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1);
+}
+
+TARGET_AVX static inline void store3x8(Vec3f* p, __m256 x, __m256 y, __m256 z)
+{
+	store3x4(p, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+	store3x4(p + 4, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+}
+
+/********************************************************************
+* SSE2 kernels, whole groups of 4 then the scalar path for the rest
+********************************************************************/
+TARGET_SSE2 static void transform_sse(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, int n)
+{
+	int i = 0;
+	__m128 m[3][4];
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 4; c++)
+			m[r][c] = _mm_set1_ps(mat.val[r][c]);
+	}
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 x, y, z;
+		load3x4(in + i, x, y, z);
+		__m128 o[3];
+		for (int r = 0; r < 3; r++)
+			o[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z)), m[r][3]);
+		store3x4(out + i, o[0], o[1], o[2]);
+	}
+	transform_scalar(mat, in + i, out + i, n - i);
+}
+
+TARGET_SSE2 static void normalize_sse(const Vec3f* in, Vec3f* out, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 x, y, z;
+		load3x4(in + i, x, y, z);
+		__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		store3x4(out + i, _mm_div_ps(x, len), _mm_div_ps(y, len), _mm_div_ps(z, len));
+	}
+	normalize_scalar(in + i, out + i, n - i);
+}
+
+TARGET_SSE2 static void dot_sse(const Vec3f* in, const Vec3f& c, float* out, int n)
+{
+	int i = 0;
+	__m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 x, y, z;
+		load3x4(in + i, x, y, z);
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, cx), _mm_mul_ps(y, cy)), _mm_mul_ps(z, cz)));
+	}
+	dot_scalar(in + i, c, out + i, n - i);
+}
+
+/**
+* Cosine between direction to from and normal for 4 points already split into components
+*/
+TARGET_SSE2 static inline __m128 facing4(__m128 fx, __m128 fy, __m128 fz, __m128 px, __m128 py, __m128 pz, __m128 nx, __m128 ny, __m128 nz)
+{
+	__m128 dx = _mm_sub_ps(fx, px), dy = _mm_sub_ps(fy, py), dz = _mm_sub_ps(fz, pz);
+	__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+	dx = _mm_div_ps(dx, len);
+	dy = _mm_div_ps(dy, len);
+	dz = _mm_div_ps(dz, len);
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz));
+}
+
+TARGET_SSE2 static void facing_sse(const Vec3f& from, const Vec3f* pos, const Vec3f* norms, float* out, int n)
+{
+	int i = 0;
+	__m128 fx = _mm_set1_ps(from.x), fy = _mm_set1_ps(from.y), fz = _mm_set1_ps(from.z);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 px, py, pz, nx, ny, nz;
+		load3x4(pos + i, px, py, pz);
+		load3x4(norms + i, nx, ny, nz);
+		_mm_storeu_ps(out + i, facing4(fx, fy, fz, px, py, pz, nx, ny, nz));
+	}
+	facing_scalar(from, pos + i, norms + i, out + i, n - i);
+}
+
+/**
+* LIGHTS fixes the light count at compile time so the light loop unrolls, 0 uses num_lights
+*/
+template <int LIGHTS>
+TARGET_SSE2 static void shade_sse(const Vec3f* lights, int num_lights, const Vec3f* pos, const Vec3f* norms, float* shade, int n)
+{
+	const int count = (LIGHTS > 0) ? LIGHTS : num_lights;
+	const __m128 zero = _mm_setzero_ps();
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 px, py, pz, nx, ny, nz;
+		load3x4(pos + i, px, py, pz);
+		load3x4(norms + i, nx, ny, nz);
+		__m128 sum = zero;
+		for (int l = 0; l < count; l++)
+		{
+			__m128 f = facing4(_mm_set1_ps(lights[l].x), _mm_set1_ps(lights[l].y), _mm_set1_ps(lights[l].z), px, py, pz, nx, ny, nz);
+			//max keeps f when it is NaN or zero, same as (f < 0) ? 0 : f
+			sum = _mm_add_ps(sum, _mm_max_ps(zero, f));
+		}
+		_mm_storeu_ps(shade + i, sum);
+	}
+	shade_scalar(lights, count, pos + i, norms + i, shade + i, n - i);
+}
+
+/********************************************************************
+* AVX kernels, whole groups of 8 then the scalar path for the rest
+* Same operations as the SSE2 kernels on twice the lanes, no fused multiply add so results stay exact
+********************************************************************/
+TARGET_AVX static void transform_avx(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, int n)
+{
+	int i = 0;
+	__m256 m[3][4];
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 4; c++)
+			m[r][c] = _mm256_set1_ps(mat.val[r][c]);
+	}
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 x, y, z;
+		load3x8(in + i, x, y, z);
+		__m256 o[3];
+		for (int r = 0; r < 3; r++)
+			o[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], x), _mm256_mul_ps(m[r][1], y)), _mm256_mul_ps(m[r][2], z)), m[r][3]);
+		store3x8(out + i, o[0], o[1], o[2]);
+	}
+	transform_scalar(mat, in + i, out + i, n - i);
+}
+
+TARGET_AVX static void normalize_avx(const Vec3f* in, Vec3f* out, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 x, y, z;
+		load3x8(in + i, x, y, z);
+		__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+		store3x8(out + i, _mm256_div_ps(x, len), _mm256_div_ps(y, len), _mm256_div_ps(z, len));
+	}
+	normalize_scalar(in + i, out + i, n - i);
+}
+
+TARGET_AVX static void dot_avx(const Vec3f* in, const Vec3f& c, float* out, int n)
+{
+	int i = 0;
+	__m256 cx = _mm256_set1_ps(c.x), cy = _mm256_set1_ps(c.y), cz = _mm256_set1_ps(c.z);
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 x, y, z;
+		load3x8(in + i, x, y, z);
+		_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, cx), _mm256_mul_ps(y, cy)), _mm256_mul_ps(z, cz)));
+	}
+	dot_scalar(in + i, c, out + i, n - i);
+}
+
+/**
+* Cosine between direction to from and normal for 8 points already split into components
+*/
+TARGET_AVX static inline __m256 facing8(__m256 fx, __m256 fy, __m256 fz, __m256 px, __m256 py, __m256 pz, __m256 nx, __m256 ny, __m256 nz)
+{
+	__m256 dx = _mm256_sub_ps(fx, px), dy = _mm256_sub_ps(fy, py), dz = _mm256_sub_ps(fz, pz);
+	__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+	dx = _mm256_div_ps(dx, len);
+	dy = _mm256_div_ps(dy, len);
+	dz = _mm256_div_ps(dz, len);
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, nx), _mm256_mul_ps(dy, ny)), _mm256_mul_ps(dz, nz));
+}
+
+TARGET_AVX static void facing_avx(const Vec3f& from, const Vec3f* pos, const Vec3f* norms, float* out, int n)
+{
+	int i = 0;
+	__m256 fx = _mm256_set1_ps(from.x), fy = _mm256_set1_ps(from.y), fz = _mm256_set1_ps(from.z);
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 px, py, pz, nx, ny, nz;
+		load3x8(pos + i, px, py, pz);
+		load3x8(norms + i, nx, ny, nz);
+		_mm256_storeu_ps(out + i, facing8(fx, fy, fz, px, py, pz, nx, ny, nz));
+	}
+	facing_scalar(from, pos + i, norms + i, out + i, n - i);
+}
+
+template <int LIGHTS>
+TARGET_AVX static void shade_avx(const Vec3f* lights, int num_lights, const Vec3f* pos, const Vec3f* norms, float* shade, int n)
+{
+	const int count = (LIGHTS > 0) ? LIGHTS : num_lights;
+	const __m256 zero = _mm256_setzero_ps();
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 px, py, pz, nx, ny, nz;
+		load3x8(pos + i, px, py, pz);
+		load3x8(norms + i, nx, ny, nz);
+		__m256 sum = zero;
+		for (int l = 0; l < count; l++)
+		{
+			__m256 f = facing8(_mm256_set1_ps(lights[l].x), _mm256_set1_ps(lights[l].y), _mm256_set1_ps(lights[l].z), px, py, pz, nx, ny, nz);
+			//max keeps f when it is NaN or zero, same as (f < 0) ? 0 : f
+			sum = _mm256_add_ps(sum, _mm256_max_ps(zero, f));
+		}
+		_mm256_storeu_ps(shade + i, sum);
+	}
+	shade_scalar(lights, count, pos + i, norms + i, shade + i, n - i);
+}
+#endif
+
+/********************************************************************
+* Dispatch
+********************************************************************/
+typedef void (*ShadeFunc)(const Vec3f* lights, int num_lights, const Vec3f* pos, const Vec3f* norms, float* shade, int n);
+
+//kernels of one tier, shade has a loop specialized for 1 to 4 lights at [1] to [4] and any count at [0]
+struct SimdKernels
+{
+	const char* name;
+	void (*transform)(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, int n);
+	void (*normalize)(const Vec3f* in, Vec3f* out, int n);
+	void (*dot)(const Vec3f* in, const Vec3f& c, float* out, int n);
+	void (*facing)(const Vec3f& from, const Vec3f* pos, const Vec3f* norms, float* out, int n);
+	ShadeFunc shade[5];
+};
+
+static const SimdKernels SCALAR_KERNELS = {
+	"scalar", transform_scalar, normalize_scalar, dot_scalar, facing_scalar,
+	{ shade_scalar, shade_scalar, shade_scalar, shade_scalar, shade_scalar }
+};
+#ifdef SIMD_X86
+static const SimdKernels SSE_KERNELS = {
+	"sse2", transform_sse, normalize_sse, dot_sse, facing_sse,
+	{ shade_sse<0>, shade_sse<1>, shade_sse<2>, shade_sse<3>, shade_sse<4> }
+};
+static const SimdKernels AVX_KERNELS = {
+	"avx", transform_avx, normalize_avx, dot_avx, facing_avx,
+	{ shade_avx<0>, shade_avx<1>, shade_avx<2>, shade_avx<3>, shade_avx<4> }
+};
+#endif
+
+//global defs
+static std::atomic<const SimdKernels*> _kernels(nullptr);
+
+/**
+* Gets bound kernels, binding them on first use
+* @return: kernel table
+*/
+static const SimdKernels* kernels()
+{
+	const SimdKernels* k = _kernels.load(std::memory_order_acquire);
+	if (k == nullptr)
+	{
+		simd_bind();
+		k = _kernels.load(std::memory_order_acquire);
+	}
+	return k;
+}
+
+/**
+* Binds kernels to the best set the current cpu tier allows
+* Kernels bind themselves on first use, call again after changing the tier
+* Must not be called while another thread is running a kernel
+*/
+void simd_bind()
+{
+	const SimdKernels* k = &SCALAR_KERNELS;
+#ifdef SIMD_X86
+	CPU_TIER tier = cpu_tier();
+	if (tier >= CPU_AVX)
+		k = &AVX_KERNELS;
+	else if (tier >= CPU_SSE2)
+		k = &SSE_KERNELS;
+#endif
+	_kernels.store(k, std::memory_order_release);
+	log(DEBUG1, std::string("math kernels bound to ") + k->name);
+}
+
+/**
+* Transforms n points by a matrix, same as Vec3f(mat * Vec4f(p)) for each point (w of 1, result w dropped)
+* in and out may be the same array
+* @param mat: transform
+* @param in: points to transform
+* @param out: transformed points
+* @param n: number of points
+*/
+void simd_transform(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, int n)
+{
+	kernels()->transform(mat, in, out, n);
+}
+
+/**
+* Normalizes n vectors, same as v.norm() for each vector
+* in and out may be the same array
+* @param in: vectors to normalize
+* @param out: unit vectors
+* @param n: number of vectors
+*/
+void simd_normalize(const Vec3f* in, Vec3f* out, int n)
+{
+	kernels()->normalize(in, out, n);
+}
+
+/**
+* Dots n vectors against one constant vector, same as v.dot(c) for each vector
+* @param in: vectors
+* @param c: vector to dot against
+* @param out: dot product of each vector
+* @param n: number of vectors
+*/
+void simd_dot(const Vec3f* in, const Vec3f& c, float* out, int n)
+{
+	kernels()->dot(in, c, out, n);
+}
+
+/**
+* Cosine of the angle between each normal and the direction from its point to one position,
+*	same as (from - p).norm().dot(norm) for each point
+* Used for diffuse lighting and for back face tests, where from is a light or the camera
+* @param from: position to face
+* @param pos: points
+* @param norms: unit normal at each point
+* @param out: cosine for each point
+* @param n: number of points
+*/
+void simd_facing(const Vec3f& from, const Vec3f* pos, const Vec3f* norms, float* out, int n)
+{
+	kernels()->facing(from, pos, norms, out, n);
+}
+
+/**
+* Lights vertices, shade[i] = sum over lights of max(0, (light - pos[i]).norm().dot(norms[i]))
+* Common light counts run a loop specialized for that count
+* @param lights: light positions
+* @param num_lights: number of lights
+* @param pos: vertex positions
+* @param norms: unit vertex normals
+* @param shade: set to summed light of each vertex, overwritten not accumulated
+* @param n: number of vertices
+*/
+void simd_shade(const Vec3f* lights, int num_lights, const Vec3f* pos, const Vec3f* norms, float* shade, int n)
+{
+	int bucket = (num_lights >= 1 && num_lights <= 4) ? num_lights : 0;
+	kernels()->shade[bucket](lights, num_lights, pos, norms, shade, n);
+}
+
+/**
+* Gets name of the kernel set in use
+* @return: "avx", "sse2" or "scalar"
+*/
+const char* simd_level()
+{
+	return kernels()->name;
+}
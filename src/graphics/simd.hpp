@@ -0,0 +1,17 @@
+#pragma once
+
+#include "geom.hpp"
+
+//batched math kernels over arrays of vectors
+//vectors stay in their usual xyz layout in memory, groups of 4 (SSE) or 8 (AVX) are turned into
+//	one register per component on load so each instruction works on a whole group
+//the instruction set is picked at runtime from the cpu tier, cpus without SSE2 run the plain loops
+//	and AVX2 or AVX-512 cpus run the AVX kernels
+//every path does the same float operations in the same order, so results match bit for bit
+void simd_bind();
+void simd_transform(const Mat4x4f& mat, const Vec3f* in, Vec3f* out, int n);
+void simd_normalize(const Vec3f* in, Vec3f* out, int n);
+void simd_dot(const Vec3f* in, const Vec3f& c, float* out, int n);
+void simd_facing(const Vec3f& from, const Vec3f* pos, const Vec3f* norms, float* out, int n);
+void simd_shade(const Vec3f* lights, int num_lights, const Vec3f* pos, const Vec3f* norms, float* shade, int n);
+const char* simd_level();
@@ -0,0 +1,342 @@
+#include "model.hpp"
+#include "geom.hpp"
+#include "../logger/logger.hpp"
+#include <vector>
+#include <queue>
+#include <string>
+#include <cmath>
+#include <unordered_map>
+#include <utility>
+
+constexpr float FLAT_MIN_DOT = 0.999f;  //vertex normal this close to its face normal counts as flat shading
+
+/*******************************************************************************
+* Quadric error metric simplification (Garland and Heckbert, 1997)
+* Used to build the level of detail chain of a model at load time
+*******************************************************************************/
+
+//symmetric 4x4 error matrix stored as its upper triangle
+struct Quadric
+{
+	double q[10];
+
+	Quadric() { for (int i = 0; i < 10; i++) q[i] = 0.0; }
+	//fundamental error quadric of the plane ax + by + cz + d = 0
+	Quadric(double a, double b, double c, double d)
+	{
+		q[0] = a * a; q[1] = a * b; q[2] = a * c; q[3] = a * d;
+		q[4] = b * b; q[5] = b * c; q[6] = b * d;
+		q[7] = c * c; q[8] = c * d;
+		q[9] = d * d;
+	}
+
+	inline Quadric operator +(const Quadric& o) const
+	{
+		Quadric out;
+		for (int i = 0; i < 10; i++)
+			out.q[i] = q[i] + o.q[i];
+		return out;
+	}
+
+	//sum of squared distances from point to every plane accumulated in this quadric
+	inline double error(const Vec3f& v) const
+	{
+		double x = v.x, y = v.y, z = v.z;
+		return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+			+ q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+			+ q[7] * z * z + 2.0 * q[8] * z
+			+ q[9];
+	}
+};
+
+//candidate edge collapse, stamps detect entries made stale by later collapses
+struct Collapse
+{
+	double cost;
+	int a, b;
+	int stamp_a, stamp_b;
+	Vec3f target;
+
+	//reversed so std::priority_queue pops the cheapest collapse first
+	bool operator <(const Collapse& c) const { return cost > c.cost; }
+};
+
+/**
+* Builds a simplified copy of this model by collapsing the cheapest edges until the face count reaches target
+* Normals are carried per corner: corners of a vertex that share a normal index form a wedge, and a collapse
+*	merges each wedge of the removed vertex into the wedge it meets across the collapsed edge, so creases stay sharp
+* A normal that only ever matches its faces' own normals is flat and takes the face normal of the simplified face instead,
+*	face normals are oriented to agree with their vertex normals so lighting stays consistent between levels
+* @param target_faces: number of faces to stop at
+* @return: simplified model
+*/
+std::unique_ptr<Model> Model::simplify(int target_faces) const
+{
+	int n = (int)vertices.size();
+	std::vector<Vec3f> pos = vertices;
+	std::vector<Quadric> quad(n);
+	std::vector<int> stamp(n, 0);
+	std::vector<bool> v_alive(n, true);
+	std::vector<int> tris(faces.size() * 3);
+	std::vector<bool> f_alive(faces.size(), true);
+	std::vector<std::vector<int>> v_faces(n);
+	int live = (int)faces.size();
+
+	//a normal that matches the face normal of every face using it belongs to flat faces
+	std::vector<bool> flat(vert_normals.size(), true);
+	for (int i = 0; i < faces.size(); i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			int vn = faces[i][k].i_norm;
+			if (vn >= 0 && vert_normals[vn].dot(face_normals[i]) < FLAT_MIN_DOT)
+				flat[vn] = false;
+		}
+	}
+	std::vector<Vec3f> w_norm;  //summed normal of each wedge
+	std::vector<bool> w_flat;
+	std::vector<int> corner(faces.size() * 3);  //wedge of each face corner
+	std::unordered_map<int64_t, int> wedges;  //(vertex, normal index) -> wedge
+
+	//accumulate plane quadrics on each vertex and sort corners into wedges
+	for (int i = 0; i < faces.size(); i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			int v = faces[i][k].i_vert;
+			int vn = faces[i][k].i_norm;
+			tris[i * 3 + k] = v;
+			v_faces[v].push_back(i);
+
+			if (vn >= 0 && !(vert_normals[vn].value() > 0.f))
+				vn = -1;
+			int64_t key = ((int64_t)v << 32) | (uint32_t)vn;
+			auto w = wedges.find(key);
+			if (w == wedges.end())
+			{
+				w = wedges.emplace(key, (int)w_norm.size()).first;
+				w_norm.push_back((vn >= 0) ? vert_normals[vn] : Vec3f());
+				w_flat.push_back(vn >= 0 && flat[vn]);
+			}
+			corner[i * 3 + k] = w->second;
+		}
+
+		Vec3f A = pos[tris[i * 3]];
+		Vec3f plane_n = (pos[tris[i * 3 + 1]] - A).cross(pos[tris[i * 3 + 2]] - A);
+		float len = plane_n.value();
+		if (len == 0.f)
+			continue;
+		plane_n = plane_n / len;
+		Quadric K(plane_n.x, plane_n.y, plane_n.z, -plane_n.dot(A));
+		for (int k = 0; k < 3; k++)
+			quad[tris[i * 3 + k]] = quad[tris[i * 3 + k]] + K;
+	}
+
+	//cost of an edge is the error of the best of its end points and midpoint
+	std::priority_queue<Collapse> heap;
+	auto push_edge = [&](int a, int b)
+		{
+			Quadric q = quad[a] + quad[b];
+			Vec3f cands[3] = { pos[a], pos[b], (pos[a] + pos[b]) / 2.f };
+			Collapse c;
+			c.cost = q.error(cands[0]);
+			c.target = cands[0];
+			for (int i = 1; i < 3; i++)
+			{
+				double e = q.error(cands[i]);
+				if (e < c.cost)
+				{
+					c.cost = e;
+					c.target = cands[i];
+				}
+			}
+			c.a = a;
+			c.b = b;
+			c.stamp_a = stamp[a];
+			c.stamp_b = stamp[b];
+			heap.push(c);
+		};
+	for (int i = 0; i < faces.size(); i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			int a = tris[i * 3 + k];
+			int b = tris[i * 3 + (k + 1) % 3];
+			if (a != b)
+				push_edge((a < b) ? a : b, (a < b) ? b : a);
+		}
+	}
+
+	//moving v to target must not turn any of its faces (other than the ones being removed) over
+	auto flips = [&](int v, int other, const Vec3f& target)
+		{
+			for (int f : v_faces[v])
+			{
+				if (!f_alive[f])
+					continue;
+				int* t = &tris[f * 3];
+				if (t[0] == other || t[1] == other || t[2] == other)
+					continue;
+
+				Vec3f p[3] = { pos[t[0]], pos[t[1]], pos[t[2]] };
+				Vec3f n_old = (p[1] - p[0]).cross(p[2] - p[0]);
+				for (int k = 0; k < 3; k++)
+				{
+					if (t[k] == v)
+						p[k] = target;
+				}
+				Vec3f n_new = (p[1] - p[0]).cross(p[2] - p[0]);
+				if (n_new.dot(n_old) <= 0.f)
+					return true;
+			}
+			return false;
+		};
+
+	//collapse edges cheapest first
+	while (live > target_faces && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+		if (!v_alive[c.a] || !v_alive[c.b] || stamp[c.a] != c.stamp_a || stamp[c.b] != c.stamp_b)
+			continue; //stale entry
+		if (flips(c.a, c.b, c.target) || flips(c.b, c.a, c.target))
+			continue;
+
+		//wedges of b join the wedge of a they meet on a face across the edge, each side of a crease pairs up separately
+		std::vector<std::pair<int, int>> carry;
+		for (int f : v_faces[c.b])
+		{
+			if (!f_alive[f])
+				continue;
+			int* t = &tris[f * 3];
+			int ka = -1, kb = -1;
+			for (int k = 0; k < 3; k++)
+			{
+				ka = (t[k] == c.a) ? k : ka;
+				kb = (t[k] == c.b) ? k : kb;
+			}
+			if (ka < 0 || kb < 0)
+				continue;
+			int wa = corner[f * 3 + ka], wb = corner[f * 3 + kb];
+			if (w_flat[wa] || w_flat[wb])
+				continue;
+			bool seen = false;
+			for (auto& p : carry)
+				seen = seen || p.first == wb;
+			if (seen)
+				continue;
+			carry.push_back(std::make_pair(wb, wa));
+			w_norm[wa] = w_norm[wa] + w_norm[wb];
+		}
+
+		//merge b into a
+		pos[c.a] = c.target;
+		quad[c.a] = quad[c.a] + quad[c.b];
+		v_alive[c.b] = false;
+		for (int f : v_faces[c.b])
+		{
+			if (!f_alive[f])
+				continue;
+			int* t = &tris[f * 3];
+			for (int k = 0; k < 3; k++)
+			{
+				if (t[k] != c.b)
+					continue;
+				t[k] = c.a;
+				for (auto& p : carry)
+				{
+					if (p.first == corner[f * 3 + k])
+					{
+						corner[f * 3 + k] = p.second;
+						break;
+					}
+				}
+			}
+			//faces that shared the edge are now degenerate
+			if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2])
+			{
+				f_alive[f] = false;
+				live--;
+			}
+			else
+				v_faces[c.a].push_back(f);
+		}
+		v_faces[c.b].clear();
+		stamp[c.a]++;
+
+		//drop dead faces from a and requeue every edge around it
+		std::vector<int> a_faces;
+		for (int f : v_faces[c.a])
+		{
+			if (!f_alive[f])
+				continue;
+			a_faces.push_back(f);
+			for (int k = 0; k < 3; k++)
+			{
+				int v = tris[f * 3 + k];
+				if (v != c.a)
+					push_edge(c.a, v);
+			}
+		}
+		v_faces[c.a].swap(a_faces);
+	}
+
+	//compact surviving vertices and faces into new model
+	std::unique_ptr<Model> lod(new Model());
+	lod->radius = radius; //collapses only move vertices inside the hull, so the bound still holds
+	std::vector<int> remap(n, -1);
+	std::vector<int> w_remap(w_norm.size(), -1);
+	for (int i = 0; i < faces.size(); i++)
+	{
+		if (!f_alive[i])
+			continue;
+
+		std::vector<Vec3i> face;
+		Vec3f n_sum;
+		for (int k = 0; k < 3; k++)
+		{
+			int v = tris[i * 3 + k];
+			if (remap[v] < 0)
+			{
+				remap[v] = (int)lod->vertices.size();
+				lod->vertices.push_back(pos[v]);
+			}
+			face.push_back(Vec3i(remap[v], -1, -1));
+			Vec3f w = w_norm[corner[i * 3 + k]];
+			n_sum = n_sum + ((w.value() > 0.f) ? w.norm() : w);
+		}
+
+		//geometric face normal, flipped to the side its vertex normals point to
+		Vec3f A = lod->vertices[face[0].i_vert];
+		Vec3f face_n = (lod->vertices[face[1].i_vert] - A).cross(lod->vertices[face[2].i_vert] - A);
+		if (!(face_n.value() > 0.f))
+			face_n = n_sum;
+		else if (face_n.dot(n_sum) < 0.f)
+			face_n = face_n * -1.f;
+		face_n = (face_n.value() > 0.f) ? face_n.norm() : face_n;
+
+		//flat corners, and wedges whose merged normals cancelled out, take the face normal
+		for (int k = 0; k < 3; k++)
+		{
+			int w = corner[i * 3 + k];
+			if (w_flat[w] || !(w_norm[w].value() > 0.f))
+			{
+				face[k].i_norm = (int)lod->vert_normals.size();
+				lod->vert_normals.push_back(face_n);
+				continue;
+			}
+			if (w_remap[w] < 0)
+			{
+				w_remap[w] = (int)lod->vert_normals.size();
+				lod->vert_normals.push_back(w_norm[w].norm());
+			}
+			face[k].i_norm = w_remap[w];
+		}
+		lod->face_normals.push_back(face_n);
+		lod->faces.push_back(face);
+	}
+
+	lod->build_meshlets();
+	log(DEBUG2, "simplified " + std::to_string(faces.size()) + " faces to " + std::to_string(lod->faces.size()));
+	return lod;
+}
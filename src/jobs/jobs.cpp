@@ -0,0 +1,486 @@
+#include "jobs.hpp"
+#include "../logger/logger.hpp"
+#ifdef _WINDOWS
+#include <Windows.h>
+#endif
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <string>
+
+constexpr int SPIN_ROUNDS = 64;  //failed steal attempts before a worker goes to sleep
+constexpr size_t QUEUE_START_SIZE = 256;  //jobs each worker deque holds before growing
+
+struct Job
+{
+    std::function<void()> run;  //set by jobs_submit
+    void (*range)(void*, int, int);  //set by jobs_parallel_for instead of run
+    void* context;
+    int begin, end;
+    JobCounter* counter;  //may be null
+
+    Job() { range = NULL; context = NULL; begin = 0; end = 0; counter = NULL; }
+};
+
+//deque owned by one worker, kept as a ring so steady state pushing and popping never allocates
+struct WorkQueue
+{
+    std::mutex lk;
+    std::vector<Job> ring;  //size is a power of two
+    size_t head;  //index of front job
+    size_t count;
+
+    WorkQueue() { ring.resize(QUEUE_START_SIZE); head = 0; count = 0; }
+
+    void push_back(Job&& job)
+    {
+        if (count == ring.size())
+        {
+            //full, unroll into a ring twice the size
+            std::vector<Job> bigger(ring.size() * 2);
+            for (size_t i = 0; i < count; i++)
+                bigger[i] = std::move(ring[(head + i) & (ring.size() - 1)]);
+            ring.swap(bigger);
+            head = 0;
+        }
+        ring[(head + count) & (ring.size() - 1)] = std::move(job);
+        count++;
+    }
+    void pop_back(Job& job)
+    {
+        count--;
+        Job& slot = ring[(head + count) & (ring.size() - 1)];
+        job = std::move(slot);
+        slot.run = nullptr;
+    }
+    void pop_front(Job& job)
+    {
+        Job& slot = ring[head];
+        job = std::move(slot);
+        slot.run = nullptr;
+        head = (head + 1) & (ring.size() - 1);
+        count--;
+    }
+    //takes the i-th job from the front, sliding the jobs behind it up so the rest keep their order
+    void pop_at(size_t i, Job& job)
+    {
+        size_t mask = ring.size() - 1;
+        job = std::move(ring[(head + i) & mask]);
+        for (size_t k = i + 1; k < count; k++)
+            ring[(head + k - 1) & mask] = std::move(ring[(head + k) & mask]);
+        count--;
+        ring[(head + count) & mask].run = nullptr;
+    }
+    //finds the newest job of a group when from_back, the oldest otherwise
+    //@return index from the front, count if the group has nothing queued here
+    size_t find(const JobCounter* group, bool from_back) const
+    {
+        size_t mask = ring.size() - 1;
+        for (size_t k = 0; k < count; k++)
+        {
+            size_t i = from_back ? count - 1 - k : k;
+            if (ring[(head + i) & mask].counter == group)
+                return i;
+        }
+        return count;
+    }
+};
+
+//global defs
+static std::vector<std::unique_ptr<WorkQueue>> _queues;
+static std::vector<std::thread> _workers;
+static std::atomic<int> _queued(0);  //jobs sitting in a deque
+static std::atomic<int> _active(0);  //jobs currently running
+static std::atomic<int> _sleeping(0);  //workers waiting on _sleep_cv
+static std::atomic<unsigned> _next(0);  //round robin target for jobs from outside the pool
+static std::atomic<bool> _stopping(false);
+static std::mutex _sleep_lk;
+static std::condition_variable _sleep_cv;  //signals new jobs or stop
+static std::condition_variable _idle_cv;  //signals pool drained
+static thread_local int t_worker = -1;  //index of worker running on this thread, -1 outside the pool
+
+/*
+* Puts job on current worker's deque, or the next worker's deque if called from outside the pool
+* @param job: job to queue
+*/
+static void push(Job job)
+{
+    int q = (t_worker >= 0) ? t_worker : (int)(_next++ % _queues.size());
+    {
+        std::lock_guard<std::mutex> lk(_queues[q]->lk);
+        _queues[q]->push_back(std::move(job));
+        _queued++;
+    }
+
+    //only pay for the wakeup if a worker is actually asleep
+    if (_sleeping.load() > 0)
+    {
+        {
+            std::lock_guard<std::mutex> lk(_sleep_lk);
+        }
+        _sleep_cv.notify_one();
+    }
+}
+
+/*
+* Takes a job, newest from own deque first, then oldest from everyone else's
+* @param self: worker index of caller, -1 outside the pool
+* @param job: set to job taken
+* @return true if a job was taken
+*/
+static bool take(int self, Job& job)
+{
+    int n = (int)_queues.size();
+    if (self >= 0)
+    {
+        std::lock_guard<std::mutex> lk(_queues[self]->lk);
+        if (_queues[self]->count != 0)
+        {
+            _queues[self]->pop_back(job);
+            _active++;
+            _queued--;
+            return true;
+        }
+    }
+
+    //steal
+    int start = (self >= 0) ? self + 1 : 0;
+    for (int i = 0; i < n; i++)
+    {
+        int q = (start + i) % n;
+        if (q == self)
+            continue;
+        std::lock_guard<std::mutex> lk(_queues[q]->lk);
+        if (_queues[q]->count != 0)
+        {
+            _queues[q]->pop_front(job);
+            _active++;
+            _queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+* Takes a job of one group only, same order as take, so a waiting thread never picks up unrelated work
+* @param self: worker index of caller, -1 outside the pool
+* @param group: counter of group to take from
+* @param job: set to job taken
+* @return true if a job was taken
+*/
+static bool take(int self, const JobCounter* group, Job& job)
+{
+    int n = (int)_queues.size();
+    int start = (self >= 0) ? self : 0;
+    for (int i = 0; i < n; i++)
+    {
+        int q = (start + i) % n;
+        std::lock_guard<std::mutex> lk(_queues[q]->lk);
+        size_t at = _queues[q]->find(group, q == self);
+        if (at != _queues[q]->count)
+        {
+            _queues[q]->pop_at(at, job);
+            _active++;
+            _queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+* Counts a job of a group as done, queueing the group's dependents once the last one finishes
+* @param counter: counter of group
+*/
+static void complete(JobCounter& counter)
+{
+    //decrement under lock, a waiter may free the counter as soon as it sees zero and takes the lock
+    std::vector<std::pair<std::function<void()>, JobCounter*>> ready;
+    {
+        std::lock_guard<std::mutex> lk(counter.lk);
+        if (counter.count.load() == 1)
+            ready.swap(counter.dependents);
+        counter.count--;
+    }
+
+    //dependents already count toward their group, queue them tagged with it so waiters on that group can run them
+    for (auto& d : ready)
+    {
+        if (_workers.empty())
+        {
+            d.first();
+            complete(*d.second);
+            continue;
+        }
+        Job j;
+        j.run = std::move(d.first);
+        j.counter = d.second;
+        push(std::move(j));
+    }
+}
+
+/*
+* Runs a job taken from a deque and reports it finished
+* @param job: job to run
+*/
+static void run(Job& job)
+{
+    if (job.range != NULL)
+        job.range(job.context, job.begin, job.end);
+    else
+        job.run();
+    if (job.counter != NULL)
+        complete(*job.counter);
+
+    if (--_active == 0 && _queued.load() == 0)
+    {
+        std::lock_guard<std::mutex> lk(_sleep_lk);
+        _idle_cv.notify_all();
+    }
+}
+
+/*
+* Pins calling worker to one core, leaving the first core to the render thread
+* @param index: worker index
+*/
+static void pin(int index)
+{
+#ifdef _WINDOWS
+    int hw = (int)std::thread::hardware_concurrency();
+    if (hw <= 1)
+        return;
+    DWORD_PTR mask = (DWORD_PTR)1 << (1 + index % (hw - 1));
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+        log(WARNING, "failed to pin job worker " + std::to_string(index));
+#else
+    if (index == 0)
+        log(WARNING, "job worker affinity not supported on this platform");
+#endif
+}
+
+/*
+* Worker loop, runs jobs until pool is stopped and every queued job is done
+* @param index: worker index
+* @param affinity: pin worker to a core
+*/
+static void worker(int index, bool affinity)
+{
+    t_worker = index;
+    if (affinity)
+        pin(index);
+
+    int misses = 0;
+    while (1)
+    {
+        Job job;
+        if (take(index, job))
+        {
+            run(job);
+            misses = 0;
+            continue;
+        }
+
+        //keep looking for a bit since parallel loops hand out work in bursts
+        if (++misses < SPIN_ROUNDS)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(_sleep_lk);
+        _sleeping++;
+        _sleep_cv.wait(lk, [] { return _stopping.load() || _queued.load() > 0; });
+        _sleeping--;
+        if (_stopping.load() && _queued.load() == 0)
+            return;
+        misses = 0;
+    }
+}
+
+/*
+* Starts worker threads
+* @param num_workers: number of threads, 0 or less picks one per hardware thread minus the render thread
+*/
+void jobs_start(int num_workers)
+{
+    jobs_start(num_workers, false);
+}
+
+/*
+* Starts worker threads
+* @param num_workers: number of threads, 0 or less picks one per hardware thread minus the render thread
+* @param affinity: pin each worker to its own core
+*/
+void jobs_start(int num_workers, bool affinity)
+{
+    if (!_workers.empty())
+    {
+        log(WARNING, "job pool already started");
+        return;
+    }
+    if (num_workers <= 0)
+    {
+        int hw = (int)std::thread::hardware_concurrency();
+        num_workers = (hw > 1) ? hw - 1 : 1;
+    }
+
+    log(DEBUG1, "starting " + std::to_string(num_workers) + " job workers" + (affinity ? " pinned to cores" : ""));
+    _stopping = false;
+    for (int i = 0; i < num_workers; i++)
+        _queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    for (int i = 0; i < num_workers; i++)
+        _workers.push_back(std::thread(worker, i, affinity));
+}
+
+/*
+* Finishes queued jobs then joins all workers
+* Must be called before exit, joinable threads terminate the process when destroyed
+*/
+void jobs_stop()
+{
+    {
+        std::lock_guard<std::mutex> lk(_sleep_lk);
+        _stopping = true;
+    }
+    _sleep_cv.notify_all();
+    for (auto& t : _workers)
+        t.join();
+    _workers.clear();
+    _queues.clear();
+}
+
+/*
+* Gets number of worker threads
+*/
+int jobs_num_workers()
+{
+    return (int)_workers.size();
+}
+
+/*
+* Queues a job to run on a worker
+* Runs job inline if pool was never started so callers don't need a fallback path
+* @param job: work to run
+*/
+void jobs_submit(std::function<void()> job)
+{
+    if (_workers.empty())
+    {
+        job();
+        return;
+    }
+
+    Job j;
+    j.run = std::move(job);
+    push(std::move(j));
+}
+
+/*
+* Queues a job as part of a group
+* @param job: work to run
+* @param counter: counter of group, counts this job until it finishes
+*/
+void jobs_submit(std::function<void()> job, JobCounter& counter)
+{
+    counter.count++;
+    if (_workers.empty())
+    {
+        job();
+        complete(counter);
+        return;
+    }
+
+    Job j;
+    j.run = std::move(job);
+    j.counter = &counter;
+    push(std::move(j));
+}
+
+/*
+* Queues a job once every job of another group has finished
+* The job counts toward its own group right away, so waiting on that group also waits on the dependency
+* @param dependency: group that must finish first
+* @param job: work to run
+* @param counter: counter of group job belongs to
+*/
+void jobs_submit_after(JobCounter& dependency, std::function<void()> job, JobCounter& counter)
+{
+    {
+        std::lock_guard<std::mutex> lk(dependency.lk);
+        if (dependency.count.load() != 0)
+        {
+            //count now so a wait on counter cannot slip through before the job is queued
+            counter.count++;
+            dependency.dependents.push_back(std::make_pair(std::move(job), &counter));
+            return;
+        }
+    }
+    jobs_submit(std::move(job), counter);
+}
+
+/*
+* Runs body over [begin, end) split into chunks of at most grain items
+* The calling thread runs the first chunk and helps with the rest, so this is safe to call from inside a job
+* @param begin: first index
+* @param end: one past last index
+* @param grain: items per chunk, 1 or more
+* @param body: called with context and the [begin, end) range of each chunk
+* @param context: passed to body
+*/
+void jobs_parallel_for(int begin, int end, int grain, void (*body)(void*, int, int), void* context)
+{
+    grain = (grain < 1) ? 1 : grain;
+    if (end - begin <= grain || _workers.empty())
+    {
+        if (end > begin)
+            body(context, begin, end);
+        return;
+    }
+
+    JobCounter counter;
+    for (int s = begin + grain; s < end; s += grain)
+    {
+        Job j;
+        j.range = body;
+        j.context = context;
+        j.begin = s;
+        j.end = (s + grain < end) ? s + grain : end;
+        j.counter = &counter;
+        counter.count++;
+        push(std::move(j));
+    }
+    body(context, begin, begin + grain);
+    jobs_wait(counter);
+}
+
+/*
+* Waits for every job of a group, running that group's queued jobs on this thread in the meantime
+* Jobs of other groups are left to the workers, a wait never takes on a long job it isn't waiting for
+* @param counter: counter of group
+*/
+void jobs_wait(JobCounter& counter)
+{
+    while (counter.count.load() != 0)
+    {
+        Job job;
+        if (!_workers.empty() && take(t_worker, &counter, job))
+            run(job);
+        else
+            std::this_thread::yield();
+    }
+
+    //last job to finish may still be releasing the counter's lock
+    std::lock_guard<std::mutex> lk(counter.lk);
+}
+
+/*
+* Blocks until every queued job has finished
+*/
+void jobs_wait_idle()
+{
+    std::unique_lock<std::mutex> lk(_sleep_lk);
+    _idle_cv.wait(lk, [] { return _active.load() == 0 && _queued.load() == 0; });
+}
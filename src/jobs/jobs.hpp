@@ -0,0 +1,46 @@
+#pragma once
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+//work stealing pool shared by everything that runs in parallel
+//each worker pushes and pops its own deque from the back and steals from the front of the others,
+//	threads outside the pool hand jobs out round robin
+//a thread waiting on a group only helps with that group's jobs, so a frame never stalls behind unrelated work like asset loads
+//start once, submit jobs from any thread, stop before exiting
+
+//counts unfinished jobs of a group so a caller can wait on them or queue jobs that depend on them
+struct JobCounter
+{
+    std::atomic<int> count;
+    std::mutex lk;  //guards dependents
+    std::vector<std::pair<std::function<void()>, JobCounter*>> dependents;  //jobs and their groups, queued once count hits zero
+
+    JobCounter() { count = 0; }
+    JobCounter(const JobCounter&) = delete;
+    JobCounter& operator =(const JobCounter&) = delete;
+};
+
+//pool lifetime
+void jobs_start(int num_workers);
+void jobs_start(int num_workers, bool affinity);
+void jobs_stop();
+int jobs_num_workers();
+
+//work submission
+void jobs_submit(std::function<void()> job);
+void jobs_submit(std::function<void()> job, JobCounter& counter);
+void jobs_submit_after(JobCounter& dependency, std::function<void()> job, JobCounter& counter);
+void jobs_parallel_for(int begin, int end, int grain, void (*body)(void*, int, int), void* context);
+void jobs_wait(JobCounter& counter);
+void jobs_wait_idle();
+
+//runs body(chunk_begin, chunk_end) over [begin, end) in chunks of at most grain items
+//body is passed through a plain function pointer, so no std::function is built for the loop or its chunks
+template <class F>
+void jobs_parallel_for(int begin, int end, int grain, const F& body)
+{
+    jobs_parallel_for(begin, end, grain, [](void* context, int b, int e) { (*(const F*)context)(b, e); }, (void*)&body);
+}
@@ -1,4 +1,5 @@
 #include "logger.hpp"
+#include "../memory/alloc.hpp"
 #include <stdio.h>
 #include <string>
 
@@ -12,6 +13,15 @@ void logger_set_level(LEVEL level)
 
 void log(LEVEL level, std::string msg)
 {
+	AllocScope scope(ALLOC_LOG);
+	log(level, msg.c_str());
+}
+
+//plain string overload so per frame messages don't build a std::string
+void log(LEVEL level, const char* msg)
+{
+	AllocScope scope(ALLOC_LOG);
+
 	//if not in debug mode do nothing
 #ifdef _DEBUG
 	//check if logger level is higher than given level
@@ -22,16 +32,16 @@ void log(LEVEL level, std::string msg)
 	switch (level)
 	{
 	case DEBUG1:
-		fprintf(stdout, "___DEBUG1___: %s\n", msg.c_str());
+		fprintf(stdout, "___DEBUG1___: %s\n", msg);
 		return;
 	case DEBUG2:
-		fprintf(stdout, "___DEBUG2___: %s\n", msg.c_str());
+		fprintf(stdout, "___DEBUG2___: %s\n", msg);
 		return;
 	case WARNING:
-		fprintf(stdout, "___WARNING___: %s\n", msg.c_str());
+		fprintf(stdout, "___WARNING___: %s\n", msg);
 		return;
 	case ERR:
-		fprintf(stderr, "___ERROR___: %s\n", msg.c_str());
+		fprintf(stderr, "___ERROR___: %s\n", msg);
 		return;
 	}
 #endif
@@ -10,3 +10,4 @@ typedef enum level {
 
 void logger_set_level(LEVEL level);
 void log(LEVEL level, std::string msg);
+void log(LEVEL level, const char* msg);
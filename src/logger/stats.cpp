@@ -0,0 +1,128 @@
+#include "stats.hpp"
+#include "logger.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+
+struct Stat
+{
+	const char* name;
+	double value;
+	const char* text;  //shown instead of value if set
+};
+
+//global defs
+static Stat _stats[MAX_STATS];
+static int _num_stats = 0;
+static std::mutex _stats_lk;
+
+/**
+* Finds a stat by name, adding it if missing
+* Stats lock must be held
+* @param name: name of stat
+* @return: stat, null if table is full
+*/
+static Stat* find(const char* name)
+{
+	for (int i = 0; i < _num_stats; i++)
+	{
+		if (strcmp(_stats[i].name, name) == 0)
+			return &_stats[i];
+	}
+	if (_num_stats == MAX_STATS)
+		return NULL;
+	_stats[_num_stats].name = name;
+	_stats[_num_stats].value = 0.0;
+	_stats[_num_stats].text = NULL;
+	return &_stats[_num_stats++];
+}
+
+/**
+* Sets the latest value of a stat
+* @param name: name of stat, string literal
+* @param value: value to show
+*/
+void stats_set(const char* name, double value)
+{
+	std::lock_guard<std::mutex> lk(_stats_lk);
+	Stat* s = find(name);
+	if (s == NULL)
+	{
+		log(WARNING, "stats table full");
+		return;
+	}
+	s->value = value;
+}
+
+/**
+* Sets a stat to show a label instead of a number
+* @param name: name of stat, string literal
+* @param text: label to show, string literal
+*/
+void stats_set_text(const char* name, const char* text)
+{
+	std::lock_guard<std::mutex> lk(_stats_lk);
+	Stat* s = find(name);
+	if (s == NULL)
+	{
+		log(WARNING, "stats table full");
+		return;
+	}
+	s->text = text;
+}
+
+/**
+* Raises a stat to value if value is larger, useful for worst case counters between prints
+* @param name: name of stat, string literal
+* @param value: value to compare
+*/
+void stats_max(const char* name, double value)
+{
+	std::lock_guard<std::mutex> lk(_stats_lk);
+	Stat* s = find(name);
+	if (s == NULL)
+	{
+		log(WARNING, "stats table full");
+		return;
+	}
+	if (value > s->value)
+		s->value = value;
+}
+
+/**
+* Reads a stat
+* @param name: name of stat
+* @param value: set to value of stat if found
+* @return: true if stat exists
+*/
+bool stats_get(const char* name, double& value)
+{
+	std::lock_guard<std::mutex> lk(_stats_lk);
+	for (int i = 0; i < _num_stats; i++)
+	{
+		if (strcmp(_stats[i].name, name) == 0)
+		{
+			value = _stats[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Prints every stat on one line
+*/
+void stats_print()
+{
+	std::lock_guard<std::mutex> lk(_stats_lk);
+	if (_num_stats == 0)
+		return;
+	for (int i = 0; i < _num_stats; i++)
+	{
+		if (_stats[i].text != NULL)
+			printf("%s%s: %s", (i == 0) ? "" : " | ", _stats[i].name, _stats[i].text);
+		else
+			printf("%s%s: %g", (i == 0) ? "" : " | ", _stats[i].name, _stats[i].value);
+	}
+	printf("\n");
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+constexpr int MAX_STATS = 32;  //named values that can be tracked at once
+
+//named per frame values printed together with the fps counter once a second
+//names must be string literals, they are kept by pointer and compared by content
+//setting a value never allocates so any thread can report every frame
+//text stats show a fixed label instead of a number, the text must be a string literal too
+void stats_set(const char* name, double value);
+void stats_set_text(const char* name, const char* text);
+void stats_max(const char* name, double value);
+bool stats_get(const char* name, double& value);
+void stats_print();
@@ -0,0 +1,166 @@
+#include "alloc.hpp"
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#if defined(_DEBUG) && defined(_MSC_VER)
+#include <crtdbg.h>
+#endif
+
+/**
+* Gets printable name of a stage
+* @param stage: stage to name
+* @return: name
+*/
+const char* alloc_stage_name(ALLOC_STAGE stage)
+{
+	switch (stage)
+	{
+	case ALLOC_DRAW:
+		return "draw";
+	case ALLOC_CLIP:
+		return "clip";
+	case ALLOC_QUATERNION:
+		return "quaternion";
+	case ALLOC_LOG:
+		return "log";
+	default:
+		return "other";
+	}
+}
+
+#ifdef _DEBUG
+//global defs
+static std::atomic<size_t> _counts[NUM_ALLOC_STAGES];
+static std::atomic<size_t> _bytes[NUM_ALLOC_STAGES];
+static thread_local ALLOC_STAGE t_stage = ALLOC_OTHER;
+static thread_local bool t_in_new = false;  //keeps the malloc hook from counting operator new twice
+
+/**
+* Counts one allocation against the calling thread's stage
+* @param size: bytes requested
+*/
+static void count(size_t size)
+{
+	_counts[t_stage]++;
+	_bytes[t_stage] += size;
+}
+
+/*
+* Replacement global allocation functions, same as the defaults plus a count
+*/
+void* operator new(size_t size)
+{
+	count(size);
+	t_in_new = true;
+	void* p = malloc((size == 0) ? 1 : size);
+	t_in_new = false;
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	count(size);
+	t_in_new = true;
+	void* p = malloc((size == 0) ? 1 : size);
+	t_in_new = false;
+	return p;
+}
+void* operator new[](size_t size, const std::nothrow_t& nt) noexcept
+{
+	return operator new(size, nt);
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t size) noexcept { free(p); }
+void operator delete[](void* p, size_t size) noexcept { free(p); }
+
+#ifdef _MSC_VER
+/*
+* Debug CRT hook, catches malloc, calloc and realloc calls that did not come through operator new
+* Must not allocate
+*/
+static int crt_hook(int type, void* data, size_t size, int block, long request, const unsigned char* file, int line)
+{
+	if (block == _CRT_BLOCK || t_in_new)
+		return TRUE;
+	if (type == _HOOK_ALLOC || type == _HOOK_REALLOC)
+		count(size);
+	return TRUE;
+}
+
+//installs the hook before main runs
+static struct CrtHookInstaller
+{
+	CrtHookInstaller() { _CrtSetAllocHook(crt_hook); }
+} _crt_hook_installer;
+#endif
+
+/*
+* Gets number of heap allocations made since the program started
+*/
+size_t alloc_count()
+{
+	size_t n = 0;
+	for (int i = 0; i < NUM_ALLOC_STAGES; i++)
+		n += _counts[i].load();
+	return n;
+}
+
+/*
+* Whether allocations are being counted in this build
+*/
+bool alloc_counting()
+{
+	return true;
+}
+
+/*
+* Gets allocation count and bytes of every stage since the program started
+* @param out: set to running totals
+*/
+void alloc_stats(AllocStats& out)
+{
+	for (int i = 0; i < NUM_ALLOC_STAGES; i++)
+	{
+		out.count[i] = _counts[i].load();
+		out.bytes[i] = _bytes[i].load();
+	}
+}
+
+/*
+* Sets stage allocations on the calling thread count against
+* @param stage: new stage
+* @return: previous stage, to restore later
+*/
+ALLOC_STAGE alloc_set_stage(ALLOC_STAGE stage)
+{
+	ALLOC_STAGE prev = t_stage;
+	t_stage = stage;
+	return prev;
+}
+#else
+size_t alloc_count()
+{
+	return 0;
+}
+
+bool alloc_counting()
+{
+	return false;
+}
+
+void alloc_stats(AllocStats& out)
+{
+	out = AllocStats();
+}
+
+ALLOC_STAGE alloc_set_stage(ALLOC_STAGE stage)
+{
+	return ALLOC_OTHER;
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+
+//heap allocation counter
+//debug builds replace global operator new (and hook malloc through the debug CRT on msvc) and count
+//	every call and its size against the stage the calling thread is in, release builds keep the
+//	default operators and always report 0
+enum ALLOC_STAGE
+{
+	ALLOC_OTHER = 0,
+	ALLOC_DRAW = 1,  //geometry and raster of a frame
+	ALLOC_CLIP = 2,  //clip_z, clip_xy and cull
+	ALLOC_QUATERNION = 3,  //Quaternion::operator*
+	ALLOC_LOG = 4,  //inside log, building the message string counts against the caller
+	NUM_ALLOC_STAGES = 5
+};
+
+//running totals since the program started, subtract two snapshots to get one frame
+struct AllocStats
+{
+	size_t count[NUM_ALLOC_STAGES];
+	size_t bytes[NUM_ALLOC_STAGES];
+
+	AllocStats() { for (int i = 0; i < NUM_ALLOC_STAGES; i++) { count[i] = 0; bytes[i] = 0; } }
+	size_t total_count() const { size_t n = 0; for (int i = 0; i < NUM_ALLOC_STAGES; i++) n += count[i]; return n; }
+	size_t total_bytes() const { size_t n = 0; for (int i = 0; i < NUM_ALLOC_STAGES; i++) n += bytes[i]; return n; }
+};
+
+size_t alloc_count();
+bool alloc_counting();
+void alloc_stats(AllocStats& out);
+const char* alloc_stage_name(ALLOC_STAGE stage);
+ALLOC_STAGE alloc_set_stage(ALLOC_STAGE stage);
+
+//counts heap allocations made on this thread against a stage until the scope ends, scopes nest
+//jobs run on other threads, so a stage has to be entered again inside the job body
+class AllocScope
+{
+public:
+#ifdef _DEBUG
+	AllocScope(ALLOC_STAGE stage) { prev = alloc_set_stage(stage); }
+	~AllocScope() { alloc_set_stage(prev); }
+private:
+	ALLOC_STAGE prev;
+#else
+	AllocScope(ALLOC_STAGE stage) {}
+#endif
+};
@@ -0,0 +1,159 @@
+#include "arena.hpp"
+#include "../logger/logger.hpp"
+#include <stdlib.h>
+#include <string>
+#include <new>
+#ifdef _WINDOWS
+#include <malloc.h>
+#endif
+
+/**
+* Rounds a size up to the arena alignment
+* @param bytes: size to round
+* @return: aligned size
+*/
+static size_t align_up(size_t bytes)
+{
+	return (bytes + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+/**
+* Allocates a heap block aligned for the arena
+* @param bytes: size of block, multiple of ARENA_ALIGN
+* @return: block, null if out of memory
+*/
+static void* block_alloc(size_t bytes)
+{
+#ifdef _WINDOWS
+	return _aligned_malloc(bytes, ARENA_ALIGN);
+#else
+	return aligned_alloc(ARENA_ALIGN, bytes);
+#endif
+}
+
+/**
+* Frees a block from block_alloc
+* @param p: block to free
+*/
+static void block_free(void* p)
+{
+#ifdef _WINDOWS
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+/**
+* Default constructor, starts with ARENA_DEFAULT_CAPACITY bytes
+*/
+FrameArena::FrameArena() : FrameArena(ARENA_DEFAULT_CAPACITY)
+{
+}
+
+/**
+* Constructor
+* @param capacity: starting size of block in bytes
+*/
+FrameArena::FrameArena(size_t capacity)
+{
+	this->capacity = align_up(capacity);
+	base = (char*)block_alloc(this->capacity);
+	if (base == NULL)
+	{
+		log(ERR, "failed to allocate frame arena");
+		this->capacity = 0;
+	}
+	offset = 0;
+	grows = 0;
+}
+
+/**
+* Frees block and anything that overflowed it
+*/
+FrameArena::~FrameArena()
+{
+	for (void* p : overflow)
+		block_free(p);
+	block_free(base);
+}
+
+/**
+* Takes memory from the arena
+* Safe to call from any number of threads at once
+* @param bytes: size needed
+* @return: memory aligned to ARENA_ALIGN, valid until next reset
+* @throws std::bad_alloc if the block is full and the heap can't cover the overflow
+*/
+void* FrameArena::alloc(size_t bytes)
+{
+	bytes = align_up((bytes == 0) ? 1 : bytes);
+	size_t start = offset.fetch_add(bytes);
+	if (start + bytes <= capacity)
+		return base + start;
+
+	//block is full, borrow from heap until the next reset grows it
+	void* p = block_alloc(bytes);
+	if (p == NULL)
+	{
+		log(ERR, "failed to allocate " + std::to_string(bytes) + " bytes of frame arena overflow");
+		throw std::bad_alloc();
+	}
+	std::lock_guard<std::mutex> lk(overflow_lk);
+	overflow.push_back(p);
+	return p;
+}
+
+/**
+* Releases everything allocated since the last reset
+* Grows the block if the last frame did not fit
+* Must not be called while anything is still allocating or using memory from the arena
+*/
+void FrameArena::reset()
+{
+	size_t need = offset.load();
+	if (!overflow.empty())
+	{
+		for (void* p : overflow)
+			block_free(p);
+		overflow.clear();
+	}
+	if (need > capacity)
+	{
+		//leave some room so slowly growing scenes don't grow every frame
+		size_t next = align_up(need + need / 2);
+		block_free(base);
+		base = (char*)block_alloc(next);
+		capacity = (base == NULL) ? 0 : next;
+		grows++;
+		log(DEBUG1, "frame arena grown to " + std::to_string(capacity) + " bytes");
+	}
+	offset = 0;
+}
+
+/**
+* Gets bytes handed out since last reset
+* @return: bytes used, may be larger than capacity if the arena overflowed
+*/
+size_t FrameArena::get_used() const
+{
+	return offset.load();
+}
+
+/**
+* Gets size of block
+* @return: capacity in bytes
+*/
+size_t FrameArena::get_capacity() const
+{
+	return capacity;
+}
+
+/**
+* Gets number of times the block had to grow
+* @return: grow count
+*/
+size_t FrameArena::num_grows() const
+{
+	return grows;
+}
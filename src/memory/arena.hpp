@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+
+constexpr size_t ARENA_ALIGN = 16;  //every allocation is aligned to this
+constexpr size_t ARENA_DEFAULT_CAPACITY = 1 << 20;
+
+//bump allocator for memory that only lives until the end of a frame
+//allocation is a single atomic add so jobs on any worker can share one arena, nothing is freed
+//	individually and reset hands the whole block back at once
+//if a frame needs more than the block holds the extra comes from the heap, and the next reset
+//	grows the block to fit, so steady state frames never touch the heap
+class FrameArena
+{
+public:
+	FrameArena();
+	FrameArena(size_t capacity);
+	~FrameArena();
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator =(const FrameArena&) = delete;
+	void* alloc(size_t bytes);
+	void reset();
+	size_t get_used() const;
+	size_t get_capacity() const;
+	size_t num_grows() const;
+private:
+	char* base;
+	size_t capacity;
+	std::atomic<size_t> offset;  //bytes requested since last reset, may pass capacity
+	std::mutex overflow_lk;
+	std::vector<void*> overflow;  //heap blocks handed out once the arena was full
+	size_t grows;  //number of times the block had to grow
+};
+
+//standard allocator that takes memory from a frame arena, so containers can live in it
+//deallocate does nothing, memory comes back when the arena is reset
+template <class T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+	FrameArena* arena;
+
+	ArenaAllocator(FrameArena& arena) { this->arena = &arena; }
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U>& a) { arena = a.arena; }
+
+	T* allocate(size_t n) { return (T*)arena->alloc(n * sizeof(T)); }
+	void deallocate(T* p, size_t n) {}
+
+	template <class U>
+	bool operator ==(const ArenaAllocator<U>& a) const { return arena == a.arena; }
+	template <class U>
+	bool operator !=(const ArenaAllocator<U>& a) const { return arena != a.arena; }
+};
+
+//vector whose storage lives in a frame arena, must not outlive the frame it was made in
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
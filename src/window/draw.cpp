@@ -2,8 +2,39 @@
 #include "window.hpp"
 #include "../logger/logger.hpp"
 #include "../graphics/geom.hpp"
+#include "../cpu/cpu.hpp"
 #include <string>
 #include <vector>
+#include <climits>
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+//per tier raster kernels are all compiled in and picked at runtime, functions using wider
+//  instructions than the build targets are marked for gcc and clang, msvc accepts the intrinsics anywhere
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RASTER_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_AVX
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX __attribute__((target("avx")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+//keeps a function out of line so every caller runs the exact same instructions
+#if defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+constexpr int COVER_RUN = 64;  //pixels of a row tested for coverage per kernel call
+constexpr size_t STREAM_FILL_BYTES = 1 << 20;  //fills this large bypass the cache, they would only evict what is drawn next
 
 
 /********************************************************************************************************************************
@@ -53,19 +84,14 @@ PIX_RET get_pixel(int x, int y, COLOR& color, float& depth)
     return SUCCESS;
 }
 
-/**
-* Sets pixel on screen
+/*
+* Sets pixel on screen, compiled once with and once without the depth test
 * Assumes draw lock taken
-* @param x: x coordinate on screen
-* @param y: y coordinate on screen
-* @param color: color to set
-* @param depth: depth value to set
-* @return if in release always returns SUCCESS or may crash program
-*           if in debug returns BOUNDS if attempt out of bounds
-*           DEPTH if depth is behind previous
-*           FAIL if lock not taken
+* @param DEPTH_TEST: skip pixel if depth is behind previous
+* (remaining parameters and return as set_pixel)
 */
-PIX_RET set_pixel(int x, int y, COLOR color, float depth)
+template <bool DEPTH_TEST>
+static inline PIX_RET put_pixel(int x, int y, COLOR color, float depth)
 {
 #ifdef _DEBUG
     log(DEBUG1, "writing pixel");
@@ -92,13 +118,31 @@ PIX_RET set_pixel(int x, int y, COLOR color, float depth)
 #endif // _DEBUG
 
     //do operation
-    if (depth > get_z_buf()[y * get_buf_width() + x])
+    if (DEPTH_TEST && depth > get_z_buf()[y * get_buf_width() + x])
         return DEPTH;
     get_buf()[y * get_buf_width() + x] = color;
     get_z_buf()[y * get_buf_width() + x] = depth;
     return SUCCESS;
 }
 
+/**
+* Sets pixel on screen
+* Assumes draw lock taken
+* @param x: x coordinate on screen
+* @param y: y coordinate on screen
+* @param color: color to set
+* @param depth: depth value to set
+* @return if in release always returns SUCCESS or may crash program
+*           if in debug returns BOUNDS if attempt out of bounds
+*           DEPTH if depth is behind previous
+*           FAIL if lock not taken
+*/
+PIX_RET set_pixel(int x, int y, COLOR color, float depth)
+{
+    mark_dirty(x, y, x, y);
+    return put_pixel<true>(x, y, color, depth);
+}
+
 /*
 * Private function to check if all future points of a line being drawn will be outside bounds
 */
@@ -123,51 +167,16 @@ static bool check_bound(int x, int y)
 }
 
 /*
-* Draws a line into buffer from point0 to point1
-* @param x0: start x coord
-* @param y0: start y coord
-* @param z0: start z depth
-* @param x1: end x coord
-* @param y1: end y coord
-* @param z1: end z depth
-* @param color0: start color
-* @param color1: end color
+* Inner loop of a line, walks x of the possibly transposed line from left to right
+* Compiled once per combination of flags so the loop carries no feature branches
+* @param STEEP: line was transposed, swap x and y back when writing
+* @param DEPTH_TEST: skip pixels behind previous
+* @param INTERP: blend color0 to color1, else draw all of it in color0
+* (remaining parameters as draw_line, already transposed and ordered)
 */
-void draw_line(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0, COLOR color1)
+template <bool STEEP, bool DEPTH_TEST, bool INTERP>
+static void line_loop(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0, COLOR color1)
 {
-#ifdef _DEBUG
-    //quick on time check on bounds to make sure line is actually fully in bounds
-    if ((x0 < 0 && (x1 <= x0)) || (x1 < 0 && (x0 <= x1)) || (x0 > get_buf_width() && (x0 <= x1)) || (x1 > get_buf_width() && (x1 <= x0)))
-    {
-        log(DEBUG1, "Line completely out of bounds, skipping");
-        return;
-    }
-    if ((y0 < 0 && (y1 <= y0)) || (y1 < 0 && (y0 <= y1)) || (y0 > get_buf_height() && (y0 <= y1)) || (y1 > get_buf_height() && (y1 <= y0)))
-    {
-        log(DEBUG1, "Line completely out of bounds, skipping");
-        return;
-    }
-#endif // _DEBUG
-
-    //check steepness (if delta-y is greater than delta-x)
-    bool steep = false;
-    if (abs(x0 - x1) < abs(y0 - y1))
-    {
-        //transpose x and y
-        std::swap(x0, y0);
-        std::swap(x1, y1);
-        steep = true;
-    }
-
-    //ensure iterateing from left to right
-    if (x0 > x1)
-    {
-        std::swap(x0, x1);
-        std::swap(y0, y1);
-        std::swap(z0, z1);
-        std::swap(color0, color1);
-    }
-
     //calculate gradients
     int dx = x1 - x0;
     int dy = y1 - y0;
@@ -191,14 +200,14 @@ void draw_line(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0,
     for (int x = x0; x <= x1; x++)
     {
         //untranspose if needed and make sure not doing uneeded draws outside of bounds
-        if (steep)
+        if (STEEP)
         {
-            if (set_pixel(y, x, color, z) == BOUNDS && !check_bound(y, x))
+            if (put_pixel<DEPTH_TEST>(y, x, color, z) == BOUNDS && !check_bound(y, x))
                 return;
         }
         else
         {
-            if (set_pixel(x, y, color, z) == BOUNDS && !check_bound(x, y))
+            if (put_pixel<DEPTH_TEST>(x, y, color, z) == BOUNDS && !check_bound(x, y))
                 return;
         }
 
@@ -212,17 +221,92 @@ void draw_line(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0,
 
         //calculate next z step
         z += dz_dx;
-        
+
         //calculate next color step
-        R += dR_dx;
-        color.R = color0.R + floorf(R);
-        G += dG_dx;
-        color.G = color0.G + floorf(G);
-        B += dB_dx;
-        color.B = color0.B + floorf(B);
+        if (INTERP)
+        {
+            R += dR_dx;
+            color.R = color0.R + floorf(R);
+            G += dG_dx;
+            color.G = color0.G + floorf(G);
+            B += dB_dx;
+            color.B = color0.B + floorf(B);
+        }
     }
 }
 
+/*
+* Draws a line into buffer from point0 to point1 with a fixed raster state
+* Steepness is decided once here, the loop for each case is compiled separately
+* @param DEPTH_TEST: skip pixels behind previous
+* @param INTERP: blend color0 to color1, else draw all of it in color0
+* (remaining parameters as draw_line)
+*/
+template <bool DEPTH_TEST, bool INTERP>
+static void line(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0, COLOR color1)
+{
+#ifdef _DEBUG
+    //quick on time check on bounds to make sure line is actually fully in bounds
+    if ((x0 < 0 && (x1 <= x0)) || (x1 < 0 && (x0 <= x1)) || (x0 > get_buf_width() && (x0 <= x1)) || (x1 > get_buf_width() && (x1 <= x0)))
+    {
+        log(DEBUG1, "Line completely out of bounds, skipping");
+        return;
+    }
+    if ((y0 < 0 && (y1 <= y0)) || (y1 < 0 && (y0 <= y1)) || (y0 > get_buf_height() && (y0 <= y1)) || (y1 > get_buf_height() && (y1 <= y0)))
+    {
+        log(DEBUG1, "Line completely out of bounds, skipping");
+        return;
+    }
+#endif // _DEBUG
+
+    //flat lines keep the color of point0 whichever end they are drawn from
+    if (!INTERP)
+        color1 = color0;
+
+    //tiles under the line's bounding box need clearing next time this buffer is used
+    mark_dirty(min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1));
+
+    //check steepness (if delta-y is greater than delta-x)
+    bool steep = false;
+    if (abs(x0 - x1) < abs(y0 - y1))
+    {
+        //transpose x and y
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+        steep = true;
+    }
+
+    //ensure iterateing from left to right
+    if (x0 > x1)
+    {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        std::swap(z0, z1);
+        std::swap(color0, color1);
+    }
+
+    if (steep)
+        line_loop<true, DEPTH_TEST, INTERP>(x0, y0, z0, x1, y1, z1, color0, color1);
+    else
+        line_loop<false, DEPTH_TEST, INTERP>(x0, y0, z0, x1, y1, z1, color0, color1);
+}
+
+/*
+* Draws a line into buffer from point0 to point1
+* @param x0: start x coord
+* @param y0: start y coord
+* @param z0: start z depth
+* @param x1: end x coord
+* @param y1: end y coord
+* @param z1: end z depth
+* @param color0: start color
+* @param color1: end color
+*/
+void draw_line(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0, COLOR color1)
+{
+    line<true, true>(x0, y0, z0, x1, y1, z1, color0, color1);
+}
+
 
 /*
 * Draws wireframe triangle over given points with given color
@@ -267,15 +351,369 @@ void fill_triangle(int x0, int y0, float z0,
     int x2, int y2, float z2, 
     COLOR color0, COLOR color1, COLOR color2)
 {
+    fill_triangle(x0, y0, z0, x1, y1, z1, x2, y2, z2, color0, color1, color2, INT_MIN, INT_MAX);
+}
+
+/*
+* Barycentric setup of a run of pixels along one row
+* Each k is the cross product of two corner vectors seen from the pixel, it changes by a
+*   constant amount per pixel to the right so a run is fully described by its first pixel
+*/
+struct CoverRun
+{
+    int ku, kv, kw;  //cross products at first pixel of run
+    int dku, dkv, dkw;  //change per pixel
+    float area;  //area of whole triangle
+};
+typedef uint64_t (*CoverFunc)(const CoverRun& run, int count, float* u, float* v, float* w);
+typedef void (*FillFunc32)(uint32_t* dst, size_t n, uint32_t value);
+
+/*
+* Tests a run of pixels for being inside a triangle
+* Weights are (|k| / 2) / area per pixel, so every tier matches the scalar one exactly
+* |k| is taken on the float so large triangles can't overflow the way squaring k in 32 bits did
+* @param run: setup of first pixel
+* @param count: pixels in run, at most COVER_RUN
+* @param u: set to weight of point1 for each pixel
+* @param v: set to weight of point2 for each pixel
+* @param w: set to weight of point0 for each pixel
+* @return: bit i set if pixel i is inside
+*/
+static uint64_t cover_scalar(const CoverRun& run, int count, float* u, float* v, float* w)
+{
+    uint64_t mask = 0;
+    int ku = run.ku, kv = run.kv, kw = run.kw;
+    for (int i = 0; i < count; i++)
+    {
+        u[i] = (fabsf((float)ku) / 2.f) / run.area;
+        v[i] = (fabsf((float)kv) / 2.f) / run.area;
+        w[i] = (fabsf((float)kw) / 2.f) / run.area;
+
+        //if sum of u v and w does not equal 1.0, then point not in triangle
+        //allow for small error
+        if (((u[i] + v[i] + w[i]) >= 0.99f) && ((u[i] + v[i] + w[i]) <= 1.01f))
+            mask |= (uint64_t)1 << i;
+        ku += run.dku;
+        kv += run.dkv;
+        kw += run.dkw;
+    }
+    return mask;
+}
+
+/*
+* Moves a run's setup forward by some pixels
+* @param run: setup to move
+* @param pixels: pixels to skip
+* @return: setup of pixel that many to the right
+*/
+static CoverRun advance(const CoverRun& run, int pixels)
+{
+    CoverRun r = run;
+    r.ku += run.dku * pixels;
+    r.kv += run.dkv * pixels;
+    r.kw += run.dkw * pixels;
+    return r;
+}
+
+/*
+* Fills 32 bit values one at a time, used for both color and depth
+* @param dst: first value to set
+* @param n: number of values
+* @param value: bits to set
+*/
+static void fill32_scalar(uint32_t* dst, size_t n, uint32_t value)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = value;
+}
+
+#ifdef RASTER_X86
+/*
+* Coverage of 4 pixels at a time, same parameters as cover_scalar
+*/
+TARGET_SSE2 static uint64_t cover_sse(const CoverRun& run, int count, float* u, float* v, float* w)
+{
+    const __m128 two = _mm_set1_ps(2.f), area = _mm_set1_ps(run.area);
+    const __m128 sign = _mm_set1_ps(-0.f);  //clearing the sign bit of a float is its absolute value
+    const __m128 lo = _mm_set1_ps(0.99f), hi = _mm_set1_ps(1.01f);
+    __m128i ku = _mm_setr_epi32(run.ku, run.ku + run.dku, run.ku + run.dku * 2, run.ku + run.dku * 3);
+    __m128i kv = _mm_setr_epi32(run.kv, run.kv + run.dkv, run.kv + run.dkv * 2, run.kv + run.dkv * 3);
+    __m128i kw = _mm_setr_epi32(run.kw, run.kw + run.dkw, run.kw + run.dkw * 2, run.kw + run.dkw * 3);
+    const __m128i dku = _mm_set1_epi32(run.dku * 4), dkv = _mm_set1_epi32(run.dkv * 4), dkw = _mm_set1_epi32(run.dkw * 4);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 fu = _mm_div_ps(_mm_div_ps(_mm_andnot_ps(sign, _mm_cvtepi32_ps(ku)), two), area);
+        __m128 fv = _mm_div_ps(_mm_div_ps(_mm_andnot_ps(sign, _mm_cvtepi32_ps(kv)), two), area);
+        __m128 fw = _mm_div_ps(_mm_div_ps(_mm_andnot_ps(sign, _mm_cvtepi32_ps(kw)), two), area);
+        _mm_storeu_ps(u + i, fu);
+        _mm_storeu_ps(v + i, fv);
+        _mm_storeu_ps(w + i, fw);
+        __m128 sum = _mm_add_ps(_mm_add_ps(fu, fv), fw);
+        __m128 in = _mm_and_ps(_mm_cmpge_ps(sum, lo), _mm_cmple_ps(sum, hi));
+        mask |= (uint64_t)_mm_movemask_ps(in) << i;
+        ku = _mm_add_epi32(ku, dku);
+        kv = _mm_add_epi32(kv, dkv);
+        kw = _mm_add_epi32(kw, dkw);
+    }
+    if (i < count)
+        mask |= cover_scalar(advance(run, i), count - i, u + i, v + i, w + i) << i;
+    return mask;
+}
+
+/*
+* Coverage of 8 pixels at a time, same parameters as cover_scalar
+*/
+TARGET_AVX2 static uint64_t cover_avx2(const CoverRun& run, int count, float* u, float* v, float* w)
+{
+    const __m256 two = _mm256_set1_ps(2.f), area = _mm256_set1_ps(run.area);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    const __m256 lo = _mm256_set1_ps(0.99f), hi = _mm256_set1_ps(1.01f);
+    const __m256i step = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i ku = _mm256_add_epi32(_mm256_set1_epi32(run.ku), _mm256_mullo_epi32(step, _mm256_set1_epi32(run.dku)));
+    __m256i kv = _mm256_add_epi32(_mm256_set1_epi32(run.kv), _mm256_mullo_epi32(step, _mm256_set1_epi32(run.dkv)));
+    __m256i kw = _mm256_add_epi32(_mm256_set1_epi32(run.kw), _mm256_mullo_epi32(step, _mm256_set1_epi32(run.dkw)));
+    const __m256i dku = _mm256_set1_epi32(run.dku * 8), dkv = _mm256_set1_epi32(run.dkv * 8), dkw = _mm256_set1_epi32(run.dkw * 8);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 fu = _mm256_div_ps(_mm256_div_ps(_mm256_andnot_ps(sign, _mm256_cvtepi32_ps(ku)), two), area);
+        __m256 fv = _mm256_div_ps(_mm256_div_ps(_mm256_andnot_ps(sign, _mm256_cvtepi32_ps(kv)), two), area);
+        __m256 fw = _mm256_div_ps(_mm256_div_ps(_mm256_andnot_ps(sign, _mm256_cvtepi32_ps(kw)), two), area);
+        _mm256_storeu_ps(u + i, fu);
+        _mm256_storeu_ps(v + i, fv);
+        _mm256_storeu_ps(w + i, fw);
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(fu, fv), fw);
+        __m256 in = _mm256_and_ps(_mm256_cmp_ps(sum, lo, _CMP_GE_OQ), _mm256_cmp_ps(sum, hi, _CMP_LE_OQ));
+        mask |= (uint64_t)_mm256_movemask_ps(in) << i;
+        ku = _mm256_add_epi32(ku, dku);
+        kv = _mm256_add_epi32(kv, dkv);
+        kw = _mm256_add_epi32(kw, dkw);
+    }
+    if (i < count)
+        mask |= cover_sse(advance(run, i), count - i, u + i, v + i, w + i) << i;
+    return mask;
+}
+
+/*
+* Fills 32 bit values 4 at a time, same parameters as fill32_scalar
+*/
+TARGET_SSE2 static void fill32_sse(uint32_t* dst, size_t n, uint32_t value)
+{
+    __m128i val = _mm_set1_epi32((int)value);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + i), val);
+    fill32_scalar(dst + i, n - i, value);
+}
+
+/*
+* Fills 32 bit values 4 at a time with non-temporal stores that skip the cache
+* Same parameters as fill32_scalar
+*/
+TARGET_SSE2 static void fill32_stream_sse(uint32_t* dst, size_t n, uint32_t value)
+{
+    //streaming stores need 16 byte alignment
+    size_t i = 0;
+    for (; i < n && ((uintptr_t)(dst + i) & 15) != 0; i++)
+        dst[i] = value;
+    __m128i val = _mm_set1_epi32((int)value);
+    for (; i + 4 <= n; i += 4)
+        _mm_stream_si128((__m128i*)(dst + i), val);
+    _mm_sfence();
+    fill32_scalar(dst + i, n - i, value);
+}
+
+/*
+* Fills 32 bit values 8 at a time, same parameters as fill32_scalar
+*/
+TARGET_AVX static void fill32_avx(uint32_t* dst, size_t n, uint32_t value)
+{
+    __m256i val = _mm256_set1_epi32((int)value);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i*)(dst + i), val);
+    fill32_scalar(dst + i, n - i, value);
+}
+
+/*
+* Fills 32 bit values 8 at a time with non-temporal stores that skip the cache
+* Same parameters as fill32_scalar
+*/
+TARGET_AVX static void fill32_stream_avx(uint32_t* dst, size_t n, uint32_t value)
+{
+    //streaming stores need 32 byte alignment
+    size_t i = 0;
+    for (; i < n && ((uintptr_t)(dst + i) & 31) != 0; i++)
+        dst[i] = value;
+    __m256i val = _mm256_set1_epi32((int)value);
+    for (; i + 8 <= n; i += 8)
+        _mm256_stream_si256((__m256i*)(dst + i), val);
+    _mm_sfence();
+    fill32_scalar(dst + i, n - i, value);
+}
+#endif
+
+/*
+* Raster kernels of one tier
+* Lines walk one pixel at a time on an error term, so they have no wide version and are not in here
+*/
+struct RasterKernels
+{
+    const char* name;
+    CoverFunc cover;
+    FillFunc32 fill;
+    FillFunc32 stream_fill;
+};
+
+static const RasterKernels SCALAR_RASTER = { "scalar", cover_scalar, fill32_scalar, fill32_scalar };
+#ifdef RASTER_X86
+static const RasterKernels SSE_RASTER = { "sse2", cover_sse, fill32_sse, fill32_stream_sse };
+static const RasterKernels AVX_RASTER = { "avx", cover_sse, fill32_avx, fill32_stream_avx };
+static const RasterKernels AVX2_RASTER = { "avx2", cover_avx2, fill32_avx, fill32_stream_avx };
+#endif
+
+//global defs
+static std::atomic<const RasterKernels*> _raster(nullptr);
+
+/*
+* Gets bound raster kernels, binding them on first use
+*/
+static const RasterKernels* raster_kernels()
+{
+    const RasterKernels* k = _raster.load(std::memory_order_acquire);
+    if (k == nullptr)
+    {
+        raster_bind();
+        k = _raster.load(std::memory_order_acquire);
+    }
+    return k;
+}
+
+/*
+* Binds raster kernels to the best set the current cpu tier allows
+* Kernels bind themselves on first use, call again after changing the tier
+* Must not be called while drawing
+*/
+void raster_bind()
+{
+    const RasterKernels* k = &SCALAR_RASTER;
+#ifdef RASTER_X86
+    CPU_TIER tier = cpu_tier();
+    if (tier >= CPU_AVX2)
+        k = &AVX2_RASTER;
+    else if (tier >= CPU_AVX)
+        k = &AVX_RASTER;
+    else if (tier >= CPU_SSE2)
+        k = &SSE_RASTER;
+#endif
+    _raster.store(k, std::memory_order_release);
+    log(DEBUG1, std::string("raster kernels bound to ") + k->name);
+}
+
+/*
+* Gets name of the raster kernel set in use
+* @return: "avx2", "avx", "sse2" or "scalar"
+*/
+const char* raster_level()
+{
+    return raster_kernels()->name;
+}
+
+/*
+* Fills 32 bit values, large fills stream past the cache
+* @param dst: first value to set
+* @param n: number of values
+* @param value: bits to set
+*/
+static void fill32(uint32_t* dst, size_t n, uint32_t value)
+{
+    const RasterKernels* k = raster_kernels();
+    if (n * sizeof(uint32_t) >= STREAM_FILL_BYTES)
+        k->stream_fill(dst, n, value);
+    else
+        k->fill(dst, n, value);
+}
+
+/*
+* Sets a run of depth values, used to clear the depth buffer
+* @param z_buf: first value to set
+* @param n: number of values
+* @param value: depth to set
+*/
+void depth_fill(float* z_buf, size_t n, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    fill32((uint32_t*)z_buf, n, bits);
+}
+
+/*
+* Sets a run of pixels to one color, used to clear the color buffer
+* @param buf: first pixel to set
+* @param n: number of pixels
+* @param color: color to set
+*/
+void color_fill(COLOR* buf, size_t n, COLOR color)
+{
+    fill32((uint32_t*)buf, n, color.val);
+}
+
+/*
+* Interpolates depth over a run of pixels
+* Kept out of line so the depth and shade passes of a prepass frame get bit for bit the same depths,
+*   inlined copies could be contracted into different instructions and break the equal test
+* @param z0: depth of point0
+* @param z1: depth of point1
+* @param z2: depth of point2
+* @param u: weight of point1 for each pixel
+* @param v: weight of point2 for each pixel
+* @param w: weight of point0 for each pixel
+* @param count: pixels in run
+* @param depth: set to depth of each pixel
+*/
+static NOINLINE void run_depth(float z0, float z1, float z2, const float* u, const float* v, const float* w, int count, float* depth)
+{
+    for (int i = 0; i < count; i++)
+        depth[i] = (z0 * w[i]) + (z1 * u[i]) + (z2 * v[i]);
+}
+
+/*
+* Draws part of filled triangle within a band of rows with a fixed raster state
+* Compiled once per combination of flags so the pixel loop carries no feature branches
+* Depth is tested before the color is blended, so pixels behind what is drawn cost no color work
+* @param DEPTH_TEST: skip pixels behind previous
+* @param INTERP: blend vertex colors, else fill with color0
+* @param PASS: draw depth and color, depth only, or color where depth matches
+* @param GBUFFER: colors are albedo, also write the blended vertex normal of each pixel to the normal buffer
+* @param normals: packed normal of each vertex, only read if GBUFFER
+* (remaining parameters as fill_triangle)
+* @return: number of pixels colored over one already drawn since the last clear, the shade pass colors each
+*   pixel once so it counts none
+*/
+template <bool DEPTH_TEST, bool INTERP, FILL_PASS PASS, bool GBUFFER>
+static int fill(int x0, int y0, float z0,
+    int x1, int y1, float z1,
+    int x2, int y2, float z2,
+    COLOR color0, COLOR color1, COLOR color2,
+    const uint32_t* normals, int y_lo, int y_hi)
+{
 
     //we are going to iterate over the bounds of the triangle and determine whether pixels are in or out of the triangle
     int x_min = min(min(x0, x1), x2); //want x to be furthest right value of highest y
     int x_max = max(max(x0, x1), x2);
-    int x = x_min;
 
-    int y_min = min(min(y0, y1), y2); //want x to be furthest right value of highest y
-    int y_max = max(max(y0, y1), y2);
+    int y_min = max(min(min(y0, y1), y2), y_lo); //want x to be furthest right value of highest y
+    int y_max = min(max(max(y0, y1), y2), y_hi);
     int y = y_min;
+    if (y_min > y_max)
+        return 0;
+
+    //tiles under the bounding box in this band need clearing next time this buffer is used
+    //  bands are whole rows of tiles, so bands drawn in parallel never mark the same tile
+    mark_dirty(x_min, y_min, x_max, y_max);
 
     //get vectors and area of triangle for barycentric calcs
     Vec3i A = Vec3i(x0, y0, 0);
@@ -285,35 +723,140 @@ void fill_triangle(int x0, int y0, float z0,
     Vec3i AC = C - A;
     float Area_ABC = AB.cross(AC).value() / 2.f;
 
-    while (y != (y_max + 1))
+    //rows are tested for coverage in runs by the kernel of the current cpu tier,
+    //  then covered pixels are drawn in the same order as walking the row one by one
+    CoverFunc cover = raster_kernels()->cover;
+    float u[COVER_RUN], v[COVER_RUN], w[COVER_RUN], z[COVER_RUN];
+    float* z_buf = get_z_buf();
+    int width = get_buf_width();
+    int overdrawn = 0;
+
+    //vertex normals are blended unpacked, packing only needs a direction so the blend is never normalized
+    uint32_t* normal_buf = GBUFFER ? get_normal_buf() : NULL;
+    Vec3f n0, n1, n2;
+    if (GBUFFER)
     {
-        //determine if point is in triangle using barycentric coordinate system
-        Vec3i P = Vec3i(x, y, 0);
-        Vec3i PA = A - P;
-        Vec3i PB = B - P;
-        Vec3i PC = C - P;
-
-        float u = (PA.cross(PC).value() / 2.f) / Area_ABC;
-        float v = (PA.cross(PB).value() / 2.f) / Area_ABC;
-        float w = (PC.cross(PB).value() / 2.f) / Area_ABC;
-
-        //if sum of u v and w does not equal 1.0, then point not in triangle
-        //allow for small error
-        if (((u + v + w) >= 0.99f) && ((u + v + w) <= 1.01f))
+        n0 = unpack_normal(normals[0]).norm();
+        n1 = unpack_normal(normals[1]).norm();
+        n2 = unpack_normal(normals[2]).norm();
+    }
+    for (; y <= y_max; y++)
+    {
+        for (int xs = x_min; xs <= x_max; xs += COVER_RUN)
         {
-            //point in triangle, determine color and depth val dependent on barycentric weights
-            COLOR color = (color0 * w) + (color1 * u) + (color2 * v);
-            float depth = (z0 * w) + (z1 * u) + (z2 * v);
-            set_pixel(x, y, color, depth);
+            int count = min(COVER_RUN, x_max - xs + 1);
+
+            //determine if points are in triangle using barycentric coordinate system
+            //PA x PC, PA x PB and PC x PB for P at start of run, moving right adds a constant to each
+            CoverRun run;
+            run.ku = (x0 - xs) * (y2 - y) - (y0 - y) * (x2 - xs);
+            run.kv = (x0 - xs) * (y1 - y) - (y0 - y) * (x1 - xs);
+            run.kw = (x2 - xs) * (y1 - y) - (y2 - y) * (x1 - xs);
+            run.dku = y0 - y2;
+            run.dkv = y0 - y1;
+            run.dkw = y2 - y1;
+            run.area = Area_ABC;
+            uint64_t mask = cover(run, count, u, v, w);
+            if (mask == 0)
+                continue;
+            run_depth(z0, z1, z2, u, v, w, count, z);
+
+            for (int i = 0; i < count; i++)
+            {
+                if (((mask >> i) & 1) == 0)
+                    continue;
+
+                //point in triangle, depth first so hidden pixels skip blending the color
+                float depth = z[i];
+                float* prev = &z_buf[y * width + xs + i];
+                if (PASS == PASS_DEPTH)
+                {
+#ifdef _DEBUG
+                    if (depth < 0.f || depth > 1.f)
+                        continue;
+#endif
+                    if (depth < *prev)
+                        *prev = depth;
+                    continue;
+                }
+                if (PASS == PASS_SHADE)
+                {
+                    if (depth != *prev)
+                        continue;
+                }
+                else if (DEPTH_TEST && depth > *prev)
+                    continue;
+                bool drawn = PASS == PASS_FULL && *prev < 1.f;
+                COLOR color = INTERP ? (color0 * w[i]) + (color1 * u[i]) + (color2 * v[i]) : color0;
+                if (put_pixel<false>(xs + i, y, color, depth) != SUCCESS)
+                    continue;
+                if (GBUFFER)
+                    normal_buf[y * width + xs + i] = pack_normal((n0 * w[i]) + (n1 * u[i]) + (n2 * v[i]));
+                if (drawn)
+                    overdrawn++;
+            }
         }
+    }
+    return overdrawn;
+}
+
+/*
+* Draws part of filled triangle that lies within a band of rows
+* Pixels drawn are the same as the full triangle's in that band, so bands can be drawn in parallel
+* @param y_lo: first row of band
+* @param y_hi: last row of band
+* (remaining parameters as above)
+*/
+void fill_triangle(int x0, int y0, float z0,
+    int x1, int y1, float z1,
+    int x2, int y2, float z2,
+    COLOR color0, COLOR color1, COLOR color2,
+    int y_lo, int y_hi)
+{
+    fill<true, true, PASS_FULL, false>(x0, y0, z0, x1, y1, z1, x2, y2, z2, color0, color1, color2, NULL, y_lo, y_hi);
+}
+
+/*
+* Picks the line loop compiled for a raster state
+* Call once per draw and use the result for every line of it
+* @param state: features of the draw
+* @return: line function with the same parameters as draw_line
+*/
+LineFunc get_line_func(RasterState state)
+{
+    static const LineFunc funcs[2][2] = {
+        { line<false, false>, line<false, true> },
+        { line<true, false>, line<true, true> }
+    };
+    return funcs[state.depth_test][state.interpolate];
+}
 
-        //increase x
-        x++;
-        if (x == (x_max + 1))
+/*
+* Picks the triangle fill loop compiled for a raster state
+* Call once per draw and use the result for every triangle of it
+* @param state: features of the draw
+* @return: fill function with the same parameters as the banded fill_triangle plus the vertex normals
+*/
+FillFunc get_fill_func(RasterState state)
+{
+    static const FillFunc funcs[2][2][2] = {
         {
-            x = x_min;
-            y++;
+            { fill<false, false, PASS_FULL, false>, fill<false, false, PASS_FULL, true> },
+            { fill<false, true, PASS_FULL, false>, fill<false, true, PASS_FULL, true> }
+        },
+        {
+            { fill<true, false, PASS_FULL, false>, fill<true, false, PASS_FULL, true> },
+            { fill<true, true, PASS_FULL, false>, fill<true, true, PASS_FULL, true> }
         }
-    }
+    };
+    static const FillFunc shade_funcs[2][2] = {
+        { fill<true, false, PASS_SHADE, false>, fill<true, false, PASS_SHADE, true> },
+        { fill<true, true, PASS_SHADE, false>, fill<true, true, PASS_SHADE, true> }
+    };
+    if (state.pass == PASS_DEPTH)
+        return fill<true, false, PASS_DEPTH, false>;
+    if (state.pass == PASS_SHADE)
+        return shade_funcs[state.interpolate][state.gbuffer];
+    return funcs[state.depth_test][state.interpolate][state.gbuffer];
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,303 @@
+#include "pacer.hpp"
+#include "../logger/logger.hpp"
+#include <thread>
+#include <string.h>
+#include <math.h>
+#ifdef _WINDOWS
+#include <Windows.h>
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#endif
+
+using namespace std::chrono;
+
+constexpr double PACER_SPIN_MIN_US = 200.0;  //spin at least this long before a deadline to absorb wakeup jitter
+constexpr double PACER_SPIN_MAX_US = 4000.0;  //never spin longer than this, even if sleeps wake very late
+
+/*
+* Creates pacer, on windows with a high resolution timer if the os has one
+*/
+FramePacer::FramePacer()
+{
+    has_last = false;
+    work_ms = 0.0;
+    cap = 0;
+    oversleep_us = 0.0;
+    timer = NULL;
+#ifdef _WINDOWS
+    timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (timer == NULL)
+    {
+        //older than windows 10 1803, regular timers wake on the scheduler tick
+        timer = CreateWaitableTimer(NULL, TRUE, NULL);
+        if (timer == NULL)
+            log(WARNING, "failed to create frame timer, pacing with thread sleeps");
+    }
+#endif
+    reset_times();
+}
+
+/*
+* Closes timer
+*/
+FramePacer::~FramePacer()
+{
+#ifdef _WINDOWS
+    if (timer != NULL)
+        CloseHandle((HANDLE)timer);
+#endif
+}
+
+/*
+* Marks start of a frame
+*/
+void FramePacer::begin_frame()
+{
+    frame_start = clock::now();
+    if (!has_last)
+    {
+        last_end = frame_start;
+        has_last = true;
+    }
+}
+
+/*
+* Waits out the rest of the frame if capped and records how long the frame took
+* @param fps_cap: frames per second to hold, 0 does not wait
+*/
+void FramePacer::end_frame(int fps_cap)
+{
+    clock::time_point now = clock::now();
+    work_ms = duration<double, std::milli>(now - frame_start).count();
+    if (fps_cap > 0)
+    {
+        nanoseconds period(1000000000LL / fps_cap);
+
+        //keep the cadence of earlier frames unless the cap changed or this frame missed its slot
+        if (cap != fps_cap)
+            deadline = frame_start + period;
+        else
+            deadline += period;
+        if (deadline < now)
+            deadline = now;
+        cap = fps_cap;
+        wait_until(deadline);
+    }
+    else
+        cap = 0;
+
+    clock::time_point end = clock::now();
+    record(duration<double, std::milli>(end - last_end).count());
+    last_end = end;
+}
+
+/*
+* Ends a frame that drew nothing without recording it
+* Time spent idle is left out of frame times so a still scene does not read as one long frame
+*/
+void FramePacer::skip_frame()
+{
+    last_end = clock::now();
+}
+
+/*
+* Sleeps until shortly before t then spins the rest of the way
+* @param t: time to return at
+*/
+void FramePacer::wait_until(clock::time_point t)
+{
+    double margin = PACER_SPIN_MIN_US + oversleep_us;
+    margin = (margin > PACER_SPIN_MAX_US) ? PACER_SPIN_MAX_US : margin;
+    double left = duration<double, std::micro>(t - clock::now()).count();
+    if (left > margin)
+    {
+        //learn how late sleeps wake up, quickly when they get worse and slowly when they get better
+        clock::time_point target = t - duration_cast<clock::duration>(duration<double, std::micro>(margin));
+        sleep_for_us(left - margin);
+        double late = duration<double, std::micro>(clock::now() - target).count();
+        late = (late < 0.0) ? 0.0 : late;
+        if (late > oversleep_us)
+            oversleep_us = oversleep_us * 0.5 + late * 0.5;
+        else
+            oversleep_us = oversleep_us * 0.95 + late * 0.05;
+    }
+    while (clock::now() < t)
+        std::this_thread::yield();
+}
+
+/*
+* Coarse sleep, may wake late but never early by more than the os timer resolution
+* @param us: microseconds to sleep
+*/
+void FramePacer::sleep_for_us(double us)
+{
+#ifdef _WINDOWS
+    if (timer != NULL)
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)(us * 10.0);  //relative, in 100ns units
+        if (SetWaitableTimer((HANDLE)timer, &due, 0, NULL, NULL, FALSE))
+        {
+            WaitForSingleObject((HANDLE)timer, INFINITE);
+            return;
+        }
+    }
+#endif
+    std::this_thread::sleep_for(duration<double, std::micro>(us));
+}
+
+/*
+* Adds a frame time to the histogram
+* @param ms: frame time in milliseconds
+*/
+void FramePacer::record(double ms)
+{
+    int b = (int)(ms * 1000.0 / PACER_BUCKET_US);
+    b = (b < 0) ? 0 : ((b >= PACER_BUCKETS) ? PACER_BUCKETS - 1 : b);
+    buckets[b]++;
+    frames++;
+    max_ms = (ms > max_ms) ? ms : max_ms;
+}
+
+/*
+* Summarizes frame times since the last reset
+* @param times: set to frame count, covered time and percentiles
+*/
+void FramePacer::get_times(FrameTimes& times) const
+{
+    times.frames = frames;
+    times.seconds = duration<double>(clock::now() - window_start).count();
+    times.max = max_ms;
+
+    //walk the histogram once, picking up each percentile as the running count passes it
+    const double pct[3] = { 0.50, 0.95, 0.99 };
+    double* out[3] = { &times.p50, &times.p95, &times.p99 };
+    int p = 0;
+    long long seen = 0;
+    for (int b = 0; b < PACER_BUCKETS && p < 3; b++)
+    {
+        seen += buckets[b];
+        while (p < 3 && frames > 0 && seen >= (long long)ceil(pct[p] * frames))
+        {
+            *out[p] = (double)(b + 1) * PACER_BUCKET_US / 1000.0;
+            p++;
+        }
+    }
+    for (; p < 3; p++)
+        *out[p] = 0.0;
+}
+
+/*
+* Empties histogram, start of the next reporting window
+*/
+void FramePacer::reset_times()
+{
+    memset(buckets, 0, sizeof(buckets));
+    frames = 0;
+    max_ms = 0.0;
+    window_start = clock::now();
+}
+
+/*
+* Gets how long the pacer currently spins before each deadline
+* @return: spin margin in milliseconds
+*/
+double FramePacer::get_spin_margin() const
+{
+    double margin = PACER_SPIN_MIN_US + oversleep_us;
+    return ((margin > PACER_SPIN_MAX_US) ? PACER_SPIN_MAX_US : margin) / 1000.0;
+}
+
+/*
+* Gets how long the last frame worked before waiting for its deadline
+* @return: milliseconds from begin_frame to end_frame
+*/
+double FramePacer::get_work_ms() const
+{
+    return work_ms;
+}
+
+/*
+* Creates scaler with scaling off
+*/
+ResolutionScaler::ResolutionScaler()
+{
+    budget_ms = 0.0;
+    min_scale = 1.f;
+    scale = 1.f;
+    avg_ms = -1.0;
+    cooldown = 0;
+}
+
+/*
+* Sets frame budget to hold
+* @param budget_ms: milliseconds of work allowed per frame, 0 turns scaling off and goes back to full resolution
+* @param min_scale: lowest fraction of the output size to render at, clamped to [RENDER_SCALE_STEP, 1]
+*/
+void ResolutionScaler::set_budget(double budget_ms, float min_scale)
+{
+    this->budget_ms = (budget_ms < 0.0) ? 0.0 : budget_ms;
+    min_scale = (min_scale < RENDER_SCALE_STEP) ? RENDER_SCALE_STEP : min_scale;
+    this->min_scale = (min_scale > 1.f) ? 1.f : min_scale;
+    if (this->budget_ms == 0.0)
+        scale = 1.f;
+    avg_ms = -1.0;
+    cooldown = 0;
+}
+
+/*
+* Feeds one frame's work time and gets the scale to render the next frames at
+* @param work_ms: time frame took before any pacing wait
+* @return: render scale in (0, 1]
+*/
+float ResolutionScaler::update(double work_ms)
+{
+    if (budget_ms == 0.0)
+        return scale;
+
+    avg_ms = (avg_ms < 0.0) ? work_ms : avg_ms * 0.9 + work_ms * 0.1;
+    if (cooldown > 0)
+    {
+        cooldown--;
+        return scale;
+    }
+
+    //over budget drops now, rising needs 20% headroom so it does not bounce right back
+    bool over = avg_ms > budget_ms;
+    bool under = avg_ms < budget_ms * 0.8;
+    if (!over && !under)
+        return scale;
+
+    float target = scale * (float)sqrt(budget_ms * 0.9 / avg_ms);
+    target = floorf(target / RENDER_SCALE_STEP) * RENDER_SCALE_STEP;
+    target = (target < min_scale) ? min_scale : ((target > 1.f) ? 1.f : target);
+    if (!over && target > scale + RENDER_SCALE_STEP * 2.f)
+        target = scale + RENDER_SCALE_STEP * 2.f;  //creep up, a bad guess up costs a slow frame
+    if (target == scale)
+        return scale;
+
+    //expect the smoothed time to follow the pixel count until new frames say otherwise
+    avg_ms *= (double)(target * target) / (double)(scale * scale);
+    scale = target;
+    cooldown = RENDER_SCALE_COOLDOWN;
+    return scale;
+}
+
+/*
+* Gets current render scale
+* @return: fraction of output size rendered
+*/
+float ResolutionScaler::get_scale() const
+{
+    return scale;
+}
+
+/*
+* Checks if scaling is on
+* @return: true if a budget is set
+*/
+bool ResolutionScaler::is_enabled() const
+{
+    return budget_ms > 0.0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <chrono>
+#include <stdint.h>
+
+constexpr int PACER_BUCKET_US = 100;  //width of each frame time histogram bucket
+constexpr int PACER_BUCKETS = 1000;  //buckets cover 0 to 100ms, the last one also counts longer frames
+
+//frame time summary since the histogram was last reset
+struct FrameTimes
+{
+	int frames;
+	double seconds;  //wall time covered
+	double p50, p95, p99, max;  //frame times in milliseconds, percentiles are rounded up to a bucket edge
+};
+
+//keeps frames to a fixed rate without burning a core
+//waits by sleeping until shortly before the deadline then spinning for the rest, the spin margin follows
+//	how late sleeps have been waking up so it stays as short as the os allows
+//deadlines advance by whole frame periods, so one slow frame does not push every later frame back
+//every frame time goes into a fixed histogram, so recording never allocates
+class FramePacer
+{
+public:
+	FramePacer();
+	~FramePacer();
+	FramePacer(const FramePacer&) = delete;
+	FramePacer& operator =(const FramePacer&) = delete;
+	void begin_frame();
+	void end_frame(int fps_cap);
+	void skip_frame();
+	void get_times(FrameTimes& times) const;
+	void reset_times();
+	double get_spin_margin() const;
+	double get_work_ms() const;
+private:
+	typedef std::chrono::steady_clock clock;
+	clock::time_point frame_start;
+	clock::time_point last_end;  //end of previous frame, frame times are measured between ends
+	clock::time_point deadline;  //end of current frame when capped
+	clock::time_point window_start;  //start of what the histogram covers
+	bool has_last;
+	double work_ms;  //time last frame spent before waiting for its deadline
+	int cap;  //cap the deadline was set for, 0 if uncapped
+	double oversleep_us;  //running estimate of how late sleeps wake up
+	void* timer;  //persistent high resolution waitable timer on windows, null elsewhere
+	uint32_t buckets[PACER_BUCKETS];
+	int frames;
+	double max_ms;
+
+	void wait_until(clock::time_point t);
+	void sleep_for_us(double us);
+	void record(double ms);
+};
+
+constexpr float RENDER_SCALE_STEP = 0.0625f;  //render scale moves in steps of this, so small jitter never reallocates buffers
+constexpr int RENDER_SCALE_COOLDOWN = 15;  //frames to hold a new scale before judging it
+
+//picks an internal render scale that keeps frame work inside a budget
+//fill cost follows pixel count, which goes with the square of the scale, so the scale moves by the square root
+//	of how far the smoothed frame time is from the budget
+//the scale drops as soon as frames run over, and only rises again once there is clear headroom
+class ResolutionScaler
+{
+public:
+	ResolutionScaler();
+	void set_budget(double budget_ms, float min_scale);
+	float update(double work_ms);
+	float get_scale() const;
+	bool is_enabled() const;
+private:
+	double budget_ms;  //0 if scaling is off
+	float min_scale;
+	float scale;
+	double avg_ms;  //smoothed frame work, negative until first frame
+	int cooldown;  //frames left before the scale may change again
+};
@@ -3,11 +3,16 @@
 */
 #ifdef _WINDOWS
 #include "window.hpp"
+#include "pacer.hpp"
 #include "../logger/logger.hpp"
+#include "../logger/stats.hpp"
 #include <Windows.h>
 #include <stdio.h>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #include <math.h>
 #include <stdlib.h>
 
@@ -30,7 +35,38 @@ volatile bool g_alive = false;
 volatile bool g_exit_error = false;
 volatile bool g_resize = false;
 
-static mutex _buf_lk;
+//swap chain
+//the render thread owns _back, the present thread owns _front when triple buffered,
+//	finished frames are handed over by swapping indices through _ready
+struct SwapBuffer
+{
+    COLOR* color;
+    float* depth;
+    uint8_t* dirty;  //one flag per tile, set if drawn to since this buffer was last cleared
+};
+static SwapBuffer _chain[MAX_SWAP_BUFFERS] = {};
+static uint32_t* _normals = NULL;  //packed normal of each pixel for deferred lighting, only read while drawing the frame that wrote it so one serves the whole chain
+static int _tiles_x = 0;  //tiles across a row of the buffer
+static int _tiles_y = 0;
+static int _num_buffers = 2;
+static int _back = 0;
+static int _front = 1;
+static int _last = -1;  //buffer holding the last presented frame, -1 until one is presented after reallocation
+static atomic<unsigned> _chain_id(0);  //bumped every time the buffers are reallocated
+static atomic<int> _ready(1);  //index of last completed frame, READY_NEW set until present thread takes it
+static atomic<int> _presenting(-1);  //buffer being read by present thread when double buffered, -1 if none
+constexpr int READY_NEW = 0x100;
+constexpr int READY_MASK = 0xFF;
+
+//present thread
+static thread _present_thread;
+static mutex _present_lk;  //only guards the wakeup, never held while drawing or presenting
+static condition_variable _present_cv;
+static bool _present_run = false;
+static bool _repaint = false;
+static mutex _chain_lk;  //held by present thread while reading a buffer and by reallocation, never by rendering
+static mutex _back_lk;  //held while drawing to the back buffer and by reallocation, taken before _chain_lk
+static PresentSink _sink = NULL;
 
 static volatile bool _draw_locked = false;
 
@@ -40,67 +76,200 @@ static WNDCLASS _wnd_class;
 
 static int _buf_width = -1;
 static int _buf_height = -1;
+static int _client_width = -1;  //output size, the buffers are this times _render_scale
+static int _client_height = -1;
+static float _render_scale = 1.f;
+static ResolutionScaler _scaler;
 
-static int _frames = -1;
-static FILETIME _start_frame_time = { 0 };
-static FILETIME _start_total_time = { 0 };
 
-static COLOR* _buf = NULL;  //heap allocated array of uint32 for each pixel on screen to hold color value
-static float* _z_buf = NULL;  //z buffer
 static BITMAPINFO _bmp_info;
 
 /*************************************************************************************
 * Getters for private vals to be used in draw.cpp (avoiding file clutter)
+* Buffers returned are always the back buffer currently being rendered to
 *************************************************************************************/
 bool get_draw_locked() { return _draw_locked; }
 int get_buf_width() { return _buf_width; }
 int get_buf_height() { return _buf_height; }
-COLOR* get_buf() { return _buf; }
-float* get_z_buf() { return _z_buf; }
+COLOR* get_buf() { return _chain[_back].color; }
+float* get_z_buf() { return _chain[_back].depth; }
+uint32_t* get_normal_buf() { return _normals; }
+int get_num_buffers() { return _num_buffers; }
+unsigned get_chain_id() { return _chain_id.load(); }
 
 /*
-* Resize operations
+* Frees every buffer in swap chain
+* Chain lock must be held if present thread is running
 */
-static bool resize(int width, int height)
+static void free_chain()
 {
-    log(DEBUG1, "resize");
+    for (int i = 0; i < MAX_SWAP_BUFFERS; i++)
+    {
+        free(_chain[i].color);
+        free(_chain[i].depth);
+        free(_chain[i].dirty);
+        _chain[i].color = NULL;
+        _chain[i].depth = NULL;
+        _chain[i].dirty = NULL;
+    }
+    free(_normals);
+    _normals = NULL;
+}
 
-    //aquire lock so buffer not modified or cleared while resizing
-    _buf_lk.lock();
+/*
+* Allocates color and depth buffer pair for each buffer in swap chain at current size, and the normal buffer
+* Chain lock must be held if present thread is running
+* @return false if allocation failed
+*/
+static bool alloc_chain()
+{
+    free_chain();
+    size_t size = (size_t)_buf_height * (size_t)_buf_width;
+    _tiles_x = (_buf_width + CLEAR_TILE - 1) / CLEAR_TILE;
+    _tiles_y = (_buf_height + CLEAR_TILE - 1) / CLEAR_TILE;
+    for (int i = 0; i < _num_buffers; i++)
+    {
+        _chain[i].color = (COLOR*)calloc(size, sizeof(COLOR));
+        _chain[i].depth = (float*)malloc(size * sizeof(float));
+        _chain[i].dirty = (uint8_t*)calloc((size_t)_tiles_x * (size_t)_tiles_y, 1);
+        if (_chain[i].color == NULL || _chain[i].depth == NULL || _chain[i].dirty == NULL)
+        {
+            log(ERR, "Failed to heap allocate window buffer");
+            return false;
+        }
 
-    //assume width and height are for buffer
-    _buf_width = width;
-    _buf_height = height;
+        //new buffers start cleared, so nothing is dirty
+        depth_fill(_chain[i].depth, size, 1.f);
+    }
 
-    //reallocate buffer
-    free(_buf);
-    free(_z_buf);
-    _buf = (COLOR*)calloc((size_t)_buf_height * (size_t)_buf_width, sizeof(COLOR));
-    _z_buf = (float*)malloc((size_t)_buf_height * (size_t)_buf_width * sizeof(float));
-    if (_buf == NULL || _z_buf == NULL)
+    _normals = (uint32_t*)malloc(size * sizeof(uint32_t));
+    if (_normals == NULL)
     {
-        log(ERR, "Failed to heap allocate window buffer");
-        _buf_lk.unlock();
+        log(ERR, "Failed to heap allocate normal buffer");
         return false;
     }
 
-    //very annoying but have to manually set all values to float 1.0, but compiler will optimize
-    for (size_t i = 0; i < (size_t)_buf_height * (size_t)_buf_width; i++)
+    //reset ownership, nothing new to present yet
+    _back = 0;
+    _front = _num_buffers - 1;
+    _last = -1;
+    _chain_id++;
+    _ready = (_num_buffers == 2) ? _front : 1;
+    _presenting = -1;
+    return true;
+}
+
+/*
+* Resize operations
+* Buffers are the client size scaled by the render scale, presentation stretches them back up
+* @param width: client width
+* @param height: client height
+*/
+static bool resize(int width, int height)
+{
+    log(DEBUG1, "resize");
+
+    //aquire locks so buffers are not being drawn or presented while replaced
+    _back_lk.lock();
+    _chain_lk.lock();
+
+    _client_width = width;
+    _client_height = height;
+    width = (int)(width * _render_scale + 0.5f);
+    height = (int)(height * _render_scale + 0.5f);
+    _buf_width = (width < 1) ? 1 : width;
+    _buf_height = (height < 1) ? 1 : height;
+
+    //reallocate buffers
+    if (!alloc_chain())
     {
-        _z_buf[i] = 1.f;
+        _chain_lk.unlock();
+        _back_lk.unlock();
+        return false;
     }
 
     //modify bitmap
-    _bmp_info.bmiHeader.biHeight = -height;
-    _bmp_info.bmiHeader.biWidth = width;
+    _bmp_info.bmiHeader.biHeight = -_buf_height;
+    _bmp_info.bmiHeader.biWidth = _buf_width;
 
     //unlock and return success
-    _buf_lk.unlock();
+    _chain_lk.unlock();
+    _back_lk.unlock();
     g_resize = true;
     return true;
 }
 
 
+/*
+* Copies front buffer to window, or hands it to sink if one is set
+* Takes newest completed frame if there is one, otherwise shows the last one again
+* Runs on present thread
+*/
+static void present()
+{
+    //keep buffers from being reallocated while reading
+    lock_guard<mutex> lk(_chain_lk);
+    if (_chain[0].color == NULL)
+    {
+        log(ERR, "buffer not allocated");
+        g_exit_error = true;
+        PostMessage(_handle, WM_DESTROY, 0, 0);
+        return;
+    }
+
+    int idx;
+    if (_num_buffers == 2)
+    {
+        //mark buffer as being read before render thread can swap it back, retry if it swapped in between
+        do
+        {
+            idx = _ready.load() & READY_MASK;
+            _presenting.store(idx);
+        } while ((_ready.load() & READY_MASK) != idx);
+        int expected = idx | READY_NEW;
+        _ready.compare_exchange_strong(expected, idx);
+    }
+    else
+    {
+        //trade front buffer for newest completed one
+        if (_ready.load() & READY_NEW)
+            _front = _ready.exchange(_front) & READY_MASK;
+        idx = _front;
+    }
+
+    if (_sink != NULL)
+        _sink(_chain[idx].color, _buf_width, _buf_height);
+    else
+    {
+        RECT wsize;
+        GetClientRect(_handle, &wsize);
+        StretchDIBits(_win_hDC, 0, 0, wsize.right, wsize.bottom, 0, 0, _buf_width, _buf_height, _chain[idx].color, &_bmp_info, DIB_RGB_COLORS, SRCCOPY);
+    }
+
+    if (_num_buffers == 2)
+        _presenting.store(-1);
+}
+
+/*
+* Present thread loop, sleeps until a frame is completed or window needs repainting
+*/
+static void present_loop()
+{
+    log(DEBUG1, "present thread started");
+    while (1)
+    {
+        {
+            unique_lock<mutex> lk(_present_lk);
+            _present_cv.wait(lk, [] { return !_present_run || _repaint || (_ready.load() & READY_NEW); });
+            if (!_present_run)
+                break;
+            _repaint = false;
+        }
+        present();
+    }
+    log(DEBUG1, "present thread stopped");
+}
+
 /*
 * Defines functionality for window events
 */
@@ -117,23 +286,13 @@ LRESULT CALLBACK window_proc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
     case WM_PAINT:
     {
-        //aquire lock
-        _buf_lk.lock();
-        if (_buf == NULL)
+        //presentation happens on present thread, just ask it to show the front buffer again
         {
-            log(ERR, "buffer not allocated");
-            g_exit_error = true;
-            _buf_lk.unlock();
-            SendMessage(_handle, WM_DESTROY, 0, 0);
-            return 0;
+            lock_guard<mutex> lk(_present_lk);
+            _repaint = true;
         }
-
-        RECT wsize;
-        GetClientRect(hwnd, &wsize);
-        StretchDIBits(_win_hDC, 0, 0, wsize.right, wsize.bottom, 0, 0, _buf_width, _buf_height, _buf, &_bmp_info, DIB_RGB_COLORS, SRCCOPY);
+        _present_cv.notify_one();
         ValidateRect(_handle, NULL);
-        //release lock
-        _buf_lk.unlock();
     }
     return 0;
     case WM_SIZE:
@@ -249,6 +408,8 @@ int create_window(const char* name, int width, int height)
 
     _buf_width = rect.right - rect.left;
     _buf_height = rect.bottom - rect.top;
+    _client_width = _buf_width;
+    _client_height = _buf_height;
     log(DEBUG1, "width: " + to_string(_buf_width) + "|height: " + to_string(_buf_height));
 
     //create window handle
@@ -268,19 +429,9 @@ int create_window(const char* name, int width, int height)
         return 1;
     }
 
-    //allocate space for client area buffer
-    _buf = (COLOR*)calloc((size_t)_buf_height * (size_t)_buf_width, sizeof(COLOR));
-    _z_buf = (float*)malloc((size_t)_buf_height * (size_t)_buf_width * sizeof(float));
-    if (_buf == NULL || _z_buf == NULL)
-    {
-        log(ERR, "Failed to heap allocate window buffer");
+    //allocate swap chain for client area
+    if (!alloc_chain())
         return 1;
-    }
-    //very annoying but have to manually set all values to float 1.0, but compiler will optimize
-    for (size_t i = 0; i < (size_t)_buf_height * (size_t)_buf_width; i++)
-    {
-        _z_buf[i] = 1.f;
-    }
 
     //allocate bitmap for buffer
     memset(&_bmp_info, 0, sizeof(BITMAPINFO));
@@ -292,6 +443,13 @@ int create_window(const char* name, int width, int height)
 
     _win_hDC = GetDC(_handle);
 
+    //buffers below output size are stretched up with the cheapest filter, nearest pixel
+    SetStretchBltMode(_win_hDC, COLORONCOLOR);
+
+    //start presenting before window is shown so first paint has somewhere to go
+    _present_run = true;
+    _present_thread = thread(present_loop);
+
     ShowWindow(_handle, SW_SHOW);
     UpdateWindow(_handle);
 
@@ -301,14 +459,104 @@ int create_window(const char* name, int width, int height)
 }
 
 /*
-* Sends paint message to window
+* Sets number of buffers in swap chain
+* 2 lets rendering of the next frame overlap presenting the last one
+* 3 also lets rendering continue while a frame is waiting to be presented
+* Must not be called while holding draw lock, contents of every buffer are lost
+* @param count: number of buffers, clamped to [2, MAX_SWAP_BUFFERS]
+* @return 0 on success, 1 if buffers could not be allocated
 */
-void window_update()
+int window_set_buffers(int count)
 {
-    MSG msg;
+    count = (count < 2) ? 2 : (count > MAX_SWAP_BUFFERS) ? MAX_SWAP_BUFFERS : count;
+    log(DEBUG1, "swap chain buffers: " + to_string(count));
+
+    lock_guard<mutex> back_lk(_back_lk);
+    lock_guard<mutex> lk(_chain_lk);
+    _num_buffers = count;
+    return alloc_chain() ? 0 : 1;
+}
+
+/*
+* Sets size buffers are rendered at as a fraction of the client size
+* Presentation stretches the image back to the client size
+* Must not be called while holding draw lock, contents of every buffer are lost if the size changes
+* @param scale: fraction of client width and height, clamped to (0, 1]
+* @return 0 on success, 1 if buffers could not be allocated
+*/
+int window_set_render_scale(float scale)
+{
+    scale = (scale <= 0.f) ? RENDER_SCALE_STEP : ((scale > 1.f) ? 1.f : scale);
+    if (scale == _render_scale)
+        return 0;
+    _render_scale = scale;
+    stats_set("render scale", scale);
+    if (_client_width <= 0 || _client_height <= 0)
+        return 0;
+    log(DEBUG1, "render scale " + to_string(scale));
+    return resize(_client_width, _client_height) ? 0 : 1;
+}
+
+/*
+* Gets fraction of the client size buffers are rendered at
+*/
+float window_get_render_scale()
+{
+    return _render_scale;
+}
+
+/*
+* Sets frame budget the render scale is adjusted to hold
+* Scale is checked at the end of each frame in window_sync_end
+* @param budget_ms: milliseconds of work allowed per frame, 0 renders at full size
+* @param min_scale: lowest render scale allowed
+*/
+void window_set_frame_budget(double budget_ms, float min_scale)
+{
+    _scaler.set_budget(budget_ms, min_scale);
+    if (!_scaler.is_enabled())
+        window_set_render_scale(1.f);
+}
+
+/*
+* Sets function that receives presented frames instead of window
+* Called on present thread with front buffer, buffer must not be kept after returning
+* @param sink: function to call, NULL to present to window again
+*/
+void window_set_sink(PresentSink sink)
+{
+    lock_guard<mutex> lk(_chain_lk);
+    _sink = sink;
+}
+
+/*
+* Hands finished back buffer to present thread
+* Returns as soon as a free back buffer is available, which is immediately when triple buffered
+*   and once the present thread is done reading the previous frame when double buffered
+* Hold draw lock when drawing on a thread other than the window's, so a resize cannot happen mid handoff
+*/
+void window_present()
+{
+    log(DEBUG1, "Presenting");
+    _last = _back;
+    _back = _ready.exchange(_back | READY_NEW) & READY_MASK;
+    {
+        lock_guard<mutex> lk(_present_lk);
+    }
+    _present_cv.notify_one();
 
-    log(DEBUG1, "Painting");
-    SendMessage(_handle, WM_PAINT, 0, 0);
+    //double buffered, wait until buffer that came back is no longer on screen
+    while (_presenting.load() == _back)
+        this_thread::yield();
+}
+
+/*
+* Processes window messages
+* Must be called on thread that created window
+*/
+void window_poll()
+{
+    MSG msg;
 
     while (PeekMessage(&msg, _handle, 0, 0, PM_REMOVE))
     {
@@ -318,35 +566,161 @@ void window_update()
 }
 
 /*
-* Clear buffer to only black
+* Sleeps until a window message arrives or the timeout passes, for loops with nothing to draw
+* @param timeout_ms: longest time to wait
+*/
+void window_wait_events(int timeout_ms)
+{
+    MsgWaitForMultipleObjects(0, NULL, FALSE, (DWORD)timeout_ms, QS_ALLINPUT);
+}
+
+/*
+* Presents back buffer and processes window messages
+*/
+void window_update()
+{
+    window_present();
+    window_poll();
+}
+
+/*
+* Clear back buffer to only black
+* Only tiles drawn to since this buffer was last cleared are reset, so the cost follows what was drawn
+*   rather than the resolution, if most of the buffer is dirty it is cleared whole with streaming stores
+* Draw lock should be held, back buffer is never read by presentation so this does not wait on it
 */
 void window_clear()
 {
-    //aquire lock to make sure resizing cannot occur during modification
-    _buf_lk.lock();
     log(DEBUG1, "clearing window");
-    if (_buf == NULL || _z_buf == NULL)
+    COLOR* buf = _chain[_back].color;
+    float* z_buf = _chain[_back].depth;
+    uint8_t* dirty = _chain[_back].dirty;
+    if (buf == NULL || z_buf == NULL || dirty == NULL)
     {
         log(ERR, "buffer not allocated");
         g_exit_error = true;
-        _buf_lk.unlock();
         SendMessage(_handle, WM_DESTROY, 0, 0);
         return;
     }
 
-    memset((void*)_buf, 0, (size_t)_buf_width * (size_t)_buf_height * sizeof(COLOR));
-    //very annoying but have to manually set all values to float 1.0, but compiler will optimize
-    for (size_t i = 0; i < (size_t)_buf_height * (size_t)_buf_width; i++)
+    int num_tiles = _tiles_x * _tiles_y;
+    int num_dirty = 0;
+    for (int i = 0; i < num_tiles; i++)
+        num_dirty += dirty[i];
+    stats_set("cleared tiles", (double)num_dirty);
+    if (num_dirty == 0)
+        return;
+
+    //mostly dirty, one long fill is cheaper than many short ones
+    if (num_dirty * 2 > num_tiles)
+    {
+        color_fill(buf, (size_t)_buf_width * (size_t)_buf_height, COLOR());
+        depth_fill(z_buf, (size_t)_buf_width * (size_t)_buf_height, 1.f);
+        memset(dirty, 0, (size_t)num_tiles);
+        return;
+    }
+
+    //clear each run of dirty tiles along a row of tiles one pixel row at a time
+    for (int ty = 0; ty < _tiles_y; ty++)
+    {
+        uint8_t* row = dirty + ty * _tiles_x;
+        int y_begin = ty * CLEAR_TILE;
+        int y_end = (y_begin + CLEAR_TILE < _buf_height) ? y_begin + CLEAR_TILE : _buf_height;
+        int tx = 0;
+        while (tx < _tiles_x)
+        {
+            if (!row[tx])
+            {
+                tx++;
+                continue;
+            }
+            int run = tx;
+            while (run < _tiles_x && row[run])
+                row[run++] = 0;
+
+            int x_begin = tx * CLEAR_TILE;
+            int x_end = (run * CLEAR_TILE < _buf_width) ? run * CLEAR_TILE : _buf_width;
+            for (int y = y_begin; y < y_end; y++)
+            {
+                size_t start = (size_t)y * (size_t)_buf_width + (size_t)x_begin;
+                color_fill(buf + start, (size_t)(x_end - x_begin), COLOR());
+                depth_fill(z_buf + start, (size_t)(x_end - x_begin), 1.f);
+            }
+            tx = run;
+        }
+    }
+}
+
+/*
+* Starts back buffer as a copy of the last presented frame with a span of rows cleared, so only those rows
+*   need to be drawn again
+* Only color is copied, depth outside the span is never read since nothing is drawn there
+* Draw lock should be held, the last frame is only read so presentation may show it at the same time
+* @param y_lo: first row to clear
+* @param y_hi: last row to clear, below y_lo clears nothing
+* @return false if no frame was presented since the buffers were allocated, the caller must draw everything
+*/
+bool window_reuse_frame(int y_lo, int y_hi)
+{
+    if (_last < 0 || _last == _back || _chain[_back].color == NULL)
+        return false;
+
+    y_lo = (y_lo < 0) ? 0 : y_lo;
+    y_hi = (y_hi >= _buf_height) ? _buf_height - 1 : y_hi;
+    COLOR* buf = _chain[_back].color;
+    float* z_buf = _chain[_back].depth;
+    const COLOR* last = _chain[_last].color;
+    size_t row = (size_t)_buf_width;
+    for (int y = 0; y < _buf_height; y++)
     {
-        _z_buf[i] = 1.f;
+        if (y >= y_lo && y <= y_hi)
+        {
+            color_fill(buf + y * row, row, COLOR());
+            depth_fill(z_buf + y * row, row, 1.f);
+        }
+        else
+            memcpy(buf + y * row, last + y * row, row * sizeof(COLOR));
     }
 
-    //unlock and return succeess
-    _buf_lk.unlock();
+    //copied rows carry whatever the last frame drew, cleared rows keep their flags until drawn and cleared again
+    uint8_t* dirty = _chain[_back].dirty;
+    const uint8_t* last_dirty = _chain[_last].dirty;
+    for (int i = 0; i < _tiles_x * _tiles_y; i++)
+        dirty[i] |= last_dirty[i];
+
+    stats_set("redrawn rows", (y_hi >= y_lo) ? (double)(y_hi - y_lo + 1) : 0.0);
+    return true;
+}
+
+/*
+* Records that a rectangle of the back buffer was drawn to, so the next clear of this buffer resets it
+* Parts outside the buffer are ignored
+* Rows of tiles are only touched by the caller marking them, so draws over different rows of tiles
+*   may mark at the same time
+* @param x_min: left edge, inclusive
+* @param y_min: top edge, inclusive
+* @param x_max: right edge, inclusive
+* @param y_max: bottom edge, inclusive
+*/
+void mark_dirty(int x_min, int y_min, int x_max, int y_max)
+{
+    x_min = (x_min < 0) ? 0 : x_min;
+    y_min = (y_min < 0) ? 0 : y_min;
+    x_max = (x_max >= _buf_width) ? _buf_width - 1 : x_max;
+    y_max = (y_max >= _buf_height) ? _buf_height - 1 : y_max;
+    if (x_min > x_max || y_min > y_max)
+        return;
+
+    uint8_t* dirty = _chain[_back].dirty;
+    int tx0 = x_min / CLEAR_TILE;
+    int tx1 = x_max / CLEAR_TILE;
+    for (int ty = y_min / CLEAR_TILE; ty <= y_max / CLEAR_TILE; ty++)
+        memset(dirty + ty * _tiles_x + tx0, 1, (size_t)(tx1 - tx0 + 1));
 }
 
 /*
-* Locks buffer from being changed while getting next frame
+* Locks back buffer from being reallocated while getting next frame
+* Present thread only reads completed buffers, so this does not block presentation
 * It is up to user to use properly
 */
 void draw_lock()
@@ -354,7 +728,7 @@ void draw_lock()
     log(DEBUG1, "locking for draw");
     if (!_draw_locked)
     {
-        _buf_lk.lock();
+        _back_lk.lock();
         _draw_locked = true;
     }
     else
@@ -365,8 +739,8 @@ void draw_unlock()
     log(DEBUG1, "unlocking for draw");
     if (_draw_locked)
     {
-        _buf_lk.unlock();
         _draw_locked = false;
+        _back_lk.unlock();
     }
     else
         log(WARNING, "attempted to unlock untaken draw lock");
@@ -378,86 +752,88 @@ void draw_unlock()
 void window_remove()
 {
     log(DEBUG1, "freeing window");
+
+    //stop present thread before its buffers go away
+    {
+        lock_guard<mutex> lk(_present_lk);
+        _present_run = false;
+    }
+    _present_cv.notify_one();
+    if (_present_thread.joinable())
+        _present_thread.join();
+
     ReleaseDC(_handle, _win_hDC);
     DestroyWindow(_handle);
-    free(_buf);
+    free_chain();
+}
+
+/*
+* Gets frame pacer, made on first use so its timer is created after logging is up
+*/
+static FramePacer& pacer()
+{
+    static FramePacer p;
+    return p;
 }
 
 /*
-* Sync window with rasterizer
+* Start window sync
 */
 void window_sync_begin()
 {
     log(DEBUG1, "sync begin");
-    GetSystemTimePreciseAsFileTime(&_start_frame_time);
-
-    if (_start_total_time.dwHighDateTime == 0 && _start_total_time.dwLowDateTime == 0)
-        _start_total_time = _start_frame_time;
+    pacer().begin_frame();
 }
 
 /*
-* Sleep window to sync to max fps
+* End window sync for a frame that drew nothing
+* Frame is not counted toward frame times or fps and does not change the render scale
 */
-static void window_sleep(long long time)
+void window_sync_skip()
 {
-    log(DEBUG1, "sleeping window");
-    HANDLE timer;
-    LARGE_INTEGER ft;
-
-    ft.QuadPart = -(10 * time);
-
-    timer = CreateWaitableTimer(NULL, TRUE, NULL);
-    if (timer == 0)
-    {
-        printf("Call to CreateWaitableTimer failed.\n");
-        exit(1);
-    }
-
-    SetWaitableTimer(timer, &ft, 0, NULL, NULL, 0);
-    WaitForSingleObject(timer, INFINITE);
-    CloseHandle(timer);
+    log(DEBUG1, "sync skip");
+    pacer().skip_frame();
 }
 
 /*
 * End window sync
+* Waits out the rest of the frame when capped, then once a second prints fps
+*   along with frame time percentiles of that second
+* A render scale change reallocates the buffers, which bumps get_chain_id
+* @param fps_cap: frames per second to hold, 0 uncaps
+* @param print_fps: print fps and stats once a second
 */
 void window_sync_end(int fps_cap, bool print_fps)
 {
     log(DEBUG1, "sync end");
+    pacer().end_frame(fps_cap);
 
-    FILETIME ft;
-    ULARGE_INTEGER start_frame_time;
-    ULARGE_INTEGER current_frame_time;
-    ULARGE_INTEGER start_total_time;
-
-    GetSystemTimePreciseAsFileTime(&ft);
-
-    start_frame_time.LowPart = _start_frame_time.dwLowDateTime;
-    start_frame_time.HighPart = _start_frame_time.dwHighDateTime;
-
-    current_frame_time.LowPart = ft.dwLowDateTime;
-    current_frame_time.HighPart = ft.dwHighDateTime;
-
-    start_total_time.LowPart = _start_total_time.dwLowDateTime;
-    start_total_time.HighPart = _start_total_time.dwHighDateTime;
+    //lower or raise internal resolution to keep frame work inside the budget
+    if (_scaler.is_enabled())
+    {
+        float scale = _scaler.update(pacer().get_work_ms());
+        if (scale != _render_scale && window_set_render_scale(scale) != 0)
+        {
+            g_exit_error = true;
+            SendMessage(_handle, WM_DESTROY, 0, 0);
+        }
+    }
 
-    //check if capping fps
-    if (fps_cap != 0)
-        window_sleep((1000000 / fps_cap) - ((current_frame_time.QuadPart - start_frame_time.QuadPart) / 10));
-        
+    FrameTimes times;
+    pacer().get_times(times);
+    if (times.seconds < 1.0)
+        return;
+    pacer().reset_times();
     if (!print_fps)
         return;
 
-    if (_frames < 0)
-        _frames = 1;
-    else
-        _frames++;
-
-    if (current_frame_time.QuadPart - start_total_time.QuadPart >= 10000000) //1 second
-    {
-        printf("fps: %d\n", _frames);
-        _start_total_time = ft;
-        _frames = 0;
-    }
+    stats_set("frame p50 ms", times.p50);
+    stats_set("frame p95 ms", times.p95);
+    stats_set("frame p99 ms", times.p99);
+    stats_set("frame max ms", times.max);
+    if (fps_cap > 0)
+        stats_set("pacer spin ms", pacer().get_spin_margin());
+    printf("fps: %d\n", (int)(times.frames / times.seconds + 0.5));
+    stats_print();
 }
 #endif
\ No newline at end of file
@@ -41,6 +41,10 @@ struct COLOR
 	inline COLOR operator /(const int& i)   const { return COLOR(floorf(R / i), floorf(G / i), floorf(B / i)); }
 	inline COLOR operator *(const float& f) const { return COLOR(floorf(R * f), floorf(G * f), floorf(B * f)); }
 };
+typedef void (*PresentSink)(const COLOR* buf, int width, int height);
+constexpr int MAX_SWAP_BUFFERS = 3;
+constexpr int CLEAR_TILE = 32;  //side of the square tiles clears are tracked in, raster bands must be whole rows of tiles
+
 enum PIX_RET
 {
 	SUCCESS,
@@ -57,14 +61,27 @@ int get_buf_width();
 int get_buf_height();
 COLOR* get_buf();
 float* get_z_buf();
+uint32_t* get_normal_buf();
+int get_num_buffers();
+unsigned get_chain_id();
 
 //window creation/deletion
 int create_window(const char* name, int width, int height);
 void window_remove();
+int window_set_buffers(int count);
+int window_set_render_scale(float scale);
+float window_get_render_scale();
+void window_set_frame_budget(double budget_ms, float min_scale);
+void window_set_sink(PresentSink sink);
 
 //window update
 void window_update();
+void window_present();
+void window_poll();
+void window_wait_events(int timeout_ms);
 void window_clear();
+bool window_reuse_frame(int y_lo, int y_hi);
+void mark_dirty(int x_min, int y_min, int x_max, int y_max);
 
 //buffer modification
 PIX_RET get_pixel(int x, int y, COLOR& color, float& depth);
@@ -75,6 +92,7 @@ void draw_unlock();
 //window sync
 void window_sync_begin();
 void window_sync_end(int fps_cap, bool print_fps);
+void window_sync_skip();
 
 //draw.cpp
 struct PIXEL //struct to hold pixel info
@@ -101,4 +119,49 @@ void fill_triangle(int x0, int y0, float z0,
 	int x1, int y1, float z1,
 	int x2, int y2, float z2, 
 	COLOR color0, COLOR color1, COLOR color2);
+void fill_triangle(int x0, int y0, float z0,
+	int x1, int y1, float z1,
+	int x2, int y2, float z2,
+	COLOR color0, COLOR color1, COLOR color2,
+	int y_lo, int y_hi);
+
+//which part of a frame a triangle fill draws
+//a depth prepass frame fills every triangle's depth first, then colors only pixels whose depth
+//	matches the buffer exactly, so each visible pixel is colored once however much is drawn over it
+typedef enum fill_pass {
+	PASS_FULL = 0,  //depth and color together
+	PASS_DEPTH = 1,  //depth only, always depth tested
+	PASS_SHADE = 2  //color only, where depth equals the buffer
+} FILL_PASS;
+
+//raster features fixed for a whole draw, each combination runs its own compiled inner loop
+//	so nothing inside a line or triangle checks them per pixel
+struct RasterState
+{
+	bool depth_test;  //skip pixels behind what is already in the depth buffer
+	bool interpolate;  //blend vertex colors across the shape, else the first color fills all of it
+	FILL_PASS pass;  //fills only
+	bool gbuffer;  //fills only, colors are unlit and each pixel's normal goes to the normal buffer for deferred lighting
+
+	RasterState() { depth_test = true; interpolate = true; pass = PASS_FULL; gbuffer = false; }
+	RasterState(bool depth_test, bool interpolate) { this->depth_test = depth_test; this->interpolate = interpolate; pass = PASS_FULL; gbuffer = false; }
+	RasterState(bool depth_test, bool interpolate, FILL_PASS pass) { this->depth_test = depth_test; this->interpolate = interpolate; this->pass = pass; gbuffer = false; }
+	RasterState(bool depth_test, bool interpolate, FILL_PASS pass, bool gbuffer) { this->depth_test = depth_test; this->interpolate = interpolate; this->pass = pass; this->gbuffer = gbuffer; }
+};
+typedef void (*LineFunc)(int x0, int y0, float z0, int x1, int y1, float z1, COLOR color0, COLOR color1);
+//fill functions return how many pixels they drew over ones already drawn since the last clear
+//normals are the packed normal of each vertex, only read by G-buffer fills
+typedef int (*FillFunc)(int x0, int y0, float z0,
+	int x1, int y1, float z1,
+	int x2, int y2, float z2,
+	COLOR color0, COLOR color1, COLOR color2,
+	const uint32_t* normals, int y_lo, int y_hi);
+LineFunc get_line_func(RasterState state);
+FillFunc get_fill_func(RasterState state);
+
+//triangle coverage and depth clears run on kernels picked from the cpu tier
+void raster_bind();
+const char* raster_level();
+void depth_fill(float* z_buf, size_t n, float value);
+void color_fill(COLOR* buf, size_t n, COLOR color);
 #endif
\ No newline at end of file